@@ -5,10 +5,12 @@
 #include "contiki.h"
 #include "contiki-net.h"
 #include "lib/sensors.h"
+#include "lib/random.h"
 
 #include "lwm2m_core.h"
 #include "lwm2m_bootstrap.h"
 #include "lwm2m_registration.h"
+#include "lwm2m_server_object.h"
 #include "lwm2m_connectivity.h"
 #include "lwm2m_security.h"
 #include "lwm2m_device.h"
@@ -18,46 +20,532 @@
 #include "lwm2m_object_defs.h"
 #include "lwm2m_types.h"
 #include "motion-sensor.h"
+#include "duty-cycle.h"
+#include "heap-stats.h"
+#include "object-defs.h"
+#include "nvm-store.h"
 #include "dev/leds.h"
 
 #define BOOTSTRAP_SERVER_URL          "coap://[fe80::1]:15685"
 #define COAP_PORT                     6000
-#define ENDPOINT_NAME                 "ButtonDevice"
+#define ENDPOINT_PREFIX               "MotionSensor"
 #define LOG_LEVEL                     DebugLevel_Debug
 
-#define BUTTON_OBJECT_STR             "Digital Input"
-#define BUTTON_RESOURCE_STR           "button"
+/* IPSO Presence sensor */
+#define PRESENCE_OBJECT_STR           "Presence"
+#define PRESENCE_OBJECT_ID            3302
+#define PRESENCE_OBJECT_INSTANCE_ID   0
 
-#define BUTTON_OBJECT_ID              3200
-#define BUTTON_OBJECT_INSTANCE_ID     0
-#define BUTTON_RESOURCE_ID            5560
-#define BUTTON_RESOURCE_INSTANCE_ID   0
+#define STATE_RESOURCE_STR            "Digital Input State"
+#define STATE_RESOURCE_ID             5500
+#define COUNTER_RESOURCE_STR          "Digital Input Counter"
+#define COUNTER_RESOURCE_ID           5501
+#define TIMESTAMP_RESOURCE_STR        "Timestamp"
+#define TIMESTAMP_RESOURCE_ID         5518
+#define HOLDOFF_RESOURCE_STR          "Busy to Clear delay"
+#define HOLDOFF_RESOURCE_ID           5903
 
+/* Energest power accounting, vendor object */
+#define POWER_OBJECT_STR              "Power"
+#define POWER_OBJECT_ID               20002
+#define POWER_OBJECT_INSTANCE_ID      0
+
+#define CPU_RESOURCE_STR              "CPU Time"
+#define CPU_RESOURCE_ID               0
+#define LPM_RESOURCE_STR              "Low Power Time"
+#define LPM_RESOURCE_ID               1
+#define LISTEN_RESOURCE_STR           "Listen Time"
+#define LISTEN_RESOURCE_ID            2
+#define TRANSMIT_RESOURCE_STR         "Transmit Time"
+#define TRANSMIT_RESOURCE_ID          3
+#define CHARGE_RESOURCE_STR           "Charge"
+#define CHARGE_RESOURCE_ID            4
+#define TICK_RATE_RESOURCE_STR        "Tick Rate"
+#define TICK_RATE_RESOURCE_ID         5
+
+/* The power object changes all the time, so it is only written this often */
+#define POWER_INTERVAL                (300 * CLOCK_SECOND)
+
+/* Vacancy is reported after this long without motion, in ms */
+#define HOLDOFF_DEFAULT_MS            10000
+
+/* LwM2M Server object, Default Minimum and Maximum Period in seconds */
+#define SERVER_OBJECT_ID              1
+#define SERVER_OBJECT_INSTANCE_ID     0
+#define SERVER_PMIN_RESOURCE_ID       2
+#define SERVER_PMAX_RESOURCE_ID       3
+
+/*
+ * Fast join: once bootstrapped, the LwM2M server account is kept in flash
+ * and later boots register with it directly. They first wait a random part
+ * of JOIN_JITTER, so a building of sensors powering up together does not
+ * reach the gateway at once. Build with FAST_JOIN=1.
+ */
+#ifndef LWM2M_CONF_FAST_JOIN
+#define LWM2M_CONF_FAST_JOIN          0
+#endif
+#define JOIN_JITTER                   (10 * CLOCK_SECOND)
+
+/* LwM2M Security and Server resources of the server account */
+#define SECURITY_OBJECT_ID            0
+#define SECURITY_URI_RESOURCE_ID      0
+#define SECURITY_BOOTSTRAP_RESOURCE_ID 1
+#define SECURITY_MODE_RESOURCE_ID     2
+#define SECURITY_IDENTITY_RESOURCE_ID 3
+#define SECURITY_SECRET_RESOURCE_ID   5
+#define SECURITY_SHORT_ID_RESOURCE_ID 10
+#define SERVER_SHORT_ID_RESOURCE_ID   0
+#define SERVER_LIFETIME_RESOURCE_ID   1
+#define SERVER_STORING_RESOURCE_ID    6
+#define SERVER_BINDING_RESOURCE_ID    7
+#define ACCOUNT_MAX_INSTANCES         4  /* Instance IDs searched for the account */
+
+/* How often the CPU and radio duty cycle is printed */
+#define DUTY_CYCLE_INTERVAL           (60 * CLOCK_SECOND)
+
+static char endpoint[sizeof(ENDPOINT_PREFIX) + 2 * LINKADDR_SIZE + 1];
 static int button = 0;
+static int motion = 0;
+static int64_t holdoff_ms = HOLDOFF_DEFAULT_MS;
+static int64_t motion_count = 0;          /* Motion onsets since boot */
+static int64_t last_motion = 0;           /* Uptime in seconds of the last edge, no wall clock */
+static struct etimer holdoff;
+static int reported = 0;                  /* State as last written to the store */
+static clock_time_t last_report = 0;
+static struct etimer pmin_timer;
+static struct etimer pmax_timer;
+static struct etimer power_timer;
+#if LWM2M_CONF_FAST_JOIN
+static int account_saved = 0;
+
+/* LwM2M server account as written by the bootstrap server */
+typedef struct {
+  char uri[64];
+  char binding[4];
+  int64_t mode;
+  int64_t short_id;
+  int64_t lifetime;
+  uint8_t identity[32];
+  uint8_t secret[32];
+  uint8_t identity_len;
+  uint8_t secret_len;
+} server_account_t;
+#endif
 PROCESS(lwm2m_button_client, "LWM2M Button Client");
 
 AUTOSTART_PROCESSES(&lwm2m_button_client);
 
+/*---------------------------------------------------------------------------*/
+/*
+ * Every node runs the same image, the endpoint name tells them apart:
+ * MotionSensor<NODE_ID> when built with one, else MotionSensor-<EUI-64>.
+ * Simulated nodes on the native target take their ID from MOTION_NODE_ID.
+ */
+static const char *
+endpoint_name(void)
+{
+#if CONTIKI_TARGET_NATIVE
+  const char *node = getenv("MOTION_NODE_ID");
+
+  if(node != NULL) {
+    snprintf(endpoint, sizeof(endpoint), ENDPOINT_PREFIX "%s", node);
+    return endpoint;
+  }
+#endif
+#ifdef NODE_ID
+  snprintf(endpoint, sizeof(endpoint), ENDPOINT_PREFIX "%u", (unsigned)NODE_ID);
+#else
+  char *p = endpoint + sprintf(endpoint, ENDPOINT_PREFIX "-");
+  int i;
+
+  for(i = 0; i < LINKADDR_SIZE; i++) {
+    p += sprintf(p, "%02x", linkaddr_node_addr.u8[i]);
+  }
+#endif
+
+  return endpoint;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Objects of this application, registered after the standard ones */
+#define POWER_RESOURCE_DEF(name, id) \
+  RESOURCE_DEF(name, POWER_OBJECT_ID, id, ResourceTypeEnum_TypeInteger, \
+    MultipleInstancesEnum_Single, MandatoryEnum_Mandatory, Operations_R)
+static const object_def_t motion_object_defs[] = {
+  OBJECT_DEF(PRESENCE_OBJECT_STR, PRESENCE_OBJECT_ID,
+    MultipleInstancesEnum_Multiple, MandatoryEnum_Mandatory),
+  RESOURCE_DEF(STATE_RESOURCE_STR, PRESENCE_OBJECT_ID, STATE_RESOURCE_ID,
+    ResourceTypeEnum_TypeBoolean, MultipleInstancesEnum_Single,
+    MandatoryEnum_Mandatory, Operations_R),
+  RESOURCE_DEF(COUNTER_RESOURCE_STR, PRESENCE_OBJECT_ID, COUNTER_RESOURCE_ID,
+    ResourceTypeEnum_TypeInteger, MultipleInstancesEnum_Single,
+    MandatoryEnum_Optional, Operations_R),
+  RESOURCE_DEF(TIMESTAMP_RESOURCE_STR, PRESENCE_OBJECT_ID, TIMESTAMP_RESOURCE_ID,
+    ResourceTypeEnum_TypeTime, MultipleInstancesEnum_Single,
+    MandatoryEnum_Optional, Operations_R),
+  RESOURCE_DEF(HOLDOFF_RESOURCE_STR, PRESENCE_OBJECT_ID, HOLDOFF_RESOURCE_ID,
+    ResourceTypeEnum_TypeInteger, MultipleInstancesEnum_Single,
+    MandatoryEnum_Optional, Operations_RW),
+
+  OBJECT_DEF(POWER_OBJECT_STR, POWER_OBJECT_ID,
+    MultipleInstancesEnum_Single, MandatoryEnum_Optional),
+  POWER_RESOURCE_DEF(CPU_RESOURCE_STR, CPU_RESOURCE_ID),
+  POWER_RESOURCE_DEF(LPM_RESOURCE_STR, LPM_RESOURCE_ID),
+  POWER_RESOURCE_DEF(LISTEN_RESOURCE_STR, LISTEN_RESOURCE_ID),
+  POWER_RESOURCE_DEF(TRANSMIT_RESOURCE_STR, TRANSMIT_RESOURCE_ID),
+  POWER_RESOURCE_DEF(CHARGE_RESOURCE_STR, CHARGE_RESOURCE_ID),
+  POWER_RESOURCE_DEF(TICK_RATE_RESOURCE_STR, TICK_RATE_RESOURCE_ID),
+};
+
+/*---------------------------------------------------------------------------*/
+static void
+set_power_resource(ObjectStore *store, int resource, int64_t value)
+{
+  ObjectStore_SetResourceInstanceValue(store, POWER_OBJECT_ID,
+    POWER_OBJECT_INSTANCE_ID, resource, 0, &value, sizeof(value));
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Cumulative Energest ticks per state since boot, and the charge they are
+ * estimated to have drawn in uAh. The charge is written last, it is what
+ * the gateway observes.
+ */
+static void
+update_power_object(ObjectStore *store)
+{
+  duty_cycle_t times;
+
+  duty_cycle_read(&times);
+
+  set_power_resource(store, TICK_RATE_RESOURCE_ID, RTIMER_SECOND);
+  set_power_resource(store, CPU_RESOURCE_ID, times.cpu);
+  set_power_resource(store, LPM_RESOURCE_ID, times.lpm);
+  set_power_resource(store, LISTEN_RESOURCE_ID, times.listen);
+  set_power_resource(store, TRANSMIT_RESOURCE_ID, times.transmit);
+  set_power_resource(store, CHARGE_RESOURCE_ID, duty_cycle_charge(&times));
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+set_resource(ObjectStore *store, ResourceIDType resource, void *value, int len)
+{
+  ObjectStore_SetResourceInstanceValue(store, PRESENCE_OBJECT_ID,
+    PRESENCE_OBJECT_INSTANCE_ID, resource, 0, value, len);
+}
+
 /*---------------------------------------------------------------------------*/
 static void
-register_button_object(ObjectStore *store)
+setup_presence_object(ObjectStore *store)
+{
+  set_resource(store, STATE_RESOURCE_ID, &button, sizeof(button));
+  set_resource(store, COUNTER_RESOURCE_ID, &motion_count, sizeof(motion_count));
+  set_resource(store, TIMESTAMP_RESOURCE_ID, &last_motion, sizeof(last_motion));
+  set_resource(store, HOLDOFF_RESOURCE_ID, &holdoff_ms, sizeof(holdoff_ms));
+}
+
+/*---------------------------------------------------------------------------*/
+/* Read an integer resource the server may have written, or fall back */
+static int64_t
+get_integer(ObjectStore *store, int object, int instance, int resource,
+  int64_t fallback)
+{
+  const void *value = NULL;
+  int len = 0;
+  int64_t result = fallback;
+
+  if(ObjectStore_GetResourceInstanceValue(store, object, instance, resource, 0,
+    &value, &len) >= 0 && value != NULL && len == sizeof(result)) {
+    memcpy(&result, value, sizeof(result));
+  }
+
+  return result;
+}
+
+/*---------------------------------------------------------------------------*/
+static clock_time_t
+holdoff_period(ObjectStore *store)
+{
+  holdoff_ms = get_integer(store, PRESENCE_OBJECT_ID, PRESENCE_OBJECT_INSTANCE_ID,
+    HOLDOFF_RESOURCE_ID, holdoff_ms);
+  if(holdoff_ms < 0) {
+    holdoff_ms = 0;
+  }
+
+  return (clock_time_t)((holdoff_ms * CLOCK_SECOND) / 1000);
+}
+
+/*---------------------------------------------------------------------------*/
+static clock_time_t
+server_period(ObjectStore *store, int resource)
+{
+  int64_t seconds = get_integer(store, SERVER_OBJECT_ID,
+    SERVER_OBJECT_INSTANCE_ID, resource, 0);
+
+  return (clock_time_t)((seconds < 0) ? 0 : seconds * CLOCK_SECOND);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Write the state to the store, and so to the radio. Motion since the last
+ * write is aggregated into the counter and timestamp, which go out with it.
+ * The next heartbeat is due pmax after this.
+ */
+static void
+publish_presence(ObjectStore *store)
+{
+  clock_time_t pmax = server_period(store, SERVER_PMAX_RESOURCE_ID);
+
+  reported = button;
+  last_report = clock_time();
+
+  set_resource(store, COUNTER_RESOURCE_ID, &motion_count, sizeof(motion_count));
+  set_resource(store, TIMESTAMP_RESOURCE_ID, &last_motion, sizeof(last_motion));
+  set_resource(store, STATE_RESOURCE_ID, &button, sizeof(button));
+
+  if(pmax > 0) {
+    etimer_set(&pmax_timer, pmax);
+  } else {
+    etimer_stop(&pmax_timer);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Changes within pmin of the last write are held back and go out together
+ * when pmin has passed, unless the state has come back by then.
+ */
+static void
+report_presence(ObjectStore *store, int value)
+{
+  clock_time_t pmin = server_period(store, SERVER_PMIN_RESOURCE_ID);
+  clock_time_t since = clock_time() - last_report;
+
+  button = value;
+
+  if(button == reported || !etimer_expired(&pmin_timer)) {
+    return;
+  }
+
+  if(since >= pmin) {
+    publish_presence(store);
+  } else {
+    etimer_set(&pmin_timer, pmin - since);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Lwm2mCore_Process returns the time in ms until it next has work to do */
+static clock_time_t
+lwm2m_wakeup(int wait_ms)
 {
-  ObjectStore_RegisterObjectType(store, BUTTON_OBJECT_STR, BUTTON_OBJECT_ID,
-    MultipleInstancesEnum_Multiple, MandatoryEnum_Mandatory);
-  ObjectStore_RegisterResourceType(store, BUTTON_RESOURCE_STR,
-    BUTTON_OBJECT_ID, BUTTON_RESOURCE_ID, ResourceTypeEnum_TypeBoolean,
-    MultipleInstancesEnum_Multiple, MandatoryEnum_Mandatory, Operations_RW);
+  clock_time_t ticks = ((clock_time_t)wait_ms * CLOCK_SECOND) / 1000;
+
+  return (ticks > 0) ? ticks : 1;
+}
+
+#if LWM2M_CONF_FAST_JOIN
+/*---------------------------------------------------------------------------*/
+/* Copy a resource value, returns its length or -1 if missing or too long */
+static int
+get_value(ObjectStore *store, int object, int instance, int resource,
+  void *buffer, int size)
+{
+  const void *value = NULL;
+  int len = 0;
+
+  if(ObjectStore_GetResourceInstanceValue(store, object, instance, resource, 0,
+    &value, &len) < 0 || value == NULL || len > size) {
+    return -1;
+  }
+
+  memcpy(buffer, value, len);
+  return len;
 }
 
 /*---------------------------------------------------------------------------*/
 static void
-setup_button_object(ObjectStore *store)
+set_value(ObjectStore *store, int object, int instance, int resource,
+  const void *value, int len)
+{
+  ObjectStore_SetResourceInstanceValue(store, object, instance, resource, 0,
+    (void *)value, len);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Find the server account the bootstrap server has written, 0 if found */
+static int
+read_account(ObjectStore *store, server_account_t *account)
+{
+  int security, server;
+  int len;
+  uint8_t bootstrap;
+
+  memset(account, 0, sizeof(*account));
+
+  for(security = 0; security < ACCOUNT_MAX_INSTANCES; security++) {
+    bootstrap = 1;
+    len = get_value(store, SECURITY_OBJECT_ID, security,
+      SECURITY_URI_RESOURCE_ID, account->uri, sizeof(account->uri) - 1);
+
+    if(len > 0 && get_value(store, SECURITY_OBJECT_ID, security,
+      SECURITY_BOOTSTRAP_RESOURCE_ID, &bootstrap, sizeof(bootstrap)) > 0 &&
+      !bootstrap) {
+      break;
+    }
+  }
+
+  if(security == ACCOUNT_MAX_INSTANCES) {
+    return -1;
+  }
+
+  account->uri[len] = '\0';
+  account->mode = get_integer(store, SECURITY_OBJECT_ID, security,
+    SECURITY_MODE_RESOURCE_ID, 0);
+  account->short_id = get_integer(store, SECURITY_OBJECT_ID, security,
+    SECURITY_SHORT_ID_RESOURCE_ID, 0);
+
+  len = get_value(store, SECURITY_OBJECT_ID, security,
+    SECURITY_IDENTITY_RESOURCE_ID, account->identity, sizeof(account->identity));
+  account->identity_len = (len > 0) ? len : 0;
+  len = get_value(store, SECURITY_OBJECT_ID, security,
+    SECURITY_SECRET_RESOURCE_ID, account->secret, sizeof(account->secret));
+  account->secret_len = (len > 0) ? len : 0;
+
+  for(server = 0; server < ACCOUNT_MAX_INSTANCES; server++) {
+    if(get_integer(store, SERVER_OBJECT_ID, server,
+      SERVER_SHORT_ID_RESOURCE_ID, -1) == account->short_id) {
+      account->lifetime = get_integer(store, SERVER_OBJECT_ID, server,
+        SERVER_LIFETIME_RESOURCE_ID, 0);
+      len = get_value(store, SERVER_OBJECT_ID, server,
+        SERVER_BINDING_RESOURCE_ID, account->binding, sizeof(account->binding) - 1);
+      account->binding[(len > 0) ? len : 0] = '\0';
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* First instance ID of an object that holds no instance yet */
+static int
+free_instance(ObjectStore *store, int object, int resource)
+{
+  const void *value = NULL;
+  int len = 0;
+  int instance;
+
+  for(instance = 0; instance < ACCOUNT_MAX_INSTANCES; instance++) {
+    if(ObjectStore_GetResourceInstanceValue(store, object, instance, resource,
+      0, &value, &len) < 0) {
+      return instance;
+    }
+  }
+  return -1;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Put the account kept in flash next to the bootstrap account, so the
+ * client registers with it without bootstrapping. The bootstrap account
+ * stays for when the server no longer accepts it.
+ */
+static int
+fast_join_restore(ObjectStore *store)
 {
-  ObjectStore_SetResourceInstanceValue(store, BUTTON_OBJECT_ID,
-    BUTTON_OBJECT_INSTANCE_ID, BUTTON_RESOURCE_ID, BUTTON_RESOURCE_INSTANCE_ID,
-    &button, sizeof(button));
+  server_account_t account;
+  int security, server;
+  uint8_t no = 0;
+
+  if(nvm_store_read(&account, sizeof(account)) != 0) {
+    return 0;
+  }
+
+  security = free_instance(store, SECURITY_OBJECT_ID, SECURITY_URI_RESOURCE_ID);
+  server = free_instance(store, SERVER_OBJECT_ID, SERVER_SHORT_ID_RESOURCE_ID);
+
+  if(security < 0 || server < 0 ||
+    ObjectStore_CreateObjectInstance(store, SECURITY_OBJECT_ID, security) < 0 ||
+    ObjectStore_CreateObjectInstance(store, SERVER_OBJECT_ID, server) < 0) {
+    return 0;
+  }
+
+  set_value(store, SECURITY_OBJECT_ID, security, SECURITY_URI_RESOURCE_ID,
+    account.uri, strlen(account.uri));
+  set_value(store, SECURITY_OBJECT_ID, security, SECURITY_BOOTSTRAP_RESOURCE_ID,
+    &no, sizeof(no));
+  set_value(store, SECURITY_OBJECT_ID, security, SECURITY_MODE_RESOURCE_ID,
+    &account.mode, sizeof(account.mode));
+  set_value(store, SECURITY_OBJECT_ID, security, SECURITY_IDENTITY_RESOURCE_ID,
+    account.identity, account.identity_len);
+  set_value(store, SECURITY_OBJECT_ID, security, SECURITY_SECRET_RESOURCE_ID,
+    account.secret, account.secret_len);
+  set_value(store, SECURITY_OBJECT_ID, security, SECURITY_SHORT_ID_RESOURCE_ID,
+    &account.short_id, sizeof(account.short_id));
+
+  set_value(store, SERVER_OBJECT_ID, server, SERVER_SHORT_ID_RESOURCE_ID,
+    &account.short_id, sizeof(account.short_id));
+  set_value(store, SERVER_OBJECT_ID, server, SERVER_LIFETIME_RESOURCE_ID,
+    &account.lifetime, sizeof(account.lifetime));
+  set_value(store, SERVER_OBJECT_ID, server, SERVER_STORING_RESOURCE_ID,
+    &no, sizeof(no));
+  set_value(store, SERVER_OBJECT_ID, server, SERVER_BINDING_RESOURCE_ID,
+    account.binding, strlen(account.binding));
+
+  printf("Fast join to %s\n", account.uri);
+  return 1;
 }
 
+/*---------------------------------------------------------------------------*/
+/* Whether the client holds a registration with the server of this short ID */
+static int
+registered(Lwm2mContextType *context, int short_id)
+{
+  struct ListHead *i;
+
+  ListForEach(i, Lwm2mCore_GetServerList(context)) {
+    LWM2MServerType *server = ListEntry(i, LWM2MServerType, list);
+
+    if(server->ShortServerID == short_id &&
+      server->RegistrationState == Lwm2mRegistrationState_Registered) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Keep the account once the server has accepted a registration with it, so
+ * an account the bootstrap server wrote but the server refuses is never
+ * used for fast join. Flash is only written when the account changed.
+ */
+static int
+fast_join_save(Lwm2mContextType *context)
+{
+  server_account_t account, saved;
+
+  if(read_account(context->Store, &account) != 0 ||
+    !registered(context, account.short_id)) {
+    return 0;
+  }
+
+  if(nvm_store_read(&saved, sizeof(saved)) == 0 &&
+    memcmp(&account, &saved, sizeof(account)) == 0) {
+    return 1;
+  }
+
+  if(nvm_store_write(&account, sizeof(account)) != 0) {
+    printf("Saving the server account failed\n");
+    return 0;
+  }
+
+  printf("Server account %s saved for fast join\n", account.uri);
+  return 1;
+}
+#endif /* LWM2M_CONF_FAST_JOIN */
+
 /*---------------------------------------------------------------------------*/
 static Lwm2mContextType*
 lwm2m_client_start()
@@ -67,16 +555,26 @@ lwm2m_client_start()
   Lwm2m_PrintBanner();
 
   CoapInfo* coap = coap_Init("0.0.0.0", COAP_PORT, LOG_LEVEL);
-  Lwm2mContextType *context = Lwm2mCore_Init(coap, ENDPOINT_NAME, NULL);
+  Lwm2mContextType *context = Lwm2mCore_Init(coap, (char *)endpoint_name(), NULL);
 
   /* Construct Object Tree */
   Lwm2m_Debug("Construct object tree\n");
+#if LWM2M_CONF_FULL_OBJECT_SET
   Lwm2m_RegisterObjectTypes(context->Store);
-  register_button_object(context->Store);
+#else
+  object_defs_register(context->Store, object_defs_core, object_defs_core_count);
+#endif
+  object_defs_register(context->Store, motion_object_defs,
+    sizeof(motion_object_defs) / sizeof(motion_object_defs[0]));
 
   LWM2M_example_security(context->Store, BOOTSTRAP_SERVER_URL);
+#if LWM2M_CONF_FAST_JOIN
+  fast_join_restore(context->Store);
+#endif
   LWM2M_device_example(context->Store);
-  setup_button_object(context->Store);
+  setup_presence_object(context->Store);
+  update_power_object(context->Store);
+  heap_stats_print("after object store setup");
 
   return context;
 }
@@ -89,31 +587,80 @@ PROCESS_THREAD(lwm2m_button_client, ev, data)
   static Lwm2mContextType *context;
   int wait_time;
 
+#if CONTIKI_TARGET_NATIVE
+  /* The native platform's main does not know the simulated sensor */
+  SENSORS_ACTIVATE(motion_sensor);
+#endif
+
   context = lwm2m_client_start();
 
-  /* Define application-specific events here. */
+#if LWM2M_CONF_FAST_JOIN
+  random_init(linkaddr_node_addr.u8[LINKADDR_SIZE - 2] << 8 |
+    linkaddr_node_addr.u8[LINKADDR_SIZE - 1]);
+  etimer_set(&et, random_rand() % JOIN_JITTER);
+  PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+
+  /* Edges during the wait were not seen */
+  motion = motion_sensor.value(0);
+  if(motion) {
+    motion_count++;
+    last_motion = clock_seconds();
+    button = 1;
+  }
+#endif
+
+  publish_presence(context->Store);
+  duty_cycle_start(DUTY_CYCLE_INTERVAL);
+  etimer_set(&power_timer, POWER_INTERVAL);
+
+  /*
+   * Sleep until the earliest of the next LwM2M deadline, a CoAP packet for
+   * our socket, a motion edge or one of our own timers. In between the main
+   * loop idles the CPU and the RDC keeps the radio off.
+   */
   while(1) {
     wait_time = Lwm2mCore_Process(context);
-    etimer_set(&et, (wait_time * CLOCK_SECOND) / 100);
-
-    PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et) || (ev == sensors_event));
-    
-    if(data == &motion_sensor)
-	{
-		printf("Sensor active\n");
-		if(motion_sensor.value(0) == 1) 
-		{
-			button = 1;
-		}
-		else
-		{
-		 	button = 0;
-		}
-		
-		ObjectStore_SetResourceInstanceValue(context->Store, BUTTON_OBJECT_ID,
-        BUTTON_OBJECT_INSTANCE_ID, BUTTON_RESOURCE_ID,
-        BUTTON_RESOURCE_INSTANCE_ID, &button, sizeof(button));
-	}
+    etimer_set(&et, lwm2m_wakeup(wait_time));
+
+#if LWM2M_CONF_FAST_JOIN
+    if(!account_saved) {
+      account_saved = fast_join_save(context);
+    }
+#endif
+
+    PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et) || (ev == sensors_event) ||
+      (ev == tcpip_event) || (ev == PROCESS_EVENT_TIMER && (data == &holdoff ||
+        data == &pmin_timer || data == &pmax_timer ||
+        data == &power_timer)));
+
+    if(ev == sensors_event && data == &motion_sensor) {
+      motion = motion_sensor.value(0);
+
+      /* Either edge bounds a period of motion */
+      last_motion = clock_seconds();
+
+      /* Occupied is reported at once, vacant only after the hold-off without motion */
+      if(motion) {
+        motion_count++;
+        etimer_stop(&holdoff);
+        report_presence(context->Store, 1);
+      } else if(button) {
+        etimer_set(&holdoff, holdoff_period(context->Store));
+      }
+    } else if(ev == PROCESS_EVENT_TIMER && data == &holdoff && !motion) {
+      report_presence(context->Store, 0);
+    } else if(ev == PROCESS_EVENT_TIMER && data == &pmin_timer) {
+      if(button != reported) {
+        publish_presence(context->Store);
+      }
+    } else if(ev == PROCESS_EVENT_TIMER && data == &pmax_timer) {
+      /* Heartbeat, the server hears the unchanged state at least every pmax */
+      publish_presence(context->Store);
+    } else if(ev == PROCESS_EVENT_TIMER && data == &power_timer) {
+      etimer_reset(&power_timer);
+      update_power_object(context->Store);
+      heap_stats_print("periodic");
+    }
   }
 
   PROCESS_END();
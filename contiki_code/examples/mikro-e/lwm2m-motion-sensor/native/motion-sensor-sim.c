@@ -0,0 +1,109 @@
+#include "motion-sensor.h"
+#include <contiki.h>
+#include <lib/sensors.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static FILE* trace = NULL;
+static unsigned long next_ms;
+static int next_level;
+
+static int motion_status_value = 0;
+static int _motion_value = 0;
+static rtimer_clock_t _motion_time = 0;
+
+PROCESS(motion_process, "Motion sensor");
+
+static int motion_configure(int type, int value)
+{
+	switch(type)
+	{
+		case SENSORS_HW_INIT:
+		return 1;
+
+		case SENSORS_ACTIVE:
+		if(value)
+		{
+			motion_status_value = 1;
+			process_start(&motion_process, NULL);
+		}
+		else
+		{
+			process_exit(&motion_process);
+			motion_status_value = 0;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static int motion_status(int type)
+{
+	return motion_status_value;
+}
+
+static int motion_value(int type)
+{
+	if(type == MOTION_VALUE_EDGE_TIME)
+	{
+		return (int)_motion_time;
+	}
+
+	return _motion_value;
+}
+
+static int read_edge(void)
+{
+	return fscanf(trace, "%lu %d", &next_ms, &next_level) == 2;
+}
+
+PROCESS_THREAD(motion_process, ev, data)
+{
+	static struct etimer edge;
+	static clock_time_t start;
+	static const char* path;
+	clock_time_t due;
+
+	PROCESS_EXITHANDLER(if(trace) { fclose(trace); trace = NULL; });
+	PROCESS_BEGIN();
+
+	path = getenv(MOTION_TRACE_ENV);
+
+	if(path == NULL || (trace = fopen(path, "r")) == NULL)
+	{
+		printf("No motion trace, set %s to replay one\n", MOTION_TRACE_ENV);
+		PROCESS_EXIT();
+	}
+
+	start = clock_time();
+
+	while(read_edge())
+	{
+		due = start + (clock_time_t)((next_ms * CLOCK_SECOND) / 1000);
+
+		if((long)(due - clock_time()) > 0)
+		{
+			etimer_set(&edge, due - clock_time());
+			PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&edge));
+		}
+
+		/* Like the pin, only a change of level is an edge */
+		if(!!next_level != _motion_value)
+		{
+			_motion_value = !!next_level;
+			_motion_time = RTIMER_NOW();
+			printf("Motion %i replayed at %lums\n", _motion_value, next_ms);
+
+			/* Not in the native platform's SENSORS() list, so post as sensors_process would */
+			process_post(PROCESS_BROADCAST, sensors_event, (void*)&motion_sensor);
+		}
+	}
+
+	printf("Motion trace %s done\n", path);
+	fclose(trace);
+	trace = NULL;
+
+	PROCESS_END();
+}
+
+SENSORS_SENSOR(motion_sensor, MOTION_SENSOR_NAME, motion_value, motion_configure, motion_status);
@@ -0,0 +1,20 @@
+#ifndef __MOTION_SENSOR_H__
+#define __MOTION_SENSOR_H__
+
+#include "lib/sensors.h"
+
+/*
+ * Simulated PIR for the native target, same interface as the mikro-e driver.
+ * It replays the trace file named by the MOTION_TRACE environment variable,
+ * one edge per line: <ms since the sensor was activated> <level>.
+ */
+#define MOTION_TRACE_ENV "MOTION_TRACE"
+
+/* value() type for the RTIMER_NOW() time of the last level change */
+#define MOTION_VALUE_EDGE_TIME 1
+
+#define MOTION_SENSOR_NAME "MotionSensor"
+
+extern const struct sensors_sensor motion_sensor;
+
+#endif
@@ -0,0 +1,90 @@
+#include "object-defs.h"
+
+#define SINGLE      MultipleInstancesEnum_Single
+#define MULTIPLE    MultipleInstancesEnum_Multiple
+#define MANDATORY   MandatoryEnum_Mandatory
+#define OPTIONAL    MandatoryEnum_Optional
+
+/*
+ * OMA LwM2M 1.0 objects 0 to 3. Keep them in step with what
+ * Lwm2m_RegisterObjectTypes() defines for LWM2M_CONF_FULL_OBJECT_SET builds.
+ * The SMS binding resources of Security (6 to 9) are left out, the client
+ * only binds over UDP.
+ */
+const object_def_t object_defs_core[] = {
+  OBJECT_DEF("LWM2MSecurity", 0, MULTIPLE, MANDATORY),
+  RESOURCE_DEF("LWM2MServerURI", 0, 0, ResourceTypeEnum_TypeString, SINGLE, MANDATORY, Operations_None),
+  RESOURCE_DEF("BootstrapServer", 0, 1, ResourceTypeEnum_TypeBoolean, SINGLE, MANDATORY, Operations_None),
+  RESOURCE_DEF("SecurityMode", 0, 2, ResourceTypeEnum_TypeInteger, SINGLE, MANDATORY, Operations_None),
+  RESOURCE_DEF("PublicKeyorIDentity", 0, 3, ResourceTypeEnum_TypeOpaque, SINGLE, MANDATORY, Operations_None),
+  RESOURCE_DEF("ServerPublicKeyorIDentity", 0, 4, ResourceTypeEnum_TypeOpaque, SINGLE, MANDATORY, Operations_None),
+  RESOURCE_DEF("SecretKey", 0, 5, ResourceTypeEnum_TypeOpaque, SINGLE, MANDATORY, Operations_None),
+  RESOURCE_DEF("ShortServerID", 0, 10, ResourceTypeEnum_TypeInteger, SINGLE, OPTIONAL, Operations_None),
+  RESOURCE_DEF("ClientHoldOffTime", 0, 11, ResourceTypeEnum_TypeInteger, SINGLE, OPTIONAL, Operations_None),
+
+  OBJECT_DEF("LWM2MServer", 1, MULTIPLE, MANDATORY),
+  RESOURCE_DEF("ShortServerID", 1, 0, ResourceTypeEnum_TypeInteger, SINGLE, MANDATORY, Operations_R),
+  RESOURCE_DEF("Lifetime", 1, 1, ResourceTypeEnum_TypeInteger, SINGLE, MANDATORY, Operations_RW),
+  RESOURCE_DEF("DefaultMinimumPeriod", 1, 2, ResourceTypeEnum_TypeInteger, SINGLE, OPTIONAL, Operations_RW),
+  RESOURCE_DEF("DefaultMaximumPeriod", 1, 3, ResourceTypeEnum_TypeInteger, SINGLE, OPTIONAL, Operations_RW),
+  RESOURCE_DEF("Disable", 1, 4, ResourceTypeEnum_TypeNone, SINGLE, OPTIONAL, Operations_E),
+  RESOURCE_DEF("DisableTimeout", 1, 5, ResourceTypeEnum_TypeInteger, SINGLE, OPTIONAL, Operations_RW),
+  RESOURCE_DEF("NotificationStoringWhenDisabledorOffline", 1, 6, ResourceTypeEnum_TypeBoolean, SINGLE, MANDATORY, Operations_RW),
+  RESOURCE_DEF("Binding", 1, 7, ResourceTypeEnum_TypeString, SINGLE, MANDATORY, Operations_RW),
+  RESOURCE_DEF("RegistrationUpdateTrigger", 1, 8, ResourceTypeEnum_TypeNone, SINGLE, MANDATORY, Operations_E),
+
+  /* The bootstrap server may write these, and the core checks access against them */
+  OBJECT_DEF("LWM2MAccessControl", 2, MULTIPLE, OPTIONAL),
+  RESOURCE_DEF("ObjectID", 2, 0, ResourceTypeEnum_TypeInteger, SINGLE, MANDATORY, Operations_R),
+  RESOURCE_DEF("ObjectInstanceID", 2, 1, ResourceTypeEnum_TypeInteger, SINGLE, MANDATORY, Operations_R),
+  RESOURCE_DEF("ACL", 2, 2, ResourceTypeEnum_TypeInteger, MULTIPLE, OPTIONAL, Operations_RW),
+  RESOURCE_DEF("AccessControlOwner", 2, 3, ResourceTypeEnum_TypeInteger, SINGLE, MANDATORY, Operations_RW),
+
+  OBJECT_DEF("Device", 3, SINGLE, MANDATORY),
+  RESOURCE_DEF("Manufacturer", 3, 0, ResourceTypeEnum_TypeString, SINGLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("ModelNumber", 3, 1, ResourceTypeEnum_TypeString, SINGLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("SerialNumber", 3, 2, ResourceTypeEnum_TypeString, SINGLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("FirmwareVersion", 3, 3, ResourceTypeEnum_TypeString, SINGLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("Reboot", 3, 4, ResourceTypeEnum_TypeNone, SINGLE, MANDATORY, Operations_E),
+  RESOURCE_DEF("FactoryReset", 3, 5, ResourceTypeEnum_TypeNone, SINGLE, OPTIONAL, Operations_E),
+  RESOURCE_DEF("AvailablePowerSources", 3, 6, ResourceTypeEnum_TypeInteger, MULTIPLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("PowerSourceVoltage", 3, 7, ResourceTypeEnum_TypeInteger, MULTIPLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("PowerSourceCurrent", 3, 8, ResourceTypeEnum_TypeInteger, MULTIPLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("BatteryLevel", 3, 9, ResourceTypeEnum_TypeInteger, SINGLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("MemoryFree", 3, 10, ResourceTypeEnum_TypeInteger, SINGLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("ErrorCode", 3, 11, ResourceTypeEnum_TypeInteger, MULTIPLE, MANDATORY, Operations_R),
+  RESOURCE_DEF("ResetErrorCode", 3, 12, ResourceTypeEnum_TypeNone, SINGLE, OPTIONAL, Operations_E),
+  RESOURCE_DEF("CurrentTime", 3, 13, ResourceTypeEnum_TypeTime, SINGLE, OPTIONAL, Operations_RW),
+  RESOURCE_DEF("UTCOffset", 3, 14, ResourceTypeEnum_TypeString, SINGLE, OPTIONAL, Operations_RW),
+  RESOURCE_DEF("Timezone", 3, 15, ResourceTypeEnum_TypeString, SINGLE, OPTIONAL, Operations_RW),
+  RESOURCE_DEF("SupportedBindingandModes", 3, 16, ResourceTypeEnum_TypeString, SINGLE, MANDATORY, Operations_R),
+  RESOURCE_DEF("DeviceType", 3, 17, ResourceTypeEnum_TypeString, SINGLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("HardwareVersion", 3, 18, ResourceTypeEnum_TypeString, SINGLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("SoftwareVersion", 3, 19, ResourceTypeEnum_TypeString, SINGLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("BatteryStatus", 3, 20, ResourceTypeEnum_TypeInteger, SINGLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("MemoryTotal", 3, 21, ResourceTypeEnum_TypeInteger, SINGLE, OPTIONAL, Operations_R),
+  RESOURCE_DEF("ExtDevInfo", 3, 22, ResourceTypeEnum_TypeObjectLink, MULTIPLE, OPTIONAL, Operations_R),
+};
+
+const int object_defs_core_count = sizeof(object_defs_core) / sizeof(object_defs_core[0]);
+
+/*---------------------------------------------------------------------------*/
+void
+object_defs_register(ObjectStore *store, const object_def_t *defs, int count)
+{
+  int i;
+
+  for(i = 0; i < count; i++) {
+    const object_def_t *def = &defs[i];
+
+    if(def->resource == OBJECT_DEF_OBJECT) {
+      ObjectStore_RegisterObjectType(store, (char *)def->name, def->object,
+        def->multiple, def->mandatory);
+    } else {
+      ObjectStore_RegisterResourceType(store, (char *)def->name, def->object,
+        def->resource, def->type, def->multiple, def->mandatory,
+        def->operations);
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
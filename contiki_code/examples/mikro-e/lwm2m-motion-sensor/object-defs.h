@@ -0,0 +1,41 @@
+#ifndef __OBJECT_DEFS_H__
+#define __OBJECT_DEFS_H__
+
+#include "lwm2m_object_store.h"
+#include "lwm2m_types.h"
+
+/*
+ * Only the objects the motion client uses are defined, from constant tables
+ * that stay in flash. Build with -DLWM2M_CONF_FULL_OBJECT_SET=1 to register
+ * every standard object instead.
+ */
+#ifndef LWM2M_CONF_FULL_OBJECT_SET
+#define LWM2M_CONF_FULL_OBJECT_SET    0
+#endif
+
+/* Resource of a row that defines the object itself, rather than a resource */
+#define OBJECT_DEF_OBJECT             -1
+
+typedef struct {
+  const char *name;
+  int object;
+  int resource;
+  int type;
+  int multiple;
+  int mandatory;
+  int operations;
+} object_def_t;
+
+#define OBJECT_DEF(name, object, multiple, mandatory) \
+  { name, object, OBJECT_DEF_OBJECT, 0, multiple, mandatory, 0 }
+#define RESOURCE_DEF(name, object, resource, type, multiple, mandatory, operations) \
+  { name, object, resource, type, multiple, mandatory, operations }
+
+/* Rows are registered in order, each object row before its resources */
+void object_defs_register(ObjectStore *store, const object_def_t *defs, int count);
+
+/* Security, Server, Access Control and Device */
+extern const object_def_t object_defs_core[];
+extern const int object_defs_core_count;
+
+#endif /* __OBJECT_DEFS_H__ */
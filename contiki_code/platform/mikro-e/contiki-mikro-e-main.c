@@ -35,6 +35,7 @@
 #include <pic32.h>
 #include <pic32_clock.h>
 #include <dev/watchdog.h>
+#include <sys/energest.h>
 #include <platform-init.h>
 #include <debug-uart.h>
 #include <pic32_irq.h>
@@ -57,6 +58,8 @@ main(int argc, char **argv)
   pic32_init();
   watchdog_init();
   clock_init();
+  energest_init();
+  ENERGEST_ON(ENERGEST_TYPE_CPU);
   leds_init();
   platform_init();
 
@@ -82,7 +85,12 @@ main(int argc, char **argv)
       r = process_run();
     } while(r > 0);
     watchdog_stop();
+    /* Time until the next interrupt is accounted as low power */
+    ENERGEST_OFF(ENERGEST_TYPE_CPU);
+    ENERGEST_ON(ENERGEST_TYPE_LPM);
     asm volatile("wait");
+    ENERGEST_OFF(ENERGEST_TYPE_LPM);
+    ENERGEST_ON(ENERGEST_TYPE_CPU);
     watchdog_start();
   }
 
@@ -0,0 +1,99 @@
+#include "duty-cycle.h"
+#include "sys/energest.h"
+#include <stdio.h>
+
+static clock_time_t interval;
+static duty_cycle_t total;
+static unsigned long last[ENERGEST_TYPE_MAX];
+
+PROCESS(duty_cycle_process, "Duty cycle");
+
+/*---------------------------------------------------------------------------*/
+/* Ticks in a state since the last read; the difference survives one wrap */
+static unsigned long
+elapsed(int type)
+{
+  unsigned long now = energest_type_time(type);
+  unsigned long delta = now - last[type];
+
+  last[type] = now;
+  return delta;
+}
+/*---------------------------------------------------------------------------*/
+void
+duty_cycle_read(duty_cycle_t *now)
+{
+  energest_flush();
+
+  total.cpu += elapsed(ENERGEST_TYPE_CPU);
+  total.lpm += elapsed(ENERGEST_TYPE_LPM);
+  total.listen += elapsed(ENERGEST_TYPE_LISTEN);
+  total.transmit += elapsed(ENERGEST_TYPE_TRANSMIT);
+
+  *now = total;
+}
+/*---------------------------------------------------------------------------*/
+uint64_t
+duty_cycle_charge(const duty_cycle_t *times)
+{
+  uint64_t ua_ticks = times->cpu * DUTY_CYCLE_CONF_CPU_UA +
+    times->lpm * DUTY_CYCLE_CONF_LPM_UA +
+    times->listen * DUTY_CYCLE_CONF_LISTEN_UA +
+    times->transmit * DUTY_CYCLE_CONF_TRANSMIT_UA;
+
+  return ua_ticks / ((uint64_t)RTIMER_SECOND * 3600);
+}
+/*---------------------------------------------------------------------------*/
+/* Hundredths of a percent, so the radio's sub-percent figures still show */
+static unsigned long
+share(uint64_t part, uint64_t whole)
+{
+  return whole ? (unsigned long)((part * 10000) / whole) : 0;
+}
+/*---------------------------------------------------------------------------*/
+void
+duty_cycle_print(const duty_cycle_t *from, const duty_cycle_t *to)
+{
+  uint64_t cpu = to->cpu - from->cpu;
+  uint64_t lpm = to->lpm - from->lpm;
+  uint64_t whole = cpu + lpm;
+
+  printf("Duty cycle: cpu %lu.%02lu%% lpm %lu.%02lu%% listen %lu.%02lu%% tx %lu.%02lu%%\n",
+         share(cpu, whole) / 100, share(cpu, whole) % 100,
+         share(lpm, whole) / 100, share(lpm, whole) % 100,
+         share(to->listen - from->listen, whole) / 100,
+         share(to->listen - from->listen, whole) % 100,
+         share(to->transmit - from->transmit, whole) / 100,
+         share(to->transmit - from->transmit, whole) % 100);
+}
+/*---------------------------------------------------------------------------*/
+void
+duty_cycle_start(clock_time_t period)
+{
+  interval = period;
+  process_start(&duty_cycle_process, NULL);
+}
+/*---------------------------------------------------------------------------*/
+PROCESS_THREAD(duty_cycle_process, ev, data)
+{
+  static struct etimer periodic;
+  static duty_cycle_t previous;
+  duty_cycle_t now;
+
+  PROCESS_BEGIN();
+
+  duty_cycle_read(&previous);
+  etimer_set(&periodic, interval);
+
+  while(1) {
+    PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&periodic));
+    etimer_reset(&periodic);
+
+    duty_cycle_read(&now);
+    duty_cycle_print(&previous, &now);
+    previous = now;
+  }
+
+  PROCESS_END();
+}
+/*---------------------------------------------------------------------------*/
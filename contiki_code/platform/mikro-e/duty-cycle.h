@@ -0,0 +1,39 @@
+#ifndef __DUTY_CYCLE_H__
+#define __DUTY_CYCLE_H__
+
+#include "contiki.h"
+#include <stdint.h>
+
+/* Cumulative Energest time in each state since boot, in rtimer ticks */
+typedef struct {
+  uint64_t cpu;
+  uint64_t lpm;
+  uint64_t listen;
+  uint64_t transmit;
+} duty_cycle_t;
+
+/* Supply current in each state in uA, typical figures from the PIC32MX470 and CC2520 datasheets */
+#ifndef DUTY_CYCLE_CONF_CPU_UA
+#define DUTY_CYCLE_CONF_CPU_UA        22000
+#endif
+#ifndef DUTY_CYCLE_CONF_LPM_UA
+#define DUTY_CYCLE_CONF_LPM_UA        6000
+#endif
+#ifndef DUTY_CYCLE_CONF_LISTEN_UA
+#define DUTY_CYCLE_CONF_LISTEN_UA     18500
+#endif
+#ifndef DUTY_CYCLE_CONF_TRANSMIT_UA
+#define DUTY_CYCLE_CONF_TRANSMIT_UA   25800
+#endif
+
+/* Must run more often than the Energest counters wrap, duty_cycle_start() sees to that */
+void duty_cycle_read(duty_cycle_t *now);
+
+/* Estimated charge drawn over the given times, in uAh */
+uint64_t duty_cycle_charge(const duty_cycle_t *times);
+
+/* Print the share of each state between two readings, every period if started */
+void duty_cycle_print(const duty_cycle_t *from, const duty_cycle_t *to);
+void duty_cycle_start(clock_time_t period);
+
+#endif /* __DUTY_CYCLE_H__ */
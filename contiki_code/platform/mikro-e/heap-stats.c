@@ -0,0 +1,31 @@
+#include "heap-stats.h"
+#include <malloc.h>
+#include <stdio.h>
+
+static unsigned long peak;
+
+/*---------------------------------------------------------------------------*/
+void
+heap_stats_read(heap_stats_t *stats)
+{
+  struct mallinfo info = mallinfo();
+
+  stats->arena = info.arena;
+  stats->in_use = info.uordblks;
+
+  if(stats->in_use > peak) {
+    peak = stats->in_use;
+  }
+  stats->peak = peak;
+}
+/*---------------------------------------------------------------------------*/
+void
+heap_stats_print(const char *when)
+{
+  heap_stats_t stats;
+
+  heap_stats_read(&stats);
+  printf("Heap %s: %lu in use, %lu peak, %lu high-water\n", when,
+         stats.in_use, stats.peak, stats.arena);
+}
+/*---------------------------------------------------------------------------*/
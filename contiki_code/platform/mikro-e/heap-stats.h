@@ -0,0 +1,14 @@
+#ifndef __HEAP_STATS_H__
+#define __HEAP_STATS_H__
+
+/* Heap use in bytes */
+typedef struct {
+  unsigned long arena;    /* Taken from the heap region so far, its high-water mark */
+  unsigned long in_use;
+  unsigned long peak;     /* Highest in_use seen by heap_stats_read() */
+} heap_stats_t;
+
+void heap_stats_read(heap_stats_t *stats);
+void heap_stats_print(const char *when);
+
+#endif /* __HEAP_STATS_H__ */
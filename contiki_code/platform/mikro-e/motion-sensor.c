@@ -1,10 +1,40 @@
 #include "motion-sensor.h"
+#include <contiki.h>
 #include <lib/sensors.h>
 #include <pic32_gpio.h>
+#include <stdio.h>
 #include "button-sensor.h"
 
+/*
+ * The change notice ISR only samples the pin and timestamps the edge into
+ * this ring, everything else happens in motion_process. One producer (the
+ * ISR) moves head, one consumer (the process) moves tail.
+ */
+#define MOTION_RING_SIZE	8	/* Power of two */
+#define MOTION_RING_MASK	(MOTION_RING_SIZE - 1)
+
+/*
+ * The ISR runs on the same single core as the process, so keeping the
+ * compiler from moving entry accesses across the index updates is enough.
+ */
+#define MOTION_BARRIER()	__asm__ volatile("" ::: "memory")
+
+typedef struct
+{
+	rtimer_clock_t	time;
+	uint8_t			level;
+} motion_edge_t;
+
+static motion_edge_t			ring[MOTION_RING_SIZE];
+static volatile uint8_t			ring_head = 0;
+static volatile uint8_t			ring_tail = 0;
+static volatile uint8_t			ring_overrun = 0;
+
 static int motion_status_value = 0;
 static int _motion_value = 0;
+static rtimer_clock_t _motion_time = 0;
+
+PROCESS(motion_process, "Motion sensor");
 
 static int motion_configure(int type, int value)
 {
@@ -18,6 +48,9 @@ static int motion_configure(int type, int value)
 		if(value)
 		{
 			motion_status_value = 1;
+			_motion_value = MOTION_READ(MOTION_PORT, MOTION_PIN);
+			_motion_time = RTIMER_NOW();
+			process_start(&motion_process, NULL);
 			BUTTON_IRQ_ENABLE(MOTION_PORT, MOTION_PIN);
 		}
 		else
@@ -37,19 +70,88 @@ static int motion_status(int type)
 
 static int motion_value(int type)
 {
+	if(type == MOTION_VALUE_EDGE_TIME)
+	{
+		return (int)_motion_time;
+	}
+
 	return _motion_value;
 }
 
 void motion_isr()
 {
-	if(_motion_value == 1)
-		_motion_value = 0;
+	uint8_t head = ring_head;
+
+	/* A full ring drops the edge, the process resamples the pin instead */
+	if(((head + 1) & MOTION_RING_MASK) != ring_tail)
+	{
+		ring[head].time = RTIMER_NOW();
+		ring[head].level = MOTION_READ(MOTION_PORT, MOTION_PIN);
+		/* The entry is complete before head publishes it */
+		MOTION_BARRIER();
+		ring_head = (head + 1) & MOTION_RING_MASK;
+	}
 	else
-		_motion_value = 1;
+	{
+		ring_overrun = 1;
+	}
 
-	printf("Motion ISR, setting val: %i\n", _motion_value);
 	BUTTON_CLEAR_IRQ(MOTION_PORT, MOTION_PIN);
-	sensors_changed(&motion_sensor);
+	process_poll(&motion_process);
+}
+
+PROCESS_THREAD(motion_process, ev, data)
+{
+	PROCESS_BEGIN();
+
+	while(1)
+	{
+		int changed = 0;
+
+		PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL);
+
+		while(ring_tail != ring_head)
+		{
+			motion_edge_t edge;
+
+			/* Read the entry only once head is seen past it, and before handing the slot back */
+			MOTION_BARRIER();
+			edge = ring[ring_tail];
+			MOTION_BARRIER();
+			ring_tail = (ring_tail + 1) & MOTION_RING_MASK;
+
+			/* The level, not the edge count, decides; a missed edge cannot invert the state */
+			if(edge.level != _motion_value)
+			{
+				_motion_value = edge.level;
+				_motion_time = edge.time;
+				changed = 1;
+				printf("Motion %i at %lu\n", _motion_value, (unsigned long)edge.time);
+			}
+		}
+
+		if(ring_overrun)
+		{
+			int level = MOTION_READ(MOTION_PORT, MOTION_PIN);
+
+			ring_overrun = 0;
+			printf("Motion edges lost, resampled %i\n", level);
+
+			if(level != _motion_value)
+			{
+				_motion_value = level;
+				_motion_time = RTIMER_NOW();
+				changed = 1;
+			}
+		}
+
+		if(changed)
+		{
+			sensors_changed(&motion_sensor);
+		}
+	}
+
+	PROCESS_END();
 }
 
 SENSORS_SENSOR(motion_sensor, MOTION_SENSOR_NAME, motion_value, motion_configure, motion_status);
@@ -6,6 +6,13 @@
 #define MOTION_PORT D
 #define MOTION_PIN  0
 
+/* Current level of the sensor output, high while motion is detected */
+#define _MOTION_READ(port, pin) ((PORT##port >> (pin)) & 1)
+#define MOTION_READ(port, pin)  _MOTION_READ(port, pin)
+
+/* value() type for the RTIMER_NOW() time of the last level change */
+#define MOTION_VALUE_EDGE_TIME 1
+
 #define MOTION_SENSOR_NAME "MotionSensor"
 
 extern const struct sensors_sensor motion_sensor;
@@ -0,0 +1,121 @@
+#include "nvm-store.h"
+#include <p32xxxx.h>
+#include <stdint.h>
+#include <string.h>
+#include "lib/crc16.h"
+
+#define NVM_STORE_MAGIC       0x4e56
+#define KVA_TO_PA(v)          ((uint32_t)(v) & 0x1fffffff)
+
+/* NVMCON operations, WREN set */
+#define NVMOP_WORD_PGM        0x4001
+#define NVMOP_PAGE_ERASE      0x4004
+
+typedef struct {
+  uint16_t magic;
+  uint16_t len;
+  uint16_t crc;
+  uint16_t reserved;
+} nvm_header_t;
+
+/*
+ * A page of its own, placed by nvm-store.ld so erasing it touches nothing
+ * else. All ones like erased flash, so programming an image leaves no
+ * record. Volatile because it changes under the compiler.
+ */
+static const volatile uint8_t page[NVM_STORE_PAGE_SIZE]
+  __attribute__((section(".nvm_store"), aligned(NVM_STORE_PAGE_SIZE))) =
+  { [0 ... NVM_STORE_PAGE_SIZE - 1] = 0xff };
+
+/*---------------------------------------------------------------------------*/
+/* The unlock sequence must not be interrupted */
+static int
+nvm_operation(uint32_t op)
+{
+  unsigned int status = __builtin_disable_interrupts();
+
+  NVMCON = op;
+  NVMKEY = 0xaa996655;
+  NVMKEY = 0x556699aa;
+  NVMCONSET = _NVMCON_WR_MASK;
+
+  while(NVMCON & _NVMCON_WR_MASK);
+
+  NVMCONCLR = _NVMCON_WREN_MASK;
+
+  if(status & 1) {
+    __builtin_enable_interrupts();
+  }
+
+  return (NVMCON & (_NVMCON_WRERR_MASK | _NVMCON_LVDERR_MASK)) ? -1 : 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+program_word(uint32_t offset, uint32_t word)
+{
+  NVMADDR = KVA_TO_PA(&page[offset]);
+  NVMDATA = word;
+  return nvm_operation(NVMOP_WORD_PGM);
+}
+/*---------------------------------------------------------------------------*/
+int
+nvm_store_erase(void)
+{
+  NVMADDR = KVA_TO_PA(page);
+  return nvm_operation(NVMOP_PAGE_ERASE);
+}
+/*---------------------------------------------------------------------------*/
+int
+nvm_store_read(void *data, int len)
+{
+  nvm_header_t header;
+
+  memcpy(&header, (const void *)page, sizeof(header));
+
+  if(header.magic != NVM_STORE_MAGIC || header.len != len ||
+     len > NVM_STORE_MAX_LEN) {
+    return -1;
+  }
+
+  memcpy(data, (const void *)&page[sizeof(header)], len);
+
+  return (crc16_data(data, len, 0) == header.crc) ? 0 : -1;
+}
+/*---------------------------------------------------------------------------*/
+int
+nvm_store_write(const void *data, int len)
+{
+  nvm_header_t header;
+  uint32_t word;
+  int i;
+
+  if(len > NVM_STORE_MAX_LEN || nvm_store_erase() != 0) {
+    return -1;
+  }
+
+  /* Body first, the header last, so an interrupted write reads as no record */
+  for(i = 0; i < len; i += sizeof(word)) {
+    word = 0xffffffff;
+    memcpy(&word, (const uint8_t *)data + i, (len - i < sizeof(word)) ? len - i : sizeof(word));
+
+    if(program_word(sizeof(header) + i, word) != 0) {
+      return -1;
+    }
+  }
+
+  header.magic = NVM_STORE_MAGIC;
+  header.len = len;
+  header.crc = crc16_data(data, len, 0);
+  header.reserved = 0xffff;
+
+  for(i = 0; i < sizeof(header); i += sizeof(word)) {
+    memcpy(&word, (const uint8_t *)&header + i, sizeof(word));
+
+    if(program_word(i, word) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,19 @@
+#ifndef __NVM_STORE_H__
+#define __NVM_STORE_H__
+
+/*
+ * One small record in a flash page reserved for it, kept across resets and
+ * power cycles. Reprogramming the part erases it.
+ */
+#define NVM_STORE_PAGE_SIZE   4096
+#define NVM_STORE_MAX_LEN     (NVM_STORE_PAGE_SIZE - 8)
+
+/* 0 if a valid record of exactly len bytes was read */
+int nvm_store_read(void *data, int len);
+
+/* Erase the page and program the record, 0 on success */
+int nvm_store_write(const void *data, int len);
+
+int nvm_store_erase(void);
+
+#endif /* __NVM_STORE_H__ */
@@ -0,0 +1,440 @@
+#include "action_queue.h"
+#include "transport.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+#include <pthread.h>
+#include <time.h>
+
+typedef struct
+{
+	ACTION_TYPE_E	type;
+	char			device[ACTION_QUEUE_DEVICE_LEN];
+	int				value;
+	struct timespec	enqueued;
+	unsigned long	trace_id;
+
+} ACTION_S;
+
+typedef struct
+{
+	ACTION_S				entries[ACTION_QUEUE_DEPTH];
+	unsigned int			head;
+	unsigned int			count;
+	ACTION_CLASS_STATS_S	stats;
+
+} ACTION_LANE_S;
+
+// An issued action. Its completion carries the slot's token, which changes
+// on every reuse, so a completion arriving after the slot timed out is ignored.
+typedef struct
+{
+	ACTION_LANE_S*	lane;
+	struct timespec	issued;
+	unsigned int	token;
+	int				busy;
+
+} ACTION_SLOT_S;
+
+static ACTION_LANE_S	lanes[ACTION_CLASS_COUNT];
+static ACTION_SLOT_S	slots[ACTION_QUEUE_MAX_IN_FLIGHT];
+static pthread_mutex_t	lock 				= PTHREAD_MUTEX_INITIALIZER;
+static unsigned int		in_flight 			= 0;
+static unsigned int		interactive_streak 	= 0;
+static int				drain_scheduled 	= 0;
+static int				reap_scheduled 		= 0;
+
+static ACTION_S* lane_at(ACTION_LANE_S* lane, unsigned int index)
+{
+	return &lane->entries[(lane->head + index) % ACTION_QUEUE_DEPTH];
+}
+
+static unsigned long elapsed_us(struct timespec* since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((now.tv_sec - since->tv_sec) * 1000000L) + ((now.tv_nsec - since->tv_nsec) / 1000L);
+}
+
+// Starting playback unmutes, so it overrides a pending mute as well
+static int conflicts(ACTION_TYPE_E pending, ACTION_TYPE_E type)
+{
+	return pending == type || (pending == ACTION_SET_MUTE && type == ACTION_START_PLAYBACK);
+}
+
+// Drop pending entries for a device/action from a lane, keeping the order of the rest
+static unsigned int lane_remove(ACTION_LANE_S* lane, ACTION_TYPE_E type, char* device)
+{
+	unsigned int i;
+	unsigned int kept 		= 0;
+	unsigned int removed 	= 0;
+
+	for(i = 0; i < lane->count; i++)
+	{
+		ACTION_S* entry = lane_at(lane, i);
+
+		if(conflicts(entry->type, type) && strcmp(entry->device, device) == 0)
+		{
+			removed++;
+		}
+		else
+		{
+			if(kept != i)
+			{
+				*lane_at(lane, kept) = *entry;
+			}
+			kept++;
+		}
+	}
+
+	lane->count 		= kept;
+	lane->stats.depth 	= kept;
+
+	return removed;
+}
+
+// Must be called with the lock held
+static void update_depth(void)
+{
+	metrics_gauge_set(METRIC_ACTION_QUEUE_DEPTH, lanes[ACTION_CLASS_INTERACTIVE].count + lanes[ACTION_CLASS_BACKGROUND].count);
+}
+
+// Pick the lane to serve next. Must be called with the lock held.
+static ACTION_LANE_S* select_lane(void)
+{
+	ACTION_LANE_S* interactive 	= &lanes[ACTION_CLASS_INTERACTIVE];
+	ACTION_LANE_S* background 	= &lanes[ACTION_CLASS_BACKGROUND];
+
+	if(background->count > 0)
+	{
+		// Background has waited long enough, let it through
+		if(interactive->count == 0
+			|| interactive_streak >= ACTION_QUEUE_STARVATION_LIMIT
+			|| elapsed_us(&lane_at(background, 0)->enqueued) >= (ACTION_QUEUE_MAX_BACKGROUND_WAIT_MS * 1000UL))
+		{
+			interactive_streak = 0;
+			return background;
+		}
+	}
+
+	if(interactive->count > 0)
+	{
+		interactive_streak++;
+		return interactive;
+	}
+
+	return NULL;
+}
+
+// Take a free slot for an action about to be issued. Must be called with the lock held.
+static unsigned int slot_claim(ACTION_LANE_S* lane)
+{
+	unsigned int i;
+
+	for(i = 0; slots[i].busy; i++);
+
+	slots[i].busy 	= 1;
+	slots[i].lane 	= lane;
+	slots[i].token 	+= ACTION_QUEUE_MAX_IN_FLIGHT;
+	clock_gettime(CLOCK_MONOTONIC, &slots[i].issued);
+	in_flight++;
+
+	return slots[i].token;
+}
+
+// Free the slot a token was issued for, NULL if it was already reclaimed.
+// Must be called with the lock held.
+static ACTION_LANE_S* slot_release(unsigned int token)
+{
+	ACTION_SLOT_S* slot = &slots[token % ACTION_QUEUE_MAX_IN_FLIGHT];
+
+	if(!slot->busy || slot->token != token)
+	{
+		return NULL;
+	}
+
+	slot->busy = 0;
+	in_flight--;
+
+	return slot->lane;
+}
+
+static int drain(void* data);
+
+// Must be called with the lock held
+static void schedule_drain(void)
+{
+	if(!drain_scheduled)
+	{
+		drain_scheduled = 1;
+
+		// Actions are always issued from the GLib thread running the control point
+		g_idle_add(drain, NULL);
+	}
+}
+
+// Reclaim the slots of actions whose completion never came
+static int reap(void* data)
+{
+	unsigned int	i;
+	unsigned int	reclaimed = 0;
+	int				res;
+
+	pthread_mutex_lock(&lock);
+
+	for(i = 0; i < ACTION_QUEUE_MAX_IN_FLIGHT; i++)
+	{
+		if(slots[i].busy && elapsed_us(&slots[i].issued) >= (ACTION_QUEUE_ACTION_TIMEOUT_MS * 1000UL))
+		{
+			slots[i].busy = 0;
+			in_flight--;
+			slots[i].lane->stats.failed++;
+			slots[i].lane->stats.timed_out++;
+			metrics_count(METRIC_ACTIONS_FAILED, 1);
+			reclaimed++;
+		}
+	}
+
+	if(reclaimed)
+	{
+		LOG(LOG_WARN, "Actions: %u without completion after %dms, slots reclaimed", reclaimed, ACTION_QUEUE_ACTION_TIMEOUT_MS);
+
+		if(lanes[ACTION_CLASS_INTERACTIVE].count || lanes[ACTION_CLASS_BACKGROUND].count)
+		{
+			schedule_drain();
+		}
+	}
+
+	reap_scheduled 	= (in_flight > 0);
+	res 			= reap_scheduled ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+
+	pthread_mutex_unlock(&lock);
+
+	return res;
+}
+
+static void action_done_cb(int success, void* user_data)
+{
+	ACTION_LANE_S* lane;
+
+	pthread_mutex_lock(&lock);
+
+	// Too late, the slot was reclaimed and the action counted as failed
+	if((lane = slot_release(GPOINTER_TO_UINT(user_data))) == NULL)
+	{
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	if(!success)
+	{
+		lane->stats.failed++;
+	}
+
+	metrics_count(success ? METRIC_ACTIONS_SUCCEEDED : METRIC_ACTIONS_FAILED, 1);
+
+	if(lanes[ACTION_CLASS_INTERACTIVE].count || lanes[ACTION_CLASS_BACKGROUND].count)
+	{
+		schedule_drain();
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+static int drain(void* data)
+{
+	ACTION_LANE_S* lane;
+
+	pthread_mutex_lock(&lock);
+
+	drain_scheduled = 0;
+
+	while(in_flight < ACTION_QUEUE_MAX_IN_FLIGHT && (lane = select_lane()) != NULL)
+	{
+		ACTION_S 		action 	= *lane_at(lane, 0);
+		unsigned long	wait_us = elapsed_us(&action.enqueued);
+		unsigned int	token;
+		int				issued;
+
+		lane->head 			= (lane->head + 1) % ACTION_QUEUE_DEPTH;
+		lane->count--;
+		lane->stats.depth 	= lane->count;
+		lane->stats.dispatched++;
+		lane->stats.total_wait_us += wait_us;
+
+		if(wait_us > lane->stats.max_wait_us)
+		{
+			lane->stats.max_wait_us = wait_us;
+		}
+
+		update_depth();
+		metrics_observe(METRIC_ACTION_WAIT_MS, wait_us / 1000);
+
+		token = slot_claim(lane);
+
+		if(!reap_scheduled)
+		{
+			reap_scheduled = 1;
+			g_timeout_add_seconds(1, reap, NULL);
+		}
+
+		pthread_mutex_unlock(&lock);
+
+		trace_set_current(action.trace_id);
+
+		switch(action.type)
+		{
+			case ACTION_SET_MUTE:
+			issued = control_point_begin_set_mute(action.device, action.value, action_done_cb, GUINT_TO_POINTER(token));
+			break;
+
+			case ACTION_SET_VOLUME:
+			issued = control_point_begin_set_volume(action.device, action.value, action_done_cb, GUINT_TO_POINTER(token));
+			break;
+
+			case ACTION_START_PLAYBACK:
+			issued = transport_begin_start(action.device, action_done_cb, GUINT_TO_POINTER(token));
+			break;
+
+			default:
+			issued = control_point_begin_get_volume(action.device, action_done_cb, GUINT_TO_POINTER(token));
+			break;
+		}
+
+		pthread_mutex_lock(&lock);
+
+		// Device not (yet) known to the control point, no completion will follow
+		if(!issued)
+		{
+			slot_release(token);
+			lane->stats.failed++;
+		}
+
+		metrics_count(issued ? METRIC_ACTIONS_ISSUED : METRIC_ACTIONS_FAILED, 1);
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return G_SOURCE_REMOVE;
+}
+
+static int enqueue(ACTION_CLASS_E cls, ACTION_TYPE_E type, char* device, int value)
+{
+	ACTION_LANE_S*	lane 	= &lanes[cls];
+	ACTION_S*		entry 	= NULL;
+	unsigned int	i;
+	int				res 	= 1;
+
+	pthread_mutex_lock(&lock);
+
+	lane->stats.enqueued++;
+
+	// An interactive action makes any pending background action of the same kind for the device obsolete
+	if(cls == ACTION_CLASS_INTERACTIVE)
+	{
+		unsigned int superseded = lane_remove(&lanes[ACTION_CLASS_BACKGROUND], type, device);
+
+		lanes[ACTION_CLASS_BACKGROUND].stats.superseded += superseded;
+		metrics_count(METRIC_EVENTS_DEBOUNCED, superseded);
+	}
+
+	// Coalesce with an action already waiting in this lane
+	for(i = 0; i < lane->count; i++)
+	{
+		if(lane_at(lane, i)->type == type && strcmp(lane_at(lane, i)->device, device) == 0)
+		{
+			entry 			= lane_at(lane, i);
+			entry->value 	= value;
+			entry->trace_id = trace_current();
+			lane->stats.coalesced++;
+			metrics_count(METRIC_EVENTS_DEBOUNCED, 1);
+			break;
+		}
+	}
+
+	if(entry == NULL)
+	{
+		if(lane->count < ACTION_QUEUE_DEPTH)
+		{
+			entry 			= lane_at(lane, lane->count);
+			entry->type 	= type;
+			entry->value 	= value;
+			entry->trace_id = trace_current();
+			strncpy(entry->device, device, ACTION_QUEUE_DEVICE_LEN - 1);
+			entry->device[ACTION_QUEUE_DEVICE_LEN - 1] = '\0';
+			clock_gettime(CLOCK_MONOTONIC, &entry->enqueued);
+
+			lane->count++;
+			lane->stats.depth = lane->count;
+
+			if(lane->count > lane->stats.max_depth)
+			{
+				lane->stats.max_depth = lane->count;
+			}
+		}
+		else
+		{
+			lane->stats.dropped++;
+			res = 0;
+		}
+	}
+
+	if(res)
+	{
+		update_depth();
+		schedule_drain();
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return res;
+}
+
+void action_queue_init(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&lock);
+
+	memset(lanes, 0, sizeof(lanes));
+	memset(slots, 0, sizeof(slots));
+
+	for(i = 0; i < ACTION_QUEUE_MAX_IN_FLIGHT; i++)
+	{
+		slots[i].token = i;
+	}
+
+	in_flight 			= 0;
+	interactive_streak 	= 0;
+
+	pthread_mutex_unlock(&lock);
+}
+
+int action_queue_set_mute(ACTION_CLASS_E cls, char* device, int mute)
+{
+	return enqueue(cls, ACTION_SET_MUTE, device, mute);
+}
+
+int action_queue_set_volume(ACTION_CLASS_E cls, char* device, int volume)
+{
+	return enqueue(cls, ACTION_SET_VOLUME, device, volume);
+}
+
+int action_queue_get_volume(ACTION_CLASS_E cls, char* device)
+{
+	return enqueue(cls, ACTION_GET_VOLUME, device, 0);
+}
+
+int action_queue_start_playback(ACTION_CLASS_E cls, char* device)
+{
+	return enqueue(cls, ACTION_START_PLAYBACK, device, 0);
+}
+
+void action_queue_get_stats(ACTION_CLASS_E cls, ACTION_CLASS_STATS_S* stats)
+{
+	pthread_mutex_lock(&lock);
+	*stats = lanes[cls].stats;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,68 @@
+#ifndef ACTION_QUEUE_H
+#define ACTION_QUEUE_H
+
+#include "control_point.h"
+
+#define ACTION_QUEUE_DEPTH					32
+#define ACTION_QUEUE_DEVICE_LEN				64
+
+// Actions allowed on the wire at once. Anything beyond this waits in the
+// class queues, which is where the priority ordering takes effect.
+#define ACTION_QUEUE_MAX_IN_FLIGHT			4
+
+// An action whose completion has not arrived by then is counted as failed
+// and its slot reused, a lost callback must not shrink the window for good
+#define ACTION_QUEUE_ACTION_TIMEOUT_MS		15000
+
+// Starvation protection for the background class: it is served after this
+// many consecutive interactive dispatches, or once its oldest entry has
+// waited longer than the age limit.
+#define ACTION_QUEUE_STARVATION_LIMIT		8
+#define ACTION_QUEUE_MAX_BACKGROUND_WAIT_MS	2000
+
+typedef enum
+{
+	ACTION_CLASS_INTERACTIVE = 0,	// Motion triggered unmute / volume
+	ACTION_CLASS_BACKGROUND,		// Vacancy mutes, fades
+	ACTION_CLASS_COUNT
+
+} ACTION_CLASS_E;
+
+typedef enum
+{
+	ACTION_SET_MUTE = 0,
+	ACTION_SET_VOLUME,
+	ACTION_GET_VOLUME,
+	ACTION_START_PLAYBACK	// Unmute, and Play if the transport is not running
+
+} ACTION_TYPE_E;
+
+typedef struct
+{
+	unsigned int		depth;
+	unsigned int		max_depth;
+	unsigned long		enqueued;
+	unsigned long		coalesced;
+	unsigned long		superseded;
+	unsigned long		dropped;
+	unsigned long		dispatched;
+	unsigned long		failed;
+	unsigned long		timed_out;		// Also counted in failed
+	unsigned long long	total_wait_us;
+	unsigned long		max_wait_us;
+
+} ACTION_CLASS_STATS_S;
+
+void action_queue_init(void);
+
+int action_queue_set_mute(ACTION_CLASS_E cls, char* device, int mute);
+
+int action_queue_set_volume(ACTION_CLASS_E cls, char* device, int volume);
+
+int action_queue_get_volume(ACTION_CLASS_E cls, char* device);
+
+int action_queue_start_playback(ACTION_CLASS_E cls, char* device);
+
+void action_queue_get_stats(ACTION_CLASS_E cls, ACTION_CLASS_STATS_S* stats);
+
+#endif	/* ACTION_QUEUE_H */
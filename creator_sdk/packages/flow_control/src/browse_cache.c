@@ -0,0 +1,411 @@
+#include "browse_cache.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONTENT_DIRECTORY 		"urn:schemas-upnp-org:service:ContentDirectory"
+
+typedef struct
+{
+	char*			id;
+	unsigned int	update_id;
+	unsigned int	generation;		// Bumped on invalidation, stale Browse replies restart
+	int				loading;
+	int				loaded;
+	GPtrArray*		items;			// BROWSE_ITEM_S, strings packed behind each item
+
+} CONTAINER_S;
+
+typedef struct
+{
+	char*				name;
+	char*				udn;
+	GUPnPServiceProxy*	content_directory;
+	unsigned int		system_update_id;
+	int					container_events;	// Server events ContainerUpdateIDs
+	GHashTable*			containers;
+
+} SERVER_S;
+
+typedef struct
+{
+	char*			udn;
+	char*			container;
+	unsigned int	generation;
+	unsigned int	start;
+
+} BROWSE_CTX_S;
+
+static GList*					servers 	= NULL;		// Touched on the GLib thread only
+static browse_cache_loaded_cb	loaded_cb 	= NULL;
+static BROWSE_CACHE_STATS_S		stats;
+static pthread_mutex_t			stats_lock 	= PTHREAD_MUTEX_INITIALIZER;
+
+static void count(unsigned long* counter, long delta)
+{
+	pthread_mutex_lock(&stats_lock);
+	*counter += delta;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void container_free(gpointer data)
+{
+	CONTAINER_S* container = data;
+
+	count(&stats.items, -(long)container->items->len);
+	g_ptr_array_free(container->items, TRUE);
+	g_free(container->id);
+	g_free(container);
+}
+
+static CONTAINER_S* container_get(SERVER_S* server, const char* id)
+{
+	CONTAINER_S* container = g_hash_table_lookup(server->containers, id);
+
+	if(container == NULL)
+	{
+		container 			= g_new0(CONTAINER_S, 1);
+		container->id 		= g_strdup(id);
+		container->items 	= g_ptr_array_new_with_free_func(g_free);
+
+		g_hash_table_insert(server->containers, container->id, container);
+	}
+
+	return container;
+}
+
+static void container_clear(CONTAINER_S* container)
+{
+	count(&stats.items, -(long)container->items->len);
+	g_ptr_array_set_size(container->items, 0);
+}
+
+static void container_invalidate(CONTAINER_S* container)
+{
+	count(&stats.invalidations, 1);
+
+	container_clear(container);
+	container->loaded = 0;
+	container->generation++;
+}
+
+static SERVER_S* find_server(const char* name, const char* udn)
+{
+	GList* item;
+
+	for(item = servers; item != NULL; item = item->next)
+	{
+		SERVER_S* server = item->data;
+
+		if((name && strcmp(server->name, name) == 0) || (udn && strcmp(server->udn, udn) == 0))
+		{
+			return server;
+		}
+	}
+
+	return NULL;
+}
+
+// Keep one playable resource per item, packed into a single allocation
+static void
+didl_item_available_cb (GUPnPDIDLLiteParser *parser,
+                        GUPnPDIDLLiteObject *object,
+                        gpointer             user_data)
+{
+	CONTAINER_S*	container 	= user_data;
+	GList*			resources 	= gupnp_didl_lite_object_get_resources(object);
+	GList*			res;
+
+	for(res = resources; res != NULL; res = res->next)
+	{
+		GUPnPProtocolInfo*	info 	= gupnp_didl_lite_resource_get_protocol_info(res->data);
+		const char*			uri 	= gupnp_didl_lite_resource_get_uri(res->data);
+		const char*			title 	= gupnp_didl_lite_object_get_title(object);
+
+		if(info && uri && g_strcmp0(gupnp_protocol_info_get_protocol(info), "http-get") == 0)
+		{
+			char*			protocol_info 	= gupnp_protocol_info_to_string(info);
+			size_t			title_len 		= strlen(title ? title : "") + 1;
+			size_t			uri_len 		= strlen(uri) + 1;
+			BROWSE_ITEM_S*	item 			= g_malloc(sizeof(BROWSE_ITEM_S) + title_len + uri_len +
+														strlen(protocol_info) + 1);
+			char*			strings 		= (char*)(item + 1);
+
+			item->title 		= memcpy(strings, title ? title : "", title_len);
+			item->uri 			= memcpy(strings + title_len, uri, uri_len);
+			item->protocol_info = strcpy(strings + title_len + uri_len, protocol_info);
+
+			g_ptr_array_add(container->items, item);
+			count(&stats.items, 1);
+
+			g_free(protocol_info);
+			break;
+		}
+	}
+
+	g_list_free_full(resources, g_object_unref);
+}
+
+static void browse(SERVER_S* server, CONTAINER_S* container, unsigned int start);
+
+static void
+browse_cb (GUPnPServiceProxy       *content_directory,
+           GUPnPServiceProxyAction *action,
+           gpointer                 user_data)
+{
+	BROWSE_CTX_S		*ctx 		= user_data;
+	SERVER_S			*server 	= find_server(NULL, ctx->udn);
+	CONTAINER_S			*container;
+	GUPnPDIDLLiteParser	*parser;
+	GError				*error 		= NULL;
+	char				*result 	= NULL;
+	guint				returned 	= 0;
+	guint				total 		= 0;
+	guint				update_id 	= 0;
+
+	if (!gupnp_service_proxy_end_action (content_directory,
+										action,
+										&error,
+										"Result", G_TYPE_STRING, &result,
+										"NumberReturned", G_TYPE_UINT, &returned,
+										"TotalMatches", G_TYPE_UINT, &total,
+										"UpdateID", G_TYPE_UINT, &update_id,
+										NULL))
+	{
+		g_warning ("Browse Failed: %s: %s", ctx->container, error->message);
+		g_error_free (error);
+
+		if(server && (container = g_hash_table_lookup(server->containers, ctx->container)) != NULL)
+		{
+			container->loading = 0;
+		}
+		goto done;
+	}
+
+	// The server went away, or the container is unknown now
+	if(server == NULL || (container = g_hash_table_lookup(server->containers, ctx->container)) == NULL)
+	{
+		goto done;
+	}
+
+	// Changed while paging through it, start over
+	if(ctx->generation != container->generation || (ctx->start > 0 && update_id != container->update_id))
+	{
+		container_clear(container);
+		browse(server, container, 0);
+		goto done;
+	}
+
+	container->update_id = update_id;
+
+	parser = gupnp_didl_lite_parser_new();
+	g_signal_connect(parser, "item-available", G_CALLBACK(didl_item_available_cb), container);
+
+	if(result && !gupnp_didl_lite_parser_parse_didl(parser, result, &error))
+	{
+		g_warning ("DIDL-Lite parse failed: %s: %s", ctx->container, error->message);
+		g_error_free (error);
+	}
+
+	g_object_unref(parser);
+
+	if(returned > 0 && ctx->start + returned < total)
+	{
+		browse(server, container, ctx->start + returned);
+		goto done;
+	}
+
+	container->loading 	= 0;
+	container->loaded 	= 1;
+
+	LOG(LOG_INFO, "Browse cache: %s/%s, %u items", server->name, container->id, container->items->len);
+
+	if(loaded_cb)
+	{
+		loaded_cb(server->name, container->id);
+	}
+
+done:
+	g_free(result);
+	g_free(ctx->udn);
+	g_free(ctx->container);
+	g_free(ctx);
+}
+
+static void browse(SERVER_S* server, CONTAINER_S* container, unsigned int start)
+{
+	BROWSE_CTX_S* ctx = g_new0(BROWSE_CTX_S, 1);
+
+	ctx->udn 			= g_strdup(server->udn);
+	ctx->container 		= g_strdup(container->id);
+	ctx->generation 	= container->generation;
+	ctx->start 			= start;
+	container->loading 	= 1;
+
+	count(&stats.browses, 1);
+
+	gupnp_service_proxy_begin_action (server->content_directory,
+							"Browse",
+							browse_cb,
+							ctx,
+							"ObjectID", G_TYPE_STRING, container->id,
+							"BrowseFlag", G_TYPE_STRING, "BrowseDirectChildren",
+							"Filter", G_TYPE_STRING, "dc:title,res,res@protocolInfo",
+							"StartingIndex", G_TYPE_UINT, start,
+							"RequestedCount", G_TYPE_UINT, BROWSE_CACHE_PAGE_SIZE,
+							"SortCriteria", G_TYPE_STRING, "",
+							NULL);
+}
+
+// "id,update_id,id,update_id..." lists the containers that changed
+static void
+container_update_ids_cb (GUPnPServiceProxy *content_directory,
+                         const char        *variable,
+                         GValue            *value,
+                         gpointer           user_data)
+{
+	SERVER_S	*server = user_data;
+	char		**ids 	= g_strsplit(g_value_get_string(value), ",", -1);
+	unsigned int i;
+
+	server->container_events = 1;
+
+	for(i = 0; ids[i] != NULL && ids[i + 1] != NULL; i += 2)
+	{
+		CONTAINER_S* container = g_hash_table_lookup(server->containers, ids[i]);
+
+		if(container && (container->loaded || container->loading) &&
+			strtoul(ids[i + 1], NULL, 10) != container->update_id)
+		{
+			container_invalidate(container);
+		}
+	}
+
+	g_strfreev(ids);
+}
+
+static void
+system_update_id_cb (GUPnPServiceProxy *content_directory,
+                     const char        *variable,
+                     GValue            *value,
+                     gpointer           user_data)
+{
+	SERVER_S		*server = user_data;
+	unsigned int	id 		= g_value_get_uint(value);
+	GHashTableIter	iter;
+	gpointer		container;
+
+	// ContainerUpdateIDs is optional; without it any change drops the whole tree
+	if(id != server->system_update_id && !server->container_events)
+	{
+		g_hash_table_iter_init(&iter, server->containers);
+
+		while(g_hash_table_iter_next(&iter, NULL, &container))
+		{
+			if(((CONTAINER_S*)container)->loaded || ((CONTAINER_S*)container)->loading)
+			{
+				container_invalidate(container);
+			}
+		}
+	}
+
+	server->system_update_id = id;
+}
+
+void browse_cache_set_loaded_cb(browse_cache_loaded_cb cb)
+{
+	loaded_cb = cb;
+}
+
+void browse_cache_server_available(GUPnPDeviceProxy* proxy)
+{
+	GUPnPServiceProxy*	content_directory;
+	SERVER_S*			server;
+	const char*			udn = gupnp_device_info_get_udn(GUPNP_DEVICE_INFO(proxy));
+
+	if(find_server(NULL, udn) != NULL)
+	{
+		return;
+	}
+
+	content_directory = GUPNP_SERVICE_PROXY(gupnp_device_info_get_service(GUPNP_DEVICE_INFO(proxy), CONTENT_DIRECTORY));
+
+	if(content_directory == NULL)
+	{
+		return;
+	}
+
+	server 						= g_new0(SERVER_S, 1);
+	server->name 				= gupnp_device_info_get_friendly_name(GUPNP_DEVICE_INFO(proxy));
+	server->udn 				= g_strdup(udn);
+	server->content_directory 	= content_directory;
+	server->containers 			= g_hash_table_new_full(g_str_hash, g_str_equal, NULL, container_free);
+
+	gupnp_service_proxy_add_notify (content_directory,
+									"SystemUpdateID",
+									G_TYPE_UINT,
+									system_update_id_cb,
+									server);
+	gupnp_service_proxy_add_notify (content_directory,
+									"ContainerUpdateIDs",
+									G_TYPE_STRING,
+									container_update_ids_cb,
+									server);
+	gupnp_service_proxy_set_subscribed (content_directory, TRUE);
+
+	servers = g_list_prepend(servers, server);
+
+	LOG(LOG_INFO, "Media server %s available", server->name);
+}
+
+void browse_cache_server_unavailable(GUPnPDeviceProxy* proxy)
+{
+	SERVER_S* server = find_server(NULL, gupnp_device_info_get_udn(GUPNP_DEVICE_INFO(proxy)));
+
+	if(server)
+	{
+		servers = g_list_remove(servers, server);
+
+		g_hash_table_destroy(server->containers);
+		g_object_unref(server->content_directory);
+		g_free(server->name);
+		g_free(server->udn);
+		g_free(server);
+	}
+}
+
+const BROWSE_ITEM_S* browse_cache_select(const char* name, const char* id, unsigned int position)
+{
+	SERVER_S*		server = find_server(name, NULL);
+	CONTAINER_S*	container;
+
+	if(server == NULL)
+	{
+		count(&stats.misses, 1);
+		return NULL;
+	}
+
+	container = container_get(server, id);
+
+	if(!container->loaded)
+	{
+		if(!container->loading)
+		{
+			browse(server, container, 0);
+		}
+		count(&stats.misses, 1);
+		return NULL;
+	}
+
+	count(&stats.hits, 1);
+
+	return container->items->len ? g_ptr_array_index(container->items, position % container->items->len) : NULL;
+}
+
+void browse_cache_get_stats(BROWSE_CACHE_STATS_S* out)
+{
+	pthread_mutex_lock(&stats_lock);
+	*out = stats;
+	pthread_mutex_unlock(&stats_lock);
+}
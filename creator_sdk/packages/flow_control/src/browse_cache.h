@@ -0,0 +1,44 @@
+#ifndef BROWSE_CACHE_H
+#define BROWSE_CACHE_H
+
+#include "control_point.h"
+
+// Children requested per Browse while populating a container
+#define BROWSE_CACHE_PAGE_SIZE	64
+
+typedef struct
+{
+	const char*	title;
+	const char*	uri;
+	const char*	protocol_info;
+
+} BROWSE_ITEM_S;
+
+typedef struct
+{
+	unsigned long	hits;
+	unsigned long	misses;
+	unsigned long	browses;
+	unsigned long	invalidations;
+	unsigned long	items;
+
+} BROWSE_CACHE_STATS_S;
+
+// Called on the GLib thread when a container has been (re)loaded
+typedef void (*browse_cache_loaded_cb)(const char* server, const char* container);
+
+void browse_cache_set_loaded_cb(browse_cache_loaded_cb cb);
+
+void browse_cache_server_available(GUPnPDeviceProxy* proxy);
+
+void browse_cache_server_unavailable(GUPnPDeviceProxy* proxy);
+
+// GLib thread only. Returns the item at position (wrapping) in a container of
+// the named media server, or NULL if the container is not cached yet, in which
+// case it is loaded in the background and the loaded callback follows. The
+// item stays valid until control returns to the main loop.
+const BROWSE_ITEM_S* browse_cache_select(const char* server, const char* container, unsigned int position);
+
+void browse_cache_get_stats(BROWSE_CACHE_STATS_S* stats);
+
+#endif	/* BROWSE_CACHE_H */
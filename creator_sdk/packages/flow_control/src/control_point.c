@@ -1,60 +1,271 @@
 #include "control_point.h"
+#include "transport.h"
+#include "media_server.h"
+#include "browse_cache.h"
+#include "interface_policy.h"
+#include "metrics.h"
+#include "trace.h"
+#include "renderer_list.h"
+#include <pthread.h>
 
 #define MEDIA_RENDERER 		"urn:schemas-upnp-org:device:MediaRenderer:1"
+#define MEDIA_SERVER 		"urn:schemas-upnp-org:device:MediaServer:1"
 #define RENDERING_CONTROL 	"urn:schemas-upnp-org:service:RenderingControl"
 
 #define FIND_ERR_NOT_FOUND	-1
 #define FIND_ERR_DUPLICATE	-2
 
+#define MAX_ALTERNATES		16
+
 static GUPnPDeviceProxy		*aDevices[MAX_DEV_ENTRIES + 1] 	= {NULL};
 static unsigned int 		ui32DeviceCount 				= 0;							
 static GUPnPContextManager 	*context_manager;
 
-int find( char* device )
+// A renderer on a multi-homed gateway is seen once per interface. The best
+// ranked path is the one in aDevices, the others are kept to fail over to.
+typedef struct
 {
-	int	dev_cnt = ui32DeviceCount;
-	int	entry 	= -1;
-	int	entries	= MAX_DEV_ENTRIES;
-	
-	// While there are still devices
-	while(dev_cnt > 0)
-	{
-		// If entry is an existing device
-		if(aDevices[entries] != NULL)
-		{		
-			// Retrieve device name
-			char* reg_device = gupnp_device_info_get_friendly_name(GUPNP_DEVICE_INFO(aDevices[entries]));
-			
-			// Compare against new device
-			if(strcmp(reg_device, device) == 0)
-			{
-				entry = entries;
-				break;
-			}
-			
-			// Decrement the number of devices to look for
-			dev_cnt--;
+	GUPnPDeviceProxy	*proxy;
+	GUPnPContext		*context;
+	int					rank;
+
+} PATH_S;
+
+static PATH_S				aDevicePaths[MAX_DEV_ENTRIES + 1];
+static PATH_S				alternates[MAX_ALTERNATES];
+static int					num_alternates 					= 0;
+
+// Last mute state commanded per renderer, kept for warm restarts. Renderers
+// restored from a snapshot are expected back; a mute for one that has not been
+// rediscovered yet is held and applied when it appears.
+typedef struct
+{
+	char	name[SNAPSHOT_NAME_LEN];
+	int		muted;
+	int		expected;
+	int		pending;
+
+} RENDERER_STATE_S;
+
+static RENDERER_STATE_S		renderer_states[SNAPSHOT_MAX_RENDERERS];
+static int					num_renderer_states 			= 0;
+static pthread_mutex_t		renderer_lock 					= PTHREAD_MUTEX_INITIALIZER;
+
+// Must be called with renderer_lock held
+static RENDERER_STATE_S* renderer_state(const char* name, int create)
+{
+	int i;
+
+	for(i = 0; i < num_renderer_states; i++)
+	{
+		if(strcmp(renderer_states[i].name, name) == 0)
+		{
+			return &renderer_states[i];
 		}
-		
-		// Decrement the number of entries to examine
-		entries--;
 	}
-	
-	return entry;
+
+	if(create && num_renderer_states < SNAPSHOT_MAX_RENDERERS)
+	{
+		RENDERER_STATE_S* state = &renderer_states[num_renderer_states++];
+
+		memset(state, 0, sizeof(RENDERER_STATE_S));
+		strncpy(state->name, name, SNAPSHOT_NAME_LEN - 1);
+
+		return state;
+	}
+
+	return NULL;
 }
 
-GUPnPDeviceProxy* control_point_find_device( char* device )
+// Called on the GLib thread whenever aDevices changes
+static void publish_renderers(void)
 {
-	int entry = find(device);
-	
-	if(entry > FIND_ERR_NOT_FOUND)
+	RENDERER_LIST_S*	list;
+	unsigned int		count 	= 0;
+	int					i;
+
+	for(i = 0; i <= MAX_DEV_ENTRIES; i++)
+	{
+		if(aDevices[i] != NULL)
+		{
+			count++;
+		}
+	}
+
+	list = renderer_list_new(count);
+
+	for(i = 0; i <= MAX_DEV_ENTRIES; i++)
+	{
+		if(aDevices[i] != NULL)
+		{
+			renderer_list_add(list, gupnp_device_info_get_friendly_name(GUPNP_DEVICE_INFO(aDevices[i])), aDevices[i]);
+		}
+	}
+
+	metrics_gauge_set(METRIC_RENDERERS, count);
+
+	renderer_list_publish(list);
+}
+
+// Any thread. The proxy is referenced for the caller, who drops it once the action is issued.
+static GUPnPDeviceProxy* lookup_renderer(const char* device)
+{
+	RENDERER_LIST_S*	list 	= renderer_list_acquire();
+	GUPnPDeviceProxy*	proxy 	= renderer_list_find(list, device);
+
+	if(proxy)
+	{
+		g_object_ref(proxy);
+	}
+
+	renderer_list_release(list);
+
+	return proxy;
+}
+
+static void apply_held_mute(char* device)
+{
+	RENDERER_STATE_S*	state;
+	int					held 	= 0;
+	int					muted 	= 0;
+
+	pthread_mutex_lock(&renderer_lock);
+
+	if((state = renderer_state(device, 0)) != NULL)
+	{
+		held 			= state->pending;
+		muted 			= state->muted;
+		state->pending 	= 0;
+		state->expected = 0;
+	}
+
+	pthread_mutex_unlock(&renderer_lock);
+
+	if(held)
+	{
+		metrics_count(METRIC_ACTIONS_RETRIED, 1);
+		control_point_begin_set_mute(device, muted, NULL, NULL);
+	}
+}
+
+static void path_init(PATH_S* path, GUPnPControlPoint* cp, GUPnPDeviceProxy* proxy)
+{
+	path->proxy 	= proxy;
+	path->context 	= gupnp_control_point_get_context(cp);
+	path->rank 		= interface_policy_rank(gssdp_client_get_interface(GSSDP_CLIENT(path->context)));
+}
+
+static int find_udn(const char* udn)
+{
+	int entries;
+
+	for(entries = MAX_DEV_ENTRIES; entries >= 0; entries--)
+	{
+		if(aDevices[entries] != NULL &&
+			strcmp(gupnp_device_info_get_udn(GUPNP_DEVICE_INFO(aDevices[entries])), udn) == 0)
+		{
+			return entries;
+		}
+	}
+
+	return FIND_ERR_NOT_FOUND;
+}
+
+static int find_proxy(GUPnPDeviceProxy* proxy)
+{
+	int entries;
+
+	for(entries = MAX_DEV_ENTRIES; entries >= 0; entries--)
 	{
-		return aDevices[entry];
+		if(aDevices[entries] == proxy)
+		{
+			return entries;
+		}
+	}
+
+	return FIND_ERR_NOT_FOUND;
+}
+
+static void add_alternate(const PATH_S* path)
+{
+	if(num_alternates < MAX_ALTERNATES)
+	{
+		alternates[num_alternates++] = *path;
 	}
 	else
 	{
-		return NULL;
+		// The renderer still works through its current path, it just cannot fail over to this one
+		g_warning ("No room for another path to %s through %s, failover to it is disabled",
+					gupnp_device_info_get_udn(GUPNP_DEVICE_INFO(path->proxy)),
+					gssdp_client_get_interface(GSSDP_CLIENT(path->context)));
+	}
+}
+
+static void remove_alternate(int alternate)
+{
+	alternates[alternate] = alternates[--num_alternates];
+}
+
+static int best_alternate(const char* udn)
+{
+	int i;
+	int best = FIND_ERR_NOT_FOUND;
+
+	for(i = 0; i < num_alternates; i++)
+	{
+		if(strcmp(gupnp_device_info_get_udn(GUPNP_DEVICE_INFO(alternates[i].proxy)), udn) == 0 &&
+			(best == FIND_ERR_NOT_FOUND || alternates[i].rank < alternates[best].rank))
+		{
+			best = i;
+		}
 	}
+
+	return best;
+}
+
+// Move the renderer in entry over to another interface
+static void switch_path(int entry, const PATH_S* path)
+{
+	transport_device_unavailable(aDevices[entry]);
+
+	aDevices[entry] 	= path->proxy;
+	aDevicePaths[entry] = *path;
+
+	TRACE_REGISTRY_ADD(gupnp_device_info_get_udn(GUPNP_DEVICE_INFO(path->proxy)), entry);
+
+	publish_renderers();
+
+	transport_device_available(path->proxy);
+
+	printf("Entry %d now reached through %s\n", entry, gssdp_client_get_interface(GSSDP_CLIENT(path->context)));
+}
+
+// The path in use to a renderer has gone, fail over if it was seen on another interface
+static void device_path_lost(int dev)
+{
+	const char*	udn 		= gupnp_device_info_get_udn(GUPNP_DEVICE_INFO(aDevices[dev]));
+	char*		dev_name	= gupnp_device_info_get_friendly_name(GUPNP_DEVICE_INFO(aDevices[dev]));
+	int			alternate 	= best_alternate(udn);
+
+	if(alternate > FIND_ERR_NOT_FOUND)
+	{
+		PATH_S path = alternates[alternate];
+
+		remove_alternate(alternate);
+		switch_path(dev, &path);
+	}
+	else
+	{
+		TRACE_REGISTRY_REMOVE(udn, dev);
+
+		transport_device_unavailable(aDevices[dev]);
+		aDevices[dev] = NULL;
+		ui32DeviceCount--;
+		publish_renderers();
+		printf("%s Removed from entry %d\n", dev_name, dev);
+	}
+
+	g_free(dev_name);
 }
 
 static void
@@ -65,6 +276,27 @@ dmr_proxy_available_cb (GUPnPControlPoint *cp,
 	int 				dev_cnt 	= ui32DeviceCount;
 	int					entry 		= -1;
 	int 				entries		= MAX_DEV_ENTRIES;
+	int					active;
+	PATH_S				path;
+
+	path_init(&path, cp, proxy);
+
+	// Same renderer already known through another interface, keep the better path in use
+	if((active = find_udn(gupnp_device_info_get_udn(GUPNP_DEVICE_INFO(proxy)))) > FIND_ERR_NOT_FOUND)
+	{
+		if(path.rank < aDevicePaths[active].rank)
+		{
+			add_alternate(&aDevicePaths[active]);
+			switch_path(active, &path);
+		}
+		else
+		{
+			add_alternate(&path);
+		}
+
+		g_free(dev_name);
+		return;
+	}
 	
 	// Determine how many devices have already been detected. If none, skip detection
 	if(dev_cnt > 0)
@@ -111,9 +343,17 @@ dmr_proxy_available_cb (GUPnPControlPoint *cp,
 	if(entry > -1)
 	{
 		// Register device
-		aDevices[entry] = proxy;
+		aDevices[entry] 	= proxy;
+		aDevicePaths[entry] = path;
 		printf("%s added at entry %d\n", dev_name, entry);
+		TRACE_REGISTRY_ADD(gupnp_device_info_get_udn(GUPNP_DEVICE_INFO(proxy)), entry);
 		ui32DeviceCount++;
+		
+		publish_renderers();
+
+		transport_device_available(proxy);
+
+		apply_held_mute(dev_name);
 	}
 }
 
@@ -121,18 +361,38 @@ static void
 dmr_proxy_unavailable_cb (GUPnPControlPoint *cp,
                           GUPnPDeviceProxy  *proxy)
 {
-	// Look up device to be removed
-	char* 	dev_name	= gupnp_device_info_get_friendly_name(GUPNP_DEVICE_INFO(proxy));	
-	int 	dev 		= find(dev_name);
-	
+	int dev = find_proxy(proxy);
+	int i;
+
 	if( dev > FIND_ERR_NOT_FOUND )
 	{
-		aDevices[dev] = NULL;
-		ui32DeviceCount--;
-		printf("%s Removed from entry %d\n", dev_name, dev);
+		device_path_lost(dev);
+		return;
+	}
+
+	for(i = 0; i < num_alternates; i++)
+	{
+		if(alternates[i].proxy == proxy)
+		{
+			remove_alternate(i);
+			break;
+		}
 	}
 }
 
+static void
+dms_proxy_available_cb (GUPnPControlPoint *cp,
+                        GUPnPDeviceProxy  *proxy)
+{
+	browse_cache_server_available(proxy);
+}
+
+static void
+dms_proxy_unavailable_cb (GUPnPControlPoint *cp,
+                          GUPnPDeviceProxy  *proxy)
+{
+	browse_cache_server_unavailable(proxy);
+}
 
 static void
 on_context_available (GUPnPContextManager *context_manager,
@@ -140,8 +400,20 @@ on_context_available (GUPnPContextManager *context_manager,
                       gpointer             user_data)
 {
     GUPnPControlPoint *dmr_cp;
+    GUPnPControlPoint *dms_cp;
+    const char        *iface;
+
+    iface = gssdp_client_get_interface (GSSDP_CLIENT (context));
+
+    /* No SSDP traffic at all on excluded interfaces, the media server is not announced there either */
+    if (!interface_policy_allowed (iface))
+    {
+        printf("Not discovering on %s\n", iface);
+        return;
+    }
 
     dmr_cp = gupnp_control_point_new (context, MEDIA_RENDERER);
+    dms_cp = gupnp_control_point_new (context, MEDIA_SERVER);
 
 
     g_signal_connect (dmr_cp,
@@ -154,14 +426,80 @@ on_context_available (GUPnPContextManager *context_manager,
                       G_CALLBACK (dmr_proxy_unavailable_cb),
                       NULL);
 
+    g_signal_connect (dms_cp,
+                      "device-proxy-available",
+                      G_CALLBACK (dms_proxy_available_cb),
+                      NULL);
+
+    g_signal_connect (dms_cp,
+                      "device-proxy-unavailable",
+                      G_CALLBACK (dms_proxy_unavailable_cb),
+                      NULL);
+
     gssdp_resource_browser_set_active (GSSDP_RESOURCE_BROWSER (dmr_cp),
                                        TRUE);
+    gssdp_resource_browser_set_active (GSSDP_RESOURCE_BROWSER (dms_cp),
+                                       TRUE);
 
     /* Let context manager take care of the control point life cycle */
     gupnp_context_manager_manage_control_point (context_manager, dmr_cp);
+    gupnp_context_manager_manage_control_point (context_manager, dms_cp);
 
     /* We don't need to keep our own references to the control points */
     g_object_unref (dmr_cp);
+    g_object_unref (dms_cp);
+
+    media_server_context_available (context_manager, context);
+}
+
+static void
+on_context_unavailable (GUPnPContextManager *context_manager,
+                        GUPnPContext        *context,
+                        gpointer             user_data)
+{
+	int entries;
+	int i;
+
+	/* Proxies found through this context go with it, fail over what was reached through it */
+	for(i = num_alternates - 1; i >= 0; i--)
+	{
+		if(alternates[i].context == context)
+		{
+			remove_alternate(i);
+		}
+	}
+
+	for(entries = MAX_DEV_ENTRIES; entries >= 0; entries--)
+	{
+		if(aDevices[entries] != NULL && aDevicePaths[entries].context == context)
+		{
+			device_path_lost(entries);
+		}
+	}
+
+    media_server_context_unavailable (context);
+}
+
+typedef struct
+{
+	control_point_action_cb	cb;
+	void*					user_data;
+	unsigned long			trace_id;
+	
+} ACTION_CTX_S;
+
+// Fire-and-forget actions get a context too, it carries the correlation ID
+static ACTION_CTX_S* action_ctx_new(GUPnPDeviceProxy* proxy, const char* action, control_point_action_cb cb, void* user_data)
+{
+	ACTION_CTX_S* ctx = g_new0(ACTION_CTX_S, 1);
+	
+	ctx->cb 		= cb;
+	ctx->user_data 	= user_data;
+	ctx->trace_id 	= trace_current();
+
+	TRACE_ACTION_BEGIN(gupnp_device_info_get_udn(GUPNP_DEVICE_INFO(proxy)), action, ctx->trace_id);
+	
+	return ctx;
 }
 
 static void
@@ -169,7 +507,9 @@ set_volume_cb (GUPnPServiceProxy       *rendering_control,
                GUPnPServiceProxyAction *action,
                gpointer                 user_data)
 {
-	GError *error;
+	GError 			*error;
+	ACTION_CTX_S	*ctx 		= user_data;
+	int				success 	= 1;
 
     error = NULL;
     if (!gupnp_service_proxy_end_action (rendering_control,
@@ -187,8 +527,18 @@ set_volume_cb (GUPnPServiceProxy       *rendering_control,
 				error->message);
 	
 		g_error_free (error);
+		success = 0;
     }
 
+	TRACE_ACTION_END(gupnp_service_info_get_udn(GUPNP_SERVICE_INFO(rendering_control)), ctx->trace_id, success);
+
+	if(ctx->cb)
+	{
+		ctx->cb(success, ctx->user_data);
+	}
+
+	g_free(ctx);
+
 	g_object_unref (rendering_control);
 }
 
@@ -212,33 +562,9 @@ char* control_point_get_device_name(GUPnPDeviceProxy* device)
 	return gupnp_device_info_get_friendly_name(gupnp_device_info);
 }
 
-void control_point_list_devices(GUPnPDeviceProxy** output_array, int* count)
-{
-	int	dev_cnt = ui32DeviceCount;
-	int	entries	= MAX_DEV_ENTRIES;
-	
-	// While there are still devices
-	while(dev_cnt > 0)
-	{
-		// If entry is an existing device
-		if(aDevices[entries] != NULL)
-		{	
-			// Decrement the number of devices to look for
-			dev_cnt--;
-				
-			output_array[dev_cnt] = aDevices[entries];
-		}
-		
-		// Decrement the number of entries to examine
-		entries--;
-	}
-	
-	*count = ui32DeviceCount;
-}
-
-int control_point_set_volume(char* device, int volume)
+int control_point_begin_set_volume(char* device, int volume, control_point_action_cb cb, void* user_data)
 {
-	GUPnPDeviceProxy* cp = control_point_find_device( device );
+	GUPnPDeviceProxy* cp = lookup_renderer( device );
 				
 	// If the device has been found
 	if(cp)
@@ -249,7 +575,7 @@ int control_point_set_volume(char* device, int volume)
 		gupnp_service_proxy_begin_action (get_rendering_control(cp),
 								"SetVolume",
 								set_volume_cb,
-								NULL,
+								action_ctx_new(cp, "SetVolume", cb, user_data),
 								"InstanceID",
 								G_TYPE_UINT,
 								0,
@@ -260,6 +586,7 @@ int control_point_set_volume(char* device, int volume)
 								G_TYPE_UINT,
 								desired_volume,
 								NULL);	
+		g_object_unref(cp);
 		return 1;
 	}
 	else
@@ -268,9 +595,36 @@ int control_point_set_volume(char* device, int volume)
 	}
 }
 
-int control_point_set_mute(char* device, int mute)
+int control_point_begin_set_mute(char* device, int mute, control_point_action_cb cb, void* user_data)
 {
-	GUPnPDeviceProxy* cp = control_point_find_device( device );
+	GUPnPDeviceProxy* 	cp 		= lookup_renderer( device );
+	RENDERER_STATE_S*	state;
+	int					held 	= 0;
+
+	pthread_mutex_lock(&renderer_lock);
+
+	if((state = renderer_state(device, 1)) != NULL)
+	{
+		state->muted = mute;
+
+		// Known from before a restart but not rediscovered yet, apply it on arrival
+		if(cp == NULL && state->expected)
+		{
+			state->pending 	= 1;
+			held 			= 1;
+		}
+	}
+
+	pthread_mutex_unlock(&renderer_lock);
+
+	if(held)
+	{
+		if(cb)
+		{
+			cb(1, user_data);
+		}
+		return 1;
+	}
 						
 	// If the device has been found
 	if(cp)	
@@ -279,7 +633,7 @@ int control_point_set_mute(char* device, int mute)
 								get_rendering_control(cp),
 								"SetMute",
 								set_volume_cb,
-								NULL,
+								action_ctx_new(cp, "SetMute", cb, user_data),
 								"InstanceID",
 								G_TYPE_UINT,
 								0,
@@ -290,6 +644,36 @@ int control_point_set_mute(char* device, int mute)
 								G_TYPE_UINT,
 								mute,
 								NULL);		
+		g_object_unref(cp);
+		return 1;	
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+int control_point_begin_get_volume(char* device, control_point_action_cb cb, void* user_data)
+{
+	GUPnPDeviceProxy* cp = lookup_renderer( device );
+						
+	// If the device has been found
+	if(cp)	
+	{
+		// Result is not needed, the round trip alone wakes the renderer
+		gupnp_service_proxy_begin_action (
+								get_rendering_control(cp),
+								"GetVolume",
+								set_volume_cb,
+								action_ctx_new(cp, "GetVolume", cb, user_data),
+								"InstanceID",
+								G_TYPE_UINT,
+								0,
+								"Channel",
+								G_TYPE_STRING,
+								"Master",
+								NULL);		
+		g_object_unref(cp);
 		return 1;	
 	}
 	else
@@ -298,6 +682,53 @@ int control_point_set_mute(char* device, int mute)
 	}
 }
 
+int control_point_set_volume(char* device, int volume)
+{
+	return control_point_begin_set_volume(device, volume, NULL, NULL);
+}
+
+int control_point_set_mute(char* device, int mute)
+{
+	return control_point_begin_set_mute(device, mute, NULL, NULL);
+}
+
+int control_point_save_renderers(SNAPSHOT_RENDERER_S* renderers, int max)
+{
+	int i;
+
+	pthread_mutex_lock(&renderer_lock);
+
+	for(i = 0; i < num_renderer_states && i < max; i++)
+	{
+		memcpy(renderers[i].name, renderer_states[i].name, SNAPSHOT_NAME_LEN);
+		renderers[i].muted = renderer_states[i].muted;
+	}
+
+	pthread_mutex_unlock(&renderer_lock);
+
+	return i;
+}
+
+void control_point_restore_renderers(const SNAPSHOT_RENDERER_S* renderers, int count)
+{
+	int i;
+
+	pthread_mutex_lock(&renderer_lock);
+
+	for(i = 0; i < count; i++)
+	{
+		RENDERER_STATE_S* state = renderer_state(renderers[i].name, 1);
+
+		if(state)
+		{
+			state->muted 	= renderers[i].muted;
+			state->expected = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&renderer_lock);
+}
+
 void control_point_init_and_run()
 {
 	GMainLoop *main_loop;
@@ -309,6 +740,11 @@ void control_point_init_and_run()
                       "context-available",
                       G_CALLBACK (on_context_available),
                       NULL);
+
+    g_signal_connect (context_manager,
+                      "context-unavailable",
+                      G_CALLBACK (on_context_unavailable),
+                      NULL);
                       
 	/* Run the main loop */
 	main_loop = g_main_loop_new (NULL, FALSE);
@@ -1,16 +1,33 @@
+#ifndef CONTROL_POINT_H
+#define CONTROL_POINT_H
+
 #include <libgupnp/gupnp-control-point.h>
 #include <libgupnp-av/gupnp-av.h>
+#include "snapshot.h"
 
 #define MAX_DEV_ENTRIES 	99
 
-void control_point_init_and_run();
+typedef void (*control_point_action_cb)(int success, void* user_data);
 
-void control_point_list_devices(GUPnPDeviceProxy** output_array, int* count);
+void control_point_init_and_run();
 
 char* control_point_get_device_name(GUPnPDeviceProxy* device);
 
-GUPnPDeviceProxy* control_point_find_device( char* device );
-
+// Renderers are looked up in the published renderer list, which any thread
+// may read; the actions themselves go out on the GLib thread, as the action
+// queue issues them
 int control_point_set_volume(char* device, int volume);
 
 int control_point_set_mute(char* device, int mute);
+
+int control_point_begin_set_volume(char* device, int volume, control_point_action_cb cb, void* user_data);
+
+int control_point_begin_set_mute(char* device, int mute, control_point_action_cb cb, void* user_data);
+
+int control_point_begin_get_volume(char* device, control_point_action_cb cb, void* user_data);
+
+int control_point_save_renderers(SNAPSHOT_RENDERER_S* renderers, int max);
+
+void control_point_restore_renderers(const SNAPSHOT_RENDERER_S* renderers, int count);
+
+#endif	/* CONTROL_POINT_H */
@@ -48,6 +48,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
+#include <libconfig.h>
 
 #include "server_low.h"
 #include "client_low.h"
@@ -56,6 +57,16 @@
 #include "flow/core/flow_memalloc.h"
 #include "log.h"
 #include "control_point.h"
+#include "action_queue.h"
+#include "prewarm.h"
+#include "transport.h"
+#include "media_server.h"
+#include "browse_cache.h"
+#include "outbox.h"
+#include "snapshot.h"
+#include "interface_policy.h"
+#include "metrics.h"
+#include "trace.h"
 #include <pthread.h>
 #include "timeout.h"
 
@@ -74,12 +85,34 @@
 #define RESOURCE_INSTANCE_ID		(0)
 #define FLOW_ACCESS_OBJECT_ID		(20001)
 #define FLOW_OBJECT_INSTANCE_ID		(0)
-#define BUTTON_OBJECT_ID	(3200)
-#define BUTTON_RESOURCE_ID	(5560)
-#define BUTTON_STR			"button"
-#define BUTTON2_STR			"button2"
-#define SPEAKER1_STR		"ewc_1"
-#define SPEAKER2_STR		"ewc_2"
+#define PRESENCE_OBJECT_ID			(3302)
+#define PRESENCE_STATE_ID			(5500)
+#define PRESENCE_COUNTER_ID			(5501)
+#define PRESENCE_TIMESTAMP_ID		(5518)
+#define PRESENCE_BUSY_TO_CLEAR_ID	(5903)
+#define POWER_OBJECT_ID				(20002)
+#define POWER_OBJECT_INSTANCE_ID	(0)
+#define POWER_CPU_ID				(0)
+#define POWER_LPM_ID				(1)
+#define POWER_LISTEN_ID				(2)
+#define POWER_TRANSMIT_ID			(3)
+#define POWER_CHARGE_ID				(4)
+#define POWER_TICK_RATE_ID			(5)
+#define SERVER_OBJECT_ID			(1)
+#define SERVER_OBJECT_INSTANCE_ID	(0)
+#define SERVER_PMIN_ID				(2)
+#define SERVER_PMAX_ID				(3)
+#define PRESENCE_OBJECT_INSTANCE_ID	(0)
+/** Registered clients with this prefix are motion sensors. */
+#define SENSOR_ENDPOINT_PREFIX	"MotionSensor"
+/** Sensors served at once, each has its own pair of observe callbacks. */
+#define MAX_SENSORS			(64)
+/** Seconds between looks for sensors that register once observation runs. */
+#define DISCOVERY_INTERVAL_S	(10)
+/** Seconds without motion before a room counts as vacant. */
+#define VACANCY_TIMEOUT		(10)
+/** Gateway configuration file, optional. */
+#define GATEWAY_CONFIG_FILE	"/etc/flow_control/flow_control.cfg"
 
 //! @endcond
 
@@ -122,53 +155,191 @@ typedef struct
 
 /** Variable storing device registration status. */
 static bool isDeviceRegistered = false;
+/** Occupancy as last reported to the flow user. */
+static bool roomOccupied[MAX_SENSORS] = { false };
 /** Interrupt signal have been issued. */
 static bool receivedSignal = false;
-/** Callback function, called when button state gets updated. */
-static int ButtonStateChangeCallback(FlowDeviceMgmtHandle * handle);
-static int ButtonStateChangeCallback2(FlowDeviceMgmtHandle * handle);
+/** Called with the sensor's index when an observed resource gets updated. */
+static int MotionStateChanged(unsigned int sensor, FlowDeviceMgmtHandle * handle);
+static int PowerReported(unsigned int sensor, FlowDeviceMgmtHandle * handle);
+static unsigned int DiscoverSensors(void);
 /** Set default debug level to info. */
 int debug_level = LOG_INFO;
-static TIMEOUT_S stimeout[2];
+static TIMEOUT_S stimeout[MAX_SENSORS];
 static int devices = 0;
 
-/** Initializing objects. */
-static OBJECT_T objects[] =
+/**
+ * IPSO Presence sensor resources, the same on every motion sensor. The instance
+ * is observed as a whole, so the counter arrives with the state.
+ */
+static RESOURCE_T presenceResources[] =
 {
 	{
-		"ButtonDevice",
-		BUTTON_OBJECT_ID,
+		PRESENCE_STATE_ID,
+		0,
+		FlowDeviceMgmtResourceType_TypeBoolean,
+		true,
+		"Digital Input State"
+	},
+	{
+		PRESENCE_COUNTER_ID,
+		0,
+		FlowDeviceMgmtResourceType_TypeInteger,
+		true,
+		"Digital Input Counter"
+	},
+	{
+		PRESENCE_TIMESTAMP_ID,
 		0,
-		"Digital Input",
-		1,
-		(RESOURCE_T []){
-							{
-								BUTTON_RESOURCE_ID,
-								0,
-								FlowDeviceMgmtResourceType_TypeBoolean,
-								true,
-								BUTTON_STR
-							},
-						}
+		FlowDeviceMgmtResourceType_TypeTime,
+		false,
+		"Timestamp"
 	},
 	{
-		"ButtonDevice2",
-		BUTTON_OBJECT_ID,
-		1,
-		"Digital Input",
-		1,
-		(RESOURCE_T []){
-							{
-								BUTTON_RESOURCE_ID,
-								0,
-								FlowDeviceMgmtResourceType_TypeBoolean,
-								true,
-								BUTTON2_STR
-							},
-						}
+		PRESENCE_BUSY_TO_CLEAR_ID,
+		0,
+		FlowDeviceMgmtResourceType_TypeInteger,
+		false,
+		"Busy to Clear delay"
 	},
 };
 
+/** Presence object definition, one instance on each motion sensor. */
+static OBJECT_T presenceObject =
+{
+	NULL,
+	PRESENCE_OBJECT_ID,
+	PRESENCE_OBJECT_INSTANCE_ID,
+	"Presence",
+	ARRAY_SIZE(presenceResources),
+	presenceResources
+};
+
+/** Energest accounting on every motion sensor, ticks per state and the estimated charge in uAh. */
+static RESOURCE_T powerResources[] =
+{
+	{
+		POWER_CPU_ID,
+		0,
+		FlowDeviceMgmtResourceType_TypeInteger,
+		false,
+		"CPU Time"
+	},
+	{
+		POWER_LPM_ID,
+		0,
+		FlowDeviceMgmtResourceType_TypeInteger,
+		false,
+		"Low Power Time"
+	},
+	{
+		POWER_LISTEN_ID,
+		0,
+		FlowDeviceMgmtResourceType_TypeInteger,
+		false,
+		"Listen Time"
+	},
+	{
+		POWER_TRANSMIT_ID,
+		0,
+		FlowDeviceMgmtResourceType_TypeInteger,
+		false,
+		"Transmit Time"
+	},
+	{
+		POWER_CHARGE_ID,
+		0,
+		FlowDeviceMgmtResourceType_TypeInteger,
+		true,
+		"Charge"
+	},
+	{
+		POWER_TICK_RATE_ID,
+		0,
+		FlowDeviceMgmtResourceType_TypeInteger,
+		false,
+		"Tick Rate"
+	},
+};
+
+/** Power object definition, one instance on each motion sensor. */
+static OBJECT_T powerObject =
+{
+	NULL,
+	POWER_OBJECT_ID,
+	POWER_OBJECT_INSTANCE_ID,
+	"Power",
+	ARRAY_SIZE(powerResources),
+	powerResources
+};
+
+/** Room and notification periods of a sensor, from the configuration. */
+typedef struct
+{
+	char clientID[SNAPSHOT_NAME_LEN];
+	char speaker[SNAPSHOT_NAME_LEN];
+	bool periods;
+	int pmin;
+	int pmax;
+} SENSOR_CONFIG_T;
+
+/** Sensors to serve when the configuration names none, one per NODE_ID built firmware. */
+static SENSOR_CONFIG_T sensorConfigs[MAX_SENSORS] =
+{
+	{ SENSOR_ENDPOINT_PREFIX "1", "ewc_1", false, 0, 0 },
+	{ SENSOR_ENDPOINT_PREFIX "2", "ewc_2", false, 0, 0 },
+};
+static unsigned int numSensorConfigs = 2;
+/** Used for sensors that are not listed, such as firmware built without NODE_ID, once default_speaker names a room. */
+static SENSOR_CONFIG_T defaultSensorConfig = { "", "", false, 0, 0 };
+
+/** Sensors in the order their registration was found, with their configuration. */
+static char clientIDs[MAX_SENSORS][SNAPSHOT_NAME_LEN];
+static OBJECT_T objects[MAX_SENSORS];
+static const SENSOR_CONFIG_T *sensorConfig[MAX_SENSORS];
+
+/**
+ * Observe callbacks are only handed the resource handle, so every sensor slot
+ * has its own pair, which passes the slot's index on.
+ */
+typedef int (*SENSOR_CALLBACK_T)(FlowDeviceMgmtHandle * handle);
+
+#define SENSOR_SLOTS(X) \
+	X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) \
+	X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) \
+	X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) \
+	X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31) \
+	X(32) X(33) X(34) X(35) X(36) X(37) X(38) X(39) \
+	X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47) \
+	X(48) X(49) X(50) X(51) X(52) X(53) X(54) X(55) \
+	X(56) X(57) X(58) X(59) X(60) X(61) X(62) X(63)
+
+#define SENSOR_CALLBACKS(n) \
+	static int PresenceCallback##n(FlowDeviceMgmtHandle * handle) { return MotionStateChanged(n, handle); } \
+	static int PowerCallback##n(FlowDeviceMgmtHandle * handle) { return PowerReported(n, handle); }
+#define PRESENCE_CALLBACK(n)	PresenceCallback##n,
+#define POWER_CALLBACK(n)		PowerCallback##n,
+
+SENSOR_SLOTS(SENSOR_CALLBACKS)
+
+static const SENSOR_CALLBACK_T presenceCallbacks[MAX_SENSORS] = { SENSOR_SLOTS(PRESENCE_CALLBACK) };
+static const SENSOR_CALLBACK_T powerCallbacks[MAX_SENSORS] = { SENSOR_SLOTS(POWER_CALLBACK) };
+
+/** When each sensor's observation was issued, and whether its first notification has arrived. */
+static struct timespec observeIssued[ARRAY_SIZE(objects)];
+static bool sensorOnline[ARRAY_SIZE(objects)];
+
+/** Presence instance observed on each sensor. */
+static FlowDeviceMgmtKey presenceKeys[ARRAY_SIZE(objects)];
+/** Each sensor's motion counter, read through a handle kept while it is observed; -1 before the first notification. */
+static FlowDeviceMgmtHandle *counterHandles[ARRAY_SIZE(objects)];
+static int64_t lastCounter[ARRAY_SIZE(objects)];
+/** Each sensor's state as of its last notification, -1 before the first. */
+static int lastState[ARRAY_SIZE(objects)];
+
+/** Charge resource observed on each sensor. */
+static FlowDeviceMgmtKey powerKeys[ARRAY_SIZE(objects)];
+
 /***************************************************************************************************
  * Implementation
  **************************************************************************************************/
@@ -188,78 +359,524 @@ static void INThandler(int sig)
  */
 static void CancelObserve(void)
 {
-	unsigned int i, j;
+	unsigned int i;
 
 	for (i = 0; i < devices; i++)
 	{
-		for (j = 0; j < objects[i].numResources; j++)
+		if (FlowDeviceMgmtServer_CancelObserve(presenceKeys[i]) != 0)
 		{
-			if (objects[i].resources[j].doObserve)
-			{
-				FlowDeviceMgmtKey key = { {0} };
+			FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_CancelObserve failed");
+		}
 
-				key = FlowDeviceMgmtServer_ToResourceKey(objects[i].clientID,
-															objects[i].objectID,
-															objects[i].objectInstanceID,
-															objects[i].resources[j].resourceID);
+		if (counterHandles[i])
+		{
+			FlowDeviceMgmtServer_DeleteHandle(counterHandles[i]);
+			counterHandles[i] = NULL;
+		}
+	}
 
-				if (FlowDeviceMgmtServer_CancelObserve(key) != 0)
-				{
-					FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_CancelObserve failed");
-				}
+	for (i = 0; i < devices; i++)
+	{
+		if (FlowDeviceMgmtServer_CancelObserve(powerKeys[i]) != 0)
+		{
+			FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_CancelObserve failed");
+		}
+	}
+}
+
+/**
+ * @brief Log per-class action dispatcher statistics.
+ */
+static void LogActionQueueStats(void)
+{
+	static const char *classNames[ACTION_CLASS_COUNT] = { "interactive", "background" };
+	unsigned int i;
+
+	for (i = 0; i < ACTION_CLASS_COUNT; i++)
+	{
+		ACTION_CLASS_STATS_S stats;
+
+		action_queue_get_stats(i, &stats);
+
+		LOG(LOG_INFO, "Actions %s: enqueued %lu dispatched %lu failed %lu (timed out %lu) coalesced %lu superseded %lu "
+				"dropped %lu, depth %u (max %u), wait avg %lluus max %luus",
+				classNames[i],
+				stats.enqueued,
+				stats.dispatched,
+				stats.failed,
+				stats.timed_out,
+				stats.coalesced,
+				stats.superseded,
+				stats.dropped,
+				stats.depth,
+				stats.max_depth,
+				stats.dispatched ? (stats.total_wait_us / stats.dispatched) : 0,
+				stats.max_wait_us);
+	}
+}
+
+/**
+ * @brief Log how many renderer pre-warms were used versus wasted.
+ */
+static void LogPrewarmStats(void)
+{
+	PREWARM_STATS_S stats;
+
+	prewarm_get_stats(&stats);
+
+	LOG(LOG_INFO, "Pre-warm: issued %lu used %lu wasted %lu skipped %lu failed %lu",
+			stats.issued,
+			stats.used,
+			stats.wasted,
+			stats.skipped,
+			stats.failed);
+}
+
+/**
+ * @brief Log browse cache statistics.
+ */
+static void LogBrowseCacheStats(void)
+{
+	BROWSE_CACHE_STATS_S stats;
+
+	browse_cache_get_stats(&stats);
+
+	LOG(LOG_INFO, "Browse cache: hits %lu misses %lu browses %lu invalidations %lu items %lu",
+			stats.hits,
+			stats.misses,
+			stats.browses,
+			stats.invalidations,
+			stats.items);
+}
+
+/**
+ * @brief Log offline outbox statistics.
+ */
+static void LogOutboxStats(void)
+{
+	OUTBOX_STATS_S stats;
+
+	outbox_get_stats(&stats);
+
+	LOG(LOG_INFO, "Outbox: depth %u appended %lu sent %lu send failures %lu evicted %lu lost %lu, "
+			"%lu flushes (%lu failed) %lu bytes written (flush avg %lluus max %luus), %lu bytes on flash",
+			stats.depth,
+			stats.appended,
+			stats.sent,
+			stats.send_failures,
+			stats.evicted,
+			stats.lost,
+			stats.flushes,
+			stats.flush_failures,
+			stats.bytes_written,
+			stats.flushes ? (stats.total_flush_us / stats.flushes) : 0,
+			stats.max_flush_us,
+			stats.disk_bytes);
+}
+
+/**
+ * @brief Log flow memory manager pool statistics.
+ */
+static void LogMemoryManagerStats(void)
+{
+	MemoryManagerStats stats;
+
+	GetMemoryManagerStats(&stats);
+
+	LOG(LOG_INFO, "Memory managers: acquired %lu released %lu waits %lu",
+			stats.acquired,
+			stats.released,
+			stats.waits);
+}
+
+/**
+ * @brief Read the sensors to serve, their rooms and notification periods.
+ *        A configured list replaces the default one.
+ * @param cfg gateway configuration.
+ */
+static void ReadSensorConfig(config_t *cfg)
+{
+	config_setting_t *list = config_lookup(cfg, "sensors");
+	const char *speaker;
+	unsigned int i;
+
+	if (config_lookup_string(cfg, "default_speaker", &speaker))
+	{
+		strncpy(defaultSensorConfig.speaker, speaker, SNAPSHOT_NAME_LEN - 1);
+	}
+
+	if (list == NULL)
+	{
+		return;
+	}
+
+	numSensorConfigs = 0;
+
+	for (i = 0; (i < config_setting_length(list)) && (numSensorConfigs < MAX_SENSORS); i++)
+	{
+		config_setting_t *entry = config_setting_get_elem(list, i);
+		SENSOR_CONFIG_T *sensor = &sensorConfigs[numSensorConfigs];
+		const char *client;
+		const char *speaker;
+
+		if (!config_setting_lookup_string(entry, "client", &client) ||
+			!config_setting_lookup_string(entry, "speaker", &speaker))
+		{
+			LOG(LOG_WARN, "Ignoring sensor entry %u", i);
+			continue;
+		}
+
+		memset(sensor, 0, sizeof(*sensor));
+		strncpy(sensor->clientID, client, SNAPSHOT_NAME_LEN - 1);
+		strncpy(sensor->speaker, speaker, SNAPSHOT_NAME_LEN - 1);
+		sensor->periods = config_setting_lookup_int(entry, "pmin", &sensor->pmin) |
+							config_setting_lookup_int(entry, "pmax", &sensor->pmax);
+		numSensorConfigs++;
+
+		LOG(LOG_INFO, "Sensor %s: speaker %s, pmin %ds, pmax %ds", client, speaker,
+				sensor->pmin,
+				sensor->pmax);
+	}
+}
+
+/**
+ * @brief Read the optional gateway configuration and configure features from it.
+ */
+static void ReadGatewayConfig(void)
+{
+	config_t cfg;
+
+	config_init(&cfg);
+
+	if (config_read_file(&cfg, GATEWAY_CONFIG_FILE))
+	{
+		prewarm_configure(&cfg);
+		transport_configure(&cfg);
+		media_server_configure(&cfg);
+		outbox_configure(&cfg);
+		interface_policy_configure(&cfg);
+		metrics_configure(&cfg);
+		ReadSensorConfig(&cfg);
+	}
+	else
+	{
+		LOG(LOG_INFO, "No gateway configuration (%s), using defaults", GATEWAY_CONFIG_FILE);
+	}
+
+	config_destroy(&cfg);
+}
+
+/**
+ * @brief Write a snapshot of the runtime state for a warm restart.
+ */
+static void SaveState(void)
+{
+	SNAPSHOT_S snapshot;
+	unsigned int i;
+
+	memset(&snapshot, 0, sizeof(snapshot));
+
+	for (i = 0; (i < devices) && (i < SNAPSHOT_MAX_SENSORS); i++)
+	{
+		SNAPSHOT_SENSOR_S *sensor = &snapshot.sensors[i];
+
+		strncpy(sensor->client_id, objects[i].clientID, SNAPSHOT_NAME_LEN - 1);
+		sensor->object_id = objects[i].objectID;
+		sensor->instance_id = objects[i].objectInstanceID;
+		sensor->observed = true;
+		sensor->occupied = roomOccupied[i];
+		sensor->remaining_s = timeout_remaining(&stimeout[i]);
+	}
+
+	snapshot.num_sensors = i;
+	snapshot.num_renderers = control_point_save_renderers(snapshot.renderers, SNAPSHOT_MAX_RENDERERS);
+
+	if (snapshot_write(&snapshot) != 0)
+	{
+		LOG(LOG_WARN, "Failed to write state snapshot");
+	}
+}
+
+/**
+ * @brief Log how long a sensor took to come online, on its first notification.
+ * @param sensor index of the sensor in objects.
+ */
+static void SensorNotified(unsigned int sensor)
+{
+	struct timespec now;
+	long setupMs;
+
+	if (sensorOnline[sensor])
+	{
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sensorOnline[sensor] = true;
+	setupMs = ((now.tv_sec - observeIssued[sensor].tv_sec) * 1000L) +
+				((now.tv_nsec - observeIssued[sensor].tv_nsec) / 1000000L);
+
+	metrics_observe(METRIC_SENSOR_SETUP_MS, setupMs);
+
+	LOG(LOG_INFO, "Sensor %s online after %ldms", objects[sensor].clientID, setupMs);
+}
+
+/**
+ * @brief Check whether an object type's registration was already pulled during this setup.
+ * @param objectID object type to check.
+ * @param first first sensor of this setup.
+ * @param sensor sensor being set up.
+ * @return true if an earlier sensor of this setup has the same object type, else false.
+ */
+static bool RegistrationPulled(ObjectIDType objectID, unsigned int first, unsigned int sensor)
+{
+	unsigned int i;
+
+	for (i = first; i < sensor; i++)
+	{
+		if (objects[i].objectID == objectID)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Write an integer resource on a constrained device.
+ * @param clientID client that holds the resource.
+ * @param objectID object ID of object which holds the resource.
+ * @param objectInstanceID object instance ID of object which holds the resource.
+ * @param resourceID resource ID of resource to write.
+ * @param value value to write.
+ * @return true if the resource was written, else false.
+ */
+static bool WriteIntegerResource(const char *clientID,
+								ObjectIDType objectID,
+								ObjectInstanceIDType objectInstanceID,
+								ResourceIDType resourceID,
+								int64_t value)
+{
+	bool success = true;
+	FlowDeviceMgmtKey key = { {0} };
+
+	key = FlowDeviceMgmtServer_ToResourceInstanceKey(clientID,
+														objectID,
+														objectInstanceID,
+														resourceID,
+														RESOURCE_INSTANCE_ID);
+
+	/* construct a resource handle for future SET operation */
+	FlowDeviceMgmtHandle * handle = FlowDeviceMgmtServer_NewHandle(key);
+
+	if (handle)
+	{
+		if (FlowDeviceMgmtServer_SetValue(handle, FlowDeviceMgmtServer_IntegerValue(&value)))
+		{
+			FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_SetValue() failed");
+			success = false;
+		}
+		else
+		{
+			key = FlowDeviceMgmtServer_ToObjectInstanceKey(clientID,
+															objectID,
+															objectInstanceID);
+
+			/* sync the local resource to the daemon */
+			if (FlowDeviceMgmtServer_Write(key))
+			{
+				FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_Write failed");
+				success = false;
 			}
 		}
+		FlowDeviceMgmtServer_DeleteHandle(handle);
 	}
+	else
+	{
+		FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_NewHandle() failed");
+		success = false;
+	}
+	return success;
 }
 
 /**
- * @brief Start observing a resource.
- *        Register a callback function, which gets called on resource value change.
+ * @brief Tell each configured sensor how often it may and must notify.
+ *        The periods go to the sensor's LwM2M Server object, which the
+ *        motion clients consult on every report.
+ * @param first first sensor to set up, the ones before are already observed.
  */
-static void StartObserving(void)
+static void WriteObservePeriods(unsigned int first)
 {
-	unsigned int i, j;
+	unsigned int i;
+	bool pulled = false;
 
-	for (i = 0; i < devices; i++)
+	for (i = first; i < devices; i++)
 	{
-		for (j = 0; j < objects[i].numResources; j++)
+		if (!sensorConfig[i]->periods)
 		{
-			if (objects[i].resources[j].doObserve)
+			continue;
+		}
+
+		if (!pulled)
+		{
+			if (FlowDeviceMgmtServer_PullRegistration(SERVER_OBJECT_ID))
 			{
-				FlowDeviceMgmtKey key = { {0} };
+				FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_PullRegistration failed");
+				return;
+			}
+			pulled = true;
+		}
 
-				FlowDeviceMgmt_Process(1 /*second*/);
+		if (!WriteIntegerResource(objects[i].clientID, SERVER_OBJECT_ID, SERVER_OBJECT_INSTANCE_ID,
+									SERVER_PMIN_ID, sensorConfig[i]->pmin) ||
+			!WriteIntegerResource(objects[i].clientID, SERVER_OBJECT_ID, SERVER_OBJECT_INSTANCE_ID,
+									SERVER_PMAX_ID, sensorConfig[i]->pmax))
+		{
+			LOG(LOG_ERR, "Writing notification periods failed for %s", objects[i].clientID);
+		}
+	}
+}
 
-				printf("Pull registration %d %d\n", i,objects[i].objectInstanceID);
+/**
+ * @brief Observe each sensor's power accounting.
+ *        The sensors only update it every few minutes, so this costs little airtime.
+ * @param first first sensor to set up, the ones before are already observed.
+ */
+static void ObservePower(unsigned int first)
+{
+	unsigned int i;
 
-				if (FlowDeviceMgmtServer_PullRegistration(objects[i].objectID))
-				{
-					FlowDeviceMgmt_PError("FlowDeviceMgmtServer_PullRegistration failed");
-					return;
-				}
+	if (FlowDeviceMgmtServer_PullRegistration(POWER_OBJECT_ID))
+	{
+		FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_PullRegistration failed");
+		return;
+	}
 
-				key = FlowDeviceMgmtServer_ToResourceKey(objects[i].clientID,
-															objects[i].objectID,
-															objects[i].objectInstanceID,
-															objects[i].resources[j].resourceID);
+	for (i = first; i < devices; i++)
+	{
+		powerKeys[i] = FlowDeviceMgmtServer_ToResourceKey(objects[i].clientID,
+															POWER_OBJECT_ID,
+															POWER_OBJECT_INSTANCE_ID,
+															POWER_CHARGE_ID);
 
-				if (FlowDeviceMgmtServer_Observe(key, ((i)?ButtonStateChangeCallback2:ButtonStateChangeCallback)))
-				{
-					FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_Observe failed");
-				}
-			}
+		if (FlowDeviceMgmtServer_Observe(powerKeys[i], powerCallbacks[i]))
+		{
+			FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_Observe failed");
 		}
 	}
-	
-	// catch CTRL-C to ensure clean-up
-	signal(SIGINT, INThandler);
+}
+
+/**
+ * @brief Observe the sensors added since the last call.
+ *        Register a callback function, which gets called on resource value change.
+ *        Observations are issued back to back; each sensor's first notification
+ *        arrives through the processing loop and reports its setup time.
+ * @param first first sensor to set up, the ones before are already observed.
+ */
+static void ObserveSensors(unsigned int first)
+{
+	unsigned int i;
+	struct timespec start, issued;
+
+	if (first == devices)
+	{
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	WriteObservePeriods(first);
+
+	for (i = first; i < devices; i++)
+	{
+		/* Once per object type rather than once per sensor */
+		if (!RegistrationPulled(objects[i].objectID, first, i) &&
+			FlowDeviceMgmtServer_PullRegistration(objects[i].objectID))
+		{
+			FlowDeviceMgmt_PError("FlowDeviceMgmtServer_PullRegistration failed");
+			return;
+		}
+
+		/* The whole instance, so state, counter and timestamp come in one notification */
+		presenceKeys[i] = FlowDeviceMgmtServer_ToObjectInstanceKey(objects[i].clientID,
+																	objects[i].objectID,
+																	objects[i].objectInstanceID);
+		lastCounter[i] = -1;
+		lastState[i] = -1;
+		counterHandles[i] = FlowDeviceMgmtServer_NewHandle(
+								FlowDeviceMgmtServer_ToResourceKey(objects[i].clientID,
+																	objects[i].objectID,
+																	objects[i].objectInstanceID,
+																	PRESENCE_COUNTER_ID));
+
+		clock_gettime(CLOCK_MONOTONIC, &observeIssued[i]);
+
+		if (FlowDeviceMgmtServer_Observe(presenceKeys[i], presenceCallbacks[i]))
+		{
+			FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_Observe failed");
+		}
+	}
+
+	ObservePower(first);
+
+	clock_gettime(CLOCK_MONOTONIC, &issued);
+
+	LOG(LOG_INFO, "Observation of %d sensors issued in %ldms",
+			devices - first,
+			((issued.tv_sec - start.tv_sec) * 1000L) +
+			((issued.tv_nsec - start.tv_nsec) / 1000000L));
+}
+
+/**
+ * @brief Start the UPnP control point, once the first sensor is served.
+ */
+static void StartControlPoint(void)
+{
+	static bool started = false;
+	pthread_t control_point_thread;
+
+	if (!started && devices > 0)
+	{
+		pthread_create( &control_point_thread, NULL, ((void *)control_point_init_and_run), NULL);
+		started = true;
+	}
+}
+
+/**
+ * @brief Serve the observed sensors until stopped, and keep looking for ones that register later.
+ */
+static void StartObserving(void)
+{
+	unsigned int ticks = 0;
 
 	while(receivedSignal == false)
 	{
 		FlowDeviceMgmt_Process(1 /*second*/);
+
+		if (++ticks % DISCOVERY_INTERVAL_S == 0)
+		{
+			unsigned int first = devices;
+
+			if (DiscoverSensors() > 0)
+			{
+				StartControlPoint();
+				ObserveSensors(first);
+			}
+		}
+
+		if (ticks % SNAPSHOT_INTERVAL_S == 0)
+		{
+			SaveState();
+		}
 	}
 
+	SaveState();
 	CancelObserve();
+	LogActionQueueStats();
+	LogPrewarmStats();
+	LogBrowseCacheStats();
+	LogOutboxStats();
+	LogMemoryManagerStats();
 }
 
 /**
@@ -269,50 +886,47 @@ static void StartObserving(void)
 static bool RegisterObjectsAsClient(void)
 {
 	bool success = true;
-	unsigned int i, j;
+	unsigned int j;
+	const OBJECT_T *object = &presenceObject;
 	FlowDeviceMgmtFlags flags = FlowDeviceMgmt_ToFlags(FlowDeviceMgmtOperations_RW,
 														FlowDeviceMgmtMandatory_Mandatory);
-	/* Register objects */
-	for (i = 0; (i < ARRAY_SIZE(objects)) && success; i++)
+	/* Check if object is registered or not */
+	if (FlowDeviceMgmt_PullRegistration(object->objectID) != 0)
 	{
-		/* Check if object is registered or not */
-		if (FlowDeviceMgmt_PullRegistration(objects[i].objectID) != 0)
+		/* Defining object */
+		if (FlowDeviceMgmt_RegisterObjectType(object->objectName,
+												object->objectID,
+												true,
+												flags) == -1)
 		{
-			/* Defining object */
-			if (FlowDeviceMgmt_RegisterObjectType(objects[i].objectName,
-													objects[i].objectID,
-													true,
-													flags) == -1)
-			{
-				FlowDeviceMgmt_PError("Registering object failed with");
-				success = false;
-			}
-			else
+			FlowDeviceMgmt_PError("Registering object failed with");
+			success = false;
+		}
+		else
+		{
+			/* Object defined successfully. Now define all its resources */
+			for (j = 0; j < object->numResources; j++)
 			{
-				/* Object defined successfully. Now define all its resources */
-				for (j = 0; j < objects[i].numResources; j++)
+				if (FlowDeviceMgmt_RegisterResourceType(object->resources[j].resourceName,
+														object->objectID,
+														object->resources[j].resourceID,
+														object->resources[j].resourceType,
+														true,
+														flags))
 				{
-					if (FlowDeviceMgmt_RegisterResourceType(objects[i].resources[j].resourceName,
-															objects[i].objectID,
-															objects[i].resources[j].resourceID,
-															objects[i].resources[j].resourceType,
-															true,
-															flags))
-					{
-						FlowDeviceMgmt_PError("Registering resource failed with");
-						success = false;
-					}
+					FlowDeviceMgmt_PError("Registering resource failed with");
+					success = false;
 				}
 			}
+		}
 
-			/* Register objects and all its resources */
-			if (success)
+		/* Register objects and all its resources */
+		if (success)
+		{
+			if (FlowDeviceMgmt_PushRegistration(object->objectID))
 			{
-				if (FlowDeviceMgmt_PushRegistration(objects[i].objectID))
-				{
-					FlowDeviceMgmt_PError("FlowDeviceMgmt_PushRegistration() failed");
-					success = false;
-				}
+				FlowDeviceMgmt_PError("FlowDeviceMgmt_PushRegistration() failed");
+				success = false;
 			}
 		}
 	}
@@ -320,56 +934,54 @@ static bool RegisterObjectsAsClient(void)
 }
 
 /**
- * @brief Register all objects and its resources with server deamon.
- * @return true if object is successfully registered on server, else false.
+ * @brief Define an object and its resources on the server, unless already defined.
+ * @param object object to define.
+ * @return true if the object is defined, else false.
  */
-static bool RegisterObjectsAsServer(void)
+static bool RegisterObjectAsServer(const OBJECT_T *object)
 {
 	bool success = true;
-	unsigned int i, j;
+	unsigned int j;
 	FlowDeviceMgmtFlags flags = {0};
 
-	for (i = 0; (i < ARRAY_SIZE(objects)) && success; i++)
+	/* Check if object is registered or not */
+	if (FlowDeviceMgmtServer_PullRegistration(object->objectID) != 0)
 	{
-		/* Check if object is registered or not */
-		if (FlowDeviceMgmtServer_PullRegistration(objects[i].objectID) != 0)
+		/* Defining object */
+		if (FlowDeviceMgmtServer_RegisterObjectType(object->objectName,
+													object->objectID,
+													true,
+													flags) == -1)
 		{
-			/* Defining object */
-			if (FlowDeviceMgmtServer_RegisterObjectType(objects[i].objectName,
-														objects[i].objectID,
-														true,
-														flags) == -1)
-			{
-				FlowDeviceMgmtServer_PError("Registering object failed with");
-				success = false;
-			}
-			else
+			FlowDeviceMgmtServer_PError("Registering object failed with");
+			success = false;
+		}
+		else
+		{
+			/* Object defined successfully. Now define all its resources */
+			for (j = 0; j < object->numResources; j++)
 			{
-				/* Object defined successfully. Now define all its resources */
-				for (j = 0; j < objects[i].numResources; j++)
+				if (FlowDeviceMgmtServer_RegisterResourceType(
+														object->resources[j].resourceName,
+														object->objectID,
+														object->resources[j].resourceID,
+														object->resources[j].resourceType,
+														true,
+														flags))
 				{
-					if (FlowDeviceMgmtServer_RegisterResourceType(
-															objects[i].resources[j].resourceName,
-															objects[i].objectID,
-															objects[i].resources[j].resourceID,
-															objects[i].resources[j].resourceType,
-															true,
-															flags))
-					{
-						FlowDeviceMgmtServer_PError("Registering resource failed with");
-						success = false;
-					}
+					FlowDeviceMgmtServer_PError("Registering resource failed with");
+					success = false;
 				}
 			}
+		}
 
-			/* Register objects and all its resources */
-			if (success)
+		/* Register objects and all its resources */
+		if (success)
+		{
+			if (FlowDeviceMgmtServer_PushRegistration(object->objectID))
 			{
-				if (FlowDeviceMgmtServer_PushRegistration(objects[i].objectID))
-				{
-					FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_PushRegistration() failed");
-					success = false;
-				}
+				FlowDeviceMgmtServer_PError("FlowDeviceMgmtServer_PushRegistration() failed");
+				success = false;
 			}
 		}
 	}
@@ -377,85 +989,128 @@ static bool RegisterObjectsAsServer(void)
 }
 
 /**
- * @brief Callback function, called when button state gets updated.
+ * @brief Register all objects and its resources with server deamon.
+ * @return true if object is successfully registered on server, else false.
  */
-static int ButtonStateChangeCallback(FlowDeviceMgmtHandle * handle)
+static bool RegisterObjectsAsServer(void)
 {
-	unsigned int i, j;
-	const int bufferLen = BUFF_SIZE;
-	bool buttonState = false, ledState = false;
-	void *buffer = malloc(bufferLen);
-	FlowDeviceMgmtValue ledResourceValue = { 0 };
+	return RegisterObjectAsServer(&presenceObject) && RegisterObjectAsServer(&powerObject);
+}
 
-	printf("MOtion Call back called\n");
+/**
+ * @brief Act on a motion sensor's new state.
+ *        The sensor holds back notifications for its minimum period, so a short
+ *        burst of motion may end before it is reported; the counter still shows it.
+ * @param sensor index of the sensor in objects.
+ * @param handle handle of the notified Presence instance.
+ * @return 0 on success, -1 if the state could not be read.
+ */
+static int MotionStateChanged(unsigned int sensor, FlowDeviceMgmtHandle * handle)
+{
+	bool buttonState = false;
+	int64_t counter;
+	int64_t onsets = 0;
+	char *speaker = (char *)sensorConfig[sensor]->speaker;
+	char buffer[BUFF_SIZE];
+	FlowDeviceMgmtValue value = FlowDeviceMgmtServer_ValueBuffer(buffer, 0, sizeof(buffer));
 
-	FlowDeviceMgmtValue buttonResourceValue = FlowDeviceMgmtServer_ValueBuffer(buffer,
-																				0,
-																				bufferLen);
+	/* Everything this notification causes is traced under one correlation ID */
+	trace_set_current(trace_new_id());
+	TRACE_OBSERVE_ENTER(objects[sensor].clientID, trace_current());
 
-	// perform the GET operation
-	if (FlowDeviceMgmtServer_GetValue(handle, &buttonResourceValue) != 0)
+	SensorNotified(sensor);
+	metrics_count(METRIC_EVENTS_RECEIVED, 1);
+
+	if (FlowDeviceMgmtServer_GetValue(handle, &value) != 0)
 	{
 		FlowDeviceMgmt_PError("FlowDeviceMgmt_GetValue() failed");
-		free(buffer);
+		TRACE_OBSERVE_EXIT(objects[sensor].clientID, trace_current(), -1);
 		return -1;
 	}
 
-	buttonState = FlowDeviceMgmtServer_ExtractBoolean(buttonResourceValue);
+	buttonState = FlowDeviceMgmtServer_ExtractBoolean(value);
 
-	if(!buttonState)
+	/* Firmware without the counter still works from the state alone */
+	value = FlowDeviceMgmtServer_ValueBuffer(buffer, 0, sizeof(buffer));
+
+	if (counterHandles[sensor] && FlowDeviceMgmtServer_GetValue(counterHandles[sensor], &value) == 0)
+	{
+		counter = FlowDeviceMgmtServer_ExtractInteger(value);
+
+		if (lastCounter[sensor] >= 0)
+		{
+			/* A counter that went backwards restarted with the sensor */
+			onsets = (counter >= lastCounter[sensor]) ? (counter - lastCounter[sensor]) : counter;
+		}
+		lastCounter[sensor] = counter;
+
+		if (onsets > 1)
+		{
+			LOG(LOG_INFO, "Sensor %s aggregated %lld motion onsets",
+					objects[sensor].clientID, (long long)onsets);
+		}
+	}
+
+	/* A pmax heartbeat repeats the state, restarting the countdown or playback on it would be wrong */
+	if ((lastState[sensor] == buttonState) && (onsets == 0))
+	{
+		TRACE_OBSERVE_EXIT(objects[sensor].clientID, trace_current(), buttonState);
+		return 0;
+	}
+	lastState[sensor] = buttonState;
+
+	/* The sensor reports its output level, high while there is motion */
+	if(buttonState || onsets > 0)
 	{
 		printf("Detected 	- Count Down Disabled\n");
-		stimeout[0].b_elapsed = 1;
-		control_point_set_mute(SPEAKER1_STR, 0);	
+		stimeout[sensor].b_elapsed = 1;
+		if (action_queue_start_playback(ACTION_CLASS_INTERACTIVE, speaker))
+		{
+			metrics_count(METRIC_EVENTS_ROUTED, 1);
+		}
+		prewarm_motion(speaker);
+
+		if (!roomOccupied[sensor])
+		{
+			roomOccupied[sensor] = true;
+			QueueMessage(speaker, "became occupied");
+		}
 	}
-	else
+
+	/* Motion that already ended by the time it was reported starts the countdown too */
+	if(!buttonState)
 	{
 		printf("No Acitivty	- Count Down Resuming\n");
-		timeout_reset(&stimeout[0]);
+		timeout_reset(&stimeout[sensor]);
 	}
 
+	TRACE_OBSERVE_EXIT(objects[sensor].clientID, trace_current(), buttonState);
 
 	return 0;
 }
 
 /**
- * @brief Callback function, called when button state gets updated.
+ * @brief Log the charge a sensor reports having drawn since it booted.
+ * @param sensor index of the sensor in objects.
+ * @param handle handle of the observed charge resource.
  */
-static int ButtonStateChangeCallback2(FlowDeviceMgmtHandle * handle)
+static int PowerReported(unsigned int sensor, FlowDeviceMgmtHandle * handle)
 {
-	unsigned int i, j;
-	const int bufferLen = BUFF_SIZE;
-	bool buttonState = false, ledState = false;
-	void *buffer = malloc(bufferLen);
-	FlowDeviceMgmtValue ledResourceValue = { 0 };
+	int64_t buffer = 0;
+	FlowDeviceMgmtValue value = FlowDeviceMgmtServer_ValueBuffer(&buffer, 0, sizeof(buffer));
 
-	FlowDeviceMgmtValue buttonResourceValue = FlowDeviceMgmtServer_ValueBuffer(buffer,
-																				0,
-																				bufferLen);
-	// perform the GET operation
-	if (FlowDeviceMgmtServer_GetValue(handle, &buttonResourceValue) != 0)
+	if (FlowDeviceMgmtServer_GetValue(handle, &value) != 0)
 	{
 		FlowDeviceMgmt_PError("FlowDeviceMgmt_GetValue() failed");
-		free(buffer);
 		return -1;
 	}
 
-	buttonState = FlowDeviceMgmtServer_ExtractBoolean(buttonResourceValue);
-
-	if(!buttonState)
-	{
-		printf("Detected 	- Count Down Disabled\n");
-		stimeout[1].b_elapsed = 1;
-		control_point_set_mute(SPEAKER2_STR, 0);	
-	}
-	else
-	{
-		printf("No Acitivty	- Count Down Resuming\n");
-		timeout_reset(&stimeout[1]);
-	}
+	long long uAh = FlowDeviceMgmtServer_ExtractInteger(value);
 
-	free(buffer);
+	LOG(LOG_INFO, "Sensor %s has drawn %lld.%03lldmAh since boot",
+			objects[sensor].clientID,
+			uAh / 1000,
+			uAh % 1000);
 
 	return 0;
 }
@@ -476,48 +1131,180 @@ static void WaitForProvisioning(void)
 }
 
 /**
- * @brief Check to see if a constrained device by the name CLIENT_ID has registered
- *        itself with the server on the gateway or not.
- * @param *endPointName pointer to client name.
- * @return true if constrained device is in client list i.e. registered, else false.
+ * @brief Vacancy countdown callback, mutes the room's speaker.
+ * @param countdown the sensor's countdown.
+ */
+static int VacancyElapsed(void *countdown)
+{
+	unsigned int sensor = (TIMEOUT_S *)countdown - stimeout;
+	char *speaker = (char *)sensorConfig[sensor]->speaker;
+
+	printf("Time has elapsed!\n");
+	action_queue_set_mute(ACTION_CLASS_BACKGROUND, speaker, 1);
+	prewarm_vacant(speaker);
+
+	if (roomOccupied[sensor])
+	{
+		roomOccupied[sensor] = false;
+		QueueMessage(speaker, "became vacant");
+	}
+	return 0;
+}
+
+/**
+ * @brief Find the configuration of a sensor.
+ * @param clientID client ID the sensor registered with.
+ * @return the sensor's configuration, the default one if it is not listed,
+ *         or NULL if there is no default speaker either.
+ */
+static const SENSOR_CONFIG_T *FindSensorConfig(const char *clientID)
+{
+	unsigned int i;
+
+	for (i = 0; i < numSensorConfigs; i++)
+	{
+		if (strcmp(sensorConfigs[i].clientID, clientID) == 0)
+		{
+			return &sensorConfigs[i];
+		}
+	}
+	return (defaultSensorConfig.speaker[0] != '\0') ? &defaultSensorConfig : NULL;
+}
+
+/**
+ * @brief Check whether a sensor is already being served.
+ * @param clientID client ID the sensor registered with.
+ * @return true if the sensor is in objects, else false.
+ */
+static bool SensorKnown(const char *clientID)
+{
+	unsigned int i;
+
+	for (i = 0; i < devices; i++)
+	{
+		if (strcmp(objects[i].clientID, clientID) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Add a sensor to the ones served. Every sensor runs the same firmware,
+ *        so all that differs is the client ID and the room it is configured for.
+ * @param clientID client ID the sensor registered with.
+ * @param config the sensor's configuration.
+ * @return index of the sensor in objects.
+ */
+static unsigned int AddSensor(const char *clientID, const SENSOR_CONFIG_T *config)
+{
+	unsigned int sensor = devices++;
+
+	strncpy(clientIDs[sensor], clientID, SNAPSHOT_NAME_LEN - 1);
+	objects[sensor] = presenceObject;
+	objects[sensor].clientID = clientIDs[sensor];
+	sensorConfig[sensor] = config;
+
+	stimeout[sensor].elapsed_cb = VacancyElapsed;
+	stimeout[sensor].sec_timeout = VACANCY_TIMEOUT;
+
+	return sensor;
+}
+
+/**
+ * @brief Add the motion sensors that have registered since the last call.
+ * @return number of sensors added.
  */
-static bool CheckConstrainedRegistered(const char *endPointName)
+static unsigned int DiscoverSensors(void)
 {
+	static bool warned = false;
+	unsigned int found = 0;
 	int i;
 
 	FlowDeviceMgmtClientList * clientList = FlowDeviceMgmtServer_GetClientList();
 	if (clientList == NULL)
 	{
-		return false;
+		return 0;
 	}
 
 	for (i = 0; i < clientList->NumClients; i++)
 	{
-		if (!strcmp(endPointName, clientList->Client[i].ClientID))
+		const char *clientID = clientList->Client[i].ClientID;
+		const SENSOR_CONFIG_T *config;
+
+		if (strncmp(clientID, SENSOR_ENDPOINT_PREFIX, strlen(SENSOR_ENDPOINT_PREFIX)) != 0 ||
+			SensorKnown(clientID))
 		{
-			LOG(LOG_INFO, "Constrained device %s registered", endPointName);
-			FlowDeviceMgmtServer_FreeClientList(clientList);
-			return true;
+			continue;
+		}
+
+		if (devices == MAX_SENSORS)
+		{
+			if (!warned)
+			{
+				LOG(LOG_WARN, "Sensor %s not served, at most %d sensors are", clientID, MAX_SENSORS);
+				warned = true;
+			}
+			continue;
+		}
+
+		if ((config = FindSensorConfig(clientID)) == NULL)
+		{
+			LOG(LOG_DBG, "Sensor %s has no room configured", clientID);
+			continue;
 		}
+
+		timeout_init_and_run(&stimeout[AddSensor(clientID, config)]);
+		found++;
+
+		LOG(LOG_INFO, "Constrained device %s registered, speaker %s", clientID, config->speaker);
 	}
 
 	FlowDeviceMgmtServer_FreeClientList(clientList);
 
-	return false;
+	return found;
 }
 
-int cb(void* stimeout)
+/**
+ * @brief Restore runtime state from the snapshot left by the previous process.
+ *        Vacancy countdowns continue with the time they had left.
+ * @return number of sensors restored.
+ */
+static unsigned int RestoreState(void)
 {
-	printf("Time has elapsed!\n");
-	control_point_set_mute(SPEAKER1_STR, 1);
-	return 0;
-}
+	SNAPSHOT_S snapshot;
+	unsigned int i;
 
-int cb2(void* stimeout)
-{
-	printf("Time has elapsed!\n");
-	control_point_set_mute(SPEAKER2_STR, 1);
-	return 0;
+	if (snapshot_read(&snapshot) != 0)
+	{
+		return 0;
+	}
+
+	control_point_restore_renderers(snapshot.renderers, snapshot.num_renderers);
+
+	/* Sensors no longer configured, or with another object, are discovered afresh */
+	for (i = 0; (i < snapshot.num_sensors) && (devices < MAX_SENSORS); i++)
+	{
+		SNAPSHOT_SENSOR_S *sensor = &snapshot.sensors[i];
+		const SENSOR_CONFIG_T *config = FindSensorConfig(sensor->client_id);
+		unsigned int restored;
+
+		if (config == NULL ||
+			sensor->object_id != PRESENCE_OBJECT_ID ||
+			sensor->instance_id != PRESENCE_OBJECT_INSTANCE_ID ||
+			!sensor->observed ||
+			SensorKnown(sensor->client_id))
+		{
+			continue;
+		}
+
+		restored = AddSensor(sensor->client_id, config);
+		roomOccupied[restored] = sensor->occupied;
+		timeout_init_and_resume(&stimeout[restored], sensor->remaining_s);
+	}
+
+	return devices;
 }
 
 /**
@@ -528,7 +1315,6 @@ int cb2(void* stimeout)
 int main(int argc, char ** argv)
 {
 	int i;
-	pthread_t control_point_thread;
 
 	LOG(LOG_INFO, "Flow Control Application");
 	LOG(LOG_INFO, "------------------------\n");
@@ -545,6 +1331,18 @@ int main(int argc, char ** argv)
 		return -1;
 	}
 
+	/* Renderers and scrapers hang up mid-response, sendfile() then fails with EPIPE instead */
+	signal(SIGPIPE, SIG_IGN);
+
+	action_queue_init();
+	ReadGatewayConfig();
+
+	/* After the outbox is configured; logging in is left to the first send, so it cannot hold up startup */
+	if (!StartFlowMessaging())
+	{
+		LOG(LOG_WARN, "No flow configuration, messages to the flow user are not sent");
+	}
+
 	//WaitForProvisioning();
 
 	//isDeviceRegistered = InitializeAndRegisterFlowDevice();
@@ -552,56 +1350,48 @@ int main(int argc, char ** argv)
 	if (RegisterObjectsAsServer() && RegisterObjectsAsClient())
 	{
 		unsigned int poll = 10;
+
+		// catch CTRL-C and service stop to ensure clean-up, from here on there is state to save
+		signal(SIGINT, INThandler);
+		signal(SIGTERM, INThandler);
+
+		/* Pick up where the previous process left off, and serve those sensors straight away */
+		RestoreState();
+
+		StartControlPoint();
+		ObserveSensors(0);
 		
-		while(1)
+		/* Until every listed sensor is found, or none has registered for a while */
+		while(devices < numSensorConfigs && receivedSignal == false)
 		{
-			if(devices < ARRAY_SIZE(objects))
+			unsigned int first = devices;
+
+			if(DiscoverSensors() > 0)
 			{
-				int res = CheckConstrainedRegistered(objects[devices].clientID);
-				
-				if(res)
+				printf("Device found\n");
+				StartControlPoint();
+				ObserveSensors(first);
+				poll = 30;
+			}
+			else
+			{
+				if(poll == 0)
 				{
-					printf("Device found\n");
-					
-					// If fisrt device call cb otherwise cb2. TEMPORARY
-					stimeout[devices].elapsed_cb 	= (devices)? cb2 : cb;
-					stimeout[devices].sec_timeout 	= 10;
-		
-					if(devices == 0)
-					{
-						pthread_create( &control_point_thread, NULL, ((void *)control_point_init_and_run), NULL);
-					}
-
-					timeout_init_and_run(&stimeout[devices]);
-					
-					devices++;
-					poll = 30;				
+					break;
 				}
 				else
 				{
-					if(poll == 0)
-					{
-						break;
-					}
-					else
-					{
-						printf("Waiting ...\n");
-						FlowDeviceMgmt_Process(1 /*second*/);
-						poll--;
-					}		
-				}	
-			}
-			else
-			{
-				break;
+					printf("Waiting ...\n");
+					FlowDeviceMgmt_Process(1 /*second*/);
+					poll--;
+				}
 			}
 		}
 		
+		/* Sensors that register from now on are picked up while observing */
 		if(devices == 0)
 		{
-			printf("Zero Devices registered");
-			
-			return -1;
+			printf("Zero Devices registered, waiting\n");
 		}
 		
 		printf("Begin Observing\n");
@@ -45,9 +45,16 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <flow/flowmessaging.h>
 #include <libconfig.h>
 #include "log.h"
+#include "outbox.h"
+#include "metrics.h"
+#include "trace.h"
+#include "flow_interface.h"
 
 /***************************************************************************************************
  * Definitions
@@ -65,6 +72,14 @@
 #define DEVICE_NAME "My FlowGateway"
 /** Configuration file to get registration data stored by provisioning app. */
 #define CONFIG_FILE "/etc/lwm2m/flow_access.cfg"
+/** Max number of distinct events waiting to be sent. */
+#define MESSAGE_QUEUE_DEPTH (16)
+/** Max length of an event or subject name. */
+#define MESSAGE_NAME_SIZE (32)
+/** Events queued within this many seconds are sent as one message. */
+#define MESSAGE_BATCH_INTERVAL (5)
+/** Memory managers live at once. FlowCore has no way to empty one, so each use creates and frees its own. */
+#define MEMORY_MANAGER_POOL_SIZE (2)
 
 /***************************************************************************************************
  * Typedef
@@ -85,6 +100,44 @@ typedef struct
 	/*@}*/
 }RegistrationData;
 
+/**
+ * A queued event and every subject it happened to within the current batch.
+ */
+typedef struct
+{
+	/*@{*/
+	char event[MESSAGE_NAME_SIZE]; /**< what happened, e.g. "became occupied" */
+	char subjects[MAX_SIZE]; /**< comma separated subjects, e.g. rooms */
+	unsigned int count; /**< number of subjects */
+	/*@}*/
+}QueuedEvent;
+
+/***************************************************************************************************
+ * Globals
+ **************************************************************************************************/
+
+/** Registration data, kept to log in again after the connection is lost. */
+static RegistrationData registration;
+static bool deviceRegistered = false;
+
+/** User ID of the device owner, resolved once per login. */
+static char cachedUserId[MAX_SIZE];
+static bool cachedUserIdValid = false;
+
+/** Pending events, drained by the message thread. */
+static QueuedEvent queue[MESSAGE_QUEUE_DEPTH];
+static unsigned int queueCount = 0;
+static unsigned long droppedEvents = 0;
+static bool queueRunning = false;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+
+/** Memory manager pool. It only caps how many are live, it does not reuse them. */
+static unsigned int memoryManagersInUse = 0;
+static MemoryManagerStats memoryManagerStats;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolCond = PTHREAD_COND_INITIALIZER;
+
 
 /***************************************************************************************************
  * Implementation
@@ -148,6 +201,67 @@ static bool GetConfigData(RegistrationData *regData)
 	return success;
 }
 
+/**
+ * @brief Create a memory manager, waiting while the pool's limit is in use.
+ * @return memory manager, or NULL if one cannot be created.
+ */
+static FlowMemoryManager AcquireMemoryManager(void)
+{
+	FlowMemoryManager memoryManager;
+
+	pthread_mutex_lock(&poolLock);
+
+	while (memoryManagersInUse == MEMORY_MANAGER_POOL_SIZE)
+	{
+		memoryManagerStats.waits++;
+		pthread_cond_wait(&poolCond, &poolLock);
+	}
+
+	memoryManagersInUse++;
+	pthread_mutex_unlock(&poolLock);
+
+	if ((memoryManager = FlowMemoryManager_New()) == NULL)
+	{
+		pthread_mutex_lock(&poolLock);
+		memoryManagersInUse--;
+		pthread_cond_signal(&poolCond);
+		pthread_mutex_unlock(&poolLock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&poolLock);
+	memoryManagerStats.acquired++;
+	pthread_mutex_unlock(&poolLock);
+
+	return memoryManager;
+}
+
+/**
+ * @brief Free a memory manager, and everything allocated against it.
+ * @param memoryManager memory manager from AcquireMemoryManager().
+ */
+static void ReleaseMemoryManager(FlowMemoryManager memoryManager)
+{
+	FlowMemoryManager_Free(&memoryManager);
+
+	pthread_mutex_lock(&poolLock);
+	memoryManagersInUse--;
+	memoryManagerStats.released++;
+	pthread_cond_signal(&poolCond);
+	pthread_mutex_unlock(&poolLock);
+}
+
+/**
+ * @brief Get memory manager pool counters.
+ * @param *stats pointer to the counters to fill in.
+ */
+void GetMemoryManagerStats(MemoryManagerStats *stats)
+{
+	pthread_mutex_lock(&poolLock);
+	*stats = memoryManagerStats;
+	pthread_mutex_unlock(&poolLock);
+}
+
 /**
  * @brief Register as a device with flow cloud.
  * @param regData device registration data.
@@ -155,24 +269,18 @@ static bool GetConfigData(RegistrationData *regData)
  */
 static bool RegisterDevice(RegistrationData regData)
 {
-	FlowMemoryManager memoryManager = FlowMemoryManager_New();
+	/* A new login may belong to a different owner */
+	pthread_mutex_lock(&queueLock);
+	cachedUserIdValid = false;
+	pthread_mutex_unlock(&queueLock);
 
-	if (memoryManager)
-	{
-		if (FlowClient_LoginAsDevice(regData.deviceType,
-										NULL,
-										SERIAL_NUMBER,
-										regData.deviceID,
-										DEVICE_SOFTWARE_VERSION,
-										DEVICE_NAME,
-										regData.fcap))
-		{
-			FlowMemoryManager_Free(&memoryManager);
-			return true;
-		}
-		FlowMemoryManager_Free(&memoryManager);
-	}
-	return false;
+	return FlowClient_LoginAsDevice(regData.deviceType,
+									NULL,
+									SERIAL_NUMBER,
+									regData.deviceID,
+									DEVICE_SOFTWARE_VERSION,
+									DEVICE_NAME,
+									regData.fcap);
 }
 
 /**
@@ -184,12 +292,20 @@ static bool RegisterDevice(RegistrationData regData)
  */
 static bool InitialiseLibFlow(const char *url, const char *key, const char *secret)
 {
-	if (FlowCore_Initialise())
+	static bool initialised = false;
+
+	/* Only connecting is repeated when logging in again */
+	if (initialised || FlowCore_Initialise())
 	{
-		FlowCore_RegisterTypes();
+		if (!initialised)
+		{
+			FlowCore_RegisterTypes();
+		}
 
-		if (FlowMessaging_Initialise())
+		if (initialised || FlowMessaging_Initialise())
 		{
+			initialised = true;
+
 			if (FlowClient_ConnectToServer(url, key, secret, false))
 			{
 				return true;
@@ -212,13 +328,13 @@ static bool InitialiseLibFlow(const char *url, const char *key, const char *secr
 }
 
 /**
- * @brief Get user id to which the device is registered.
+ * @brief Resolve the user id to which the device is registered from flow cloud.
  * @param *userId pointer to device's user Id.
  * @return true if user id is retrieved successfully, else false.
  */
-static bool GetUserId(char *userId)
+static bool FetchUserId(char *userId)
 {
-	FlowMemoryManager memoryManager = FlowMemoryManager_New();
+	FlowMemoryManager memoryManager = AcquireMemoryManager();
 
 	if (memoryManager)
 	{
@@ -228,15 +344,16 @@ static bool GetUserId(char *userId)
 			FlowID temp;
 
 			temp = FlowUser_GetUserID(FlowDevice_RetrieveOwner(device));
-			strcpy(userId, temp);
-			FlowMemoryManager_Free(&memoryManager);
+			strncpy(userId, temp, MAX_SIZE - 1);
+			userId[MAX_SIZE - 1] = '\0';
+			ReleaseMemoryManager(memoryManager);
 			return true;
 		}
 		else
 		{
 			LOG(LOG_ERR, "Failed to get logged in device");
 		}
-		FlowMemoryManager_Free(&memoryManager);
+		ReleaseMemoryManager(memoryManager);
 	}
 	else
 	{
@@ -245,6 +362,44 @@ static bool GetUserId(char *userId)
 	return false;
 }
 
+/**
+ * @brief Get user id to which the device is registered, resolving it only once per login.
+ * @param *id pointer to device's user Id.
+ * @return true if user id is available, else false.
+ */
+static bool GetUserId(char *id)
+{
+	char fetched[MAX_SIZE];
+	bool valid;
+
+	pthread_mutex_lock(&queueLock);
+	valid = cachedUserIdValid;
+	if (valid)
+	{
+		strcpy(id, cachedUserId);
+	}
+	pthread_mutex_unlock(&queueLock);
+
+	if (valid)
+	{
+		return true;
+	}
+
+	/* Round trip to flow cloud outside the lock */
+	if (!FetchUserId(fetched))
+	{
+		return false;
+	}
+
+	pthread_mutex_lock(&queueLock);
+	strcpy(cachedUserId, fetched);
+	cachedUserIdValid = true;
+	pthread_mutex_unlock(&queueLock);
+
+	strcpy(id, fetched);
+	return true;
+}
+
 /**
  * @brief Send a flow message to user.
  * @param *message pointer to a message for flow user.
@@ -254,62 +409,292 @@ bool SendMessage(char *message)
 {
 	char userId[MAX_SIZE];
 
-	GetUserId(userId);
+	if (!GetUserId(userId))
+	{
+		return false;
+	}
 
-	FlowMemoryManager memoryManager = FlowMemoryManager_New();
+	TRACE_CLOUD_SEND_BEGIN(strlen(message));
 
-	if (memoryManager)
+	if (FlowMessaging_SendMessageToUser((FlowID)userId,
+											"text/plain",
+											message,
+											strlen(message),
+											MESSAGE_EXPIRY_TIMEOUT))
 	{
-		if (FlowMessaging_SendMessageToUser((FlowID)userId,
-												"text/plain",
-												message,
-												strlen(message),
-												MESSAGE_EXPIRY_TIMEOUT))
+		TRACE_CLOUD_SEND_END(strlen(message), 1);
+		LOG(LOG_INFO, "Message sent to user = %s",message);
+		return true;
+	}
+
+	TRACE_CLOUD_SEND_END(strlen(message), 0);
+	LOG(LOG_ERR, "Failed to send message to user");
+	return false;
+}
+
+/**
+ * @brief Take every queued event and format them as one message.
+ *        Called with the queue lock held.
+ * @param *message buffer of MAX_SIZE bytes for the message.
+ */
+static void TakeQueuedEvents(char *message)
+{
+	unsigned int i;
+	int len = 0;
+
+	message[0] = '\0';
+
+	for (i = 0; i < queueCount && len < MAX_SIZE; i++)
+	{
+		len += snprintf(message + len,
+						MAX_SIZE - len,
+						"%s%s %s",
+						i ? "; " : "",
+						queue[i].subjects,
+						queue[i].event);
+	}
+
+	queueCount = 0;
+	metrics_gauge_set(METRIC_MESSAGE_QUEUE_DEPTH, 0);
+
+	if (droppedEvents)
+	{
+		LOG(LOG_WARN, "Message queue full, %lu events dropped", droppedEvents);
+		droppedEvents = 0;
+	}
+}
+
+/**
+ * @brief Message thread, sends at most one message per batch interval.
+ */
+static void *MessageThread(void *arg)
+{
+	char message[MAX_SIZE];
+
+	pthread_mutex_lock(&queueLock);
+
+	while (1)
+	{
+		struct timespec deadline;
+		bool registered;
+		int result;
+
+		while (queueCount == 0)
 		{
-			LOG(LOG_INFO, "Message sent to user = %s",message);
-			FlowMemoryManager_Free(&memoryManager);
-			return true;
+			pthread_cond_wait(&queueCond, &queueLock);
 		}
-		else
+
+		/* Let the rest of a burst arrive before sending */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += MESSAGE_BATCH_INTERVAL;
+		do
 		{
-			LOG(LOG_ERR, "Failed to send message to user");
+			result = pthread_cond_timedwait(&queueCond, &queueLock, &deadline);
 		}
-		FlowMemoryManager_Free(&memoryManager);
+		while (result != ETIMEDOUT);
+
+		TakeQueuedEvents(message);
+		registered = deviceRegistered;
+
+		pthread_mutex_unlock(&queueLock);
+
+		/* Keep messages in order behind any already waiting offline */
+		if (outbox_depth() > 0 || !registered || !SendMessage(message))
+		{
+			outbox_append(message);
+		}
+
+		pthread_mutex_lock(&queueLock);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Queue an event for the flow user without blocking. Events queued within
+ *        MESSAGE_BATCH_INTERVAL are sent together, with subjects of the same event
+ *        merged, e.g. "ewc_1, ewc_2, ewc_3 became occupied".
+ * @param *subject what the event happened to, e.g. a room.
+ * @param *event what happened.
+ * @return true if the event is queued, else false.
+ */
+bool QueueMessage(const char *subject, const char *event)
+{
+	QueuedEvent *entry = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&queueLock);
+
+	if (!queueRunning)
+	{
+		pthread_mutex_unlock(&queueLock);
+		return false;
+	}
+
+	for (i = 0; i < queueCount; i++)
+	{
+		if (strcmp(queue[i].event, event) == 0)
+		{
+			entry = &queue[i];
+			break;
+		}
+	}
+
+	if (entry == NULL)
+	{
+		if (queueCount == MESSAGE_QUEUE_DEPTH)
+		{
+			droppedEvents++;
+			pthread_mutex_unlock(&queueLock);
+			return false;
+		}
+
+		entry = &queue[queueCount++];
+		metrics_gauge_set(METRIC_MESSAGE_QUEUE_DEPTH, queueCount);
+		strncpy(entry->event, event, MESSAGE_NAME_SIZE - 1);
+		entry->event[MESSAGE_NAME_SIZE - 1] = '\0';
+		entry->subjects[0] = '\0';
+		entry->count = 0;
+	}
+
+	if (strlen(entry->subjects) + strlen(subject) + 3 < MAX_SIZE)
+	{
+		if (entry->count)
+		{
+			strcat(entry->subjects, ", ");
+		}
+		strcat(entry->subjects, subject);
+		entry->count++;
 	}
 	else
 	{
-		LOG(LOG_ERR, "Failed to create memory manager");
+		droppedEvents++;
 	}
-	return false;
+
+	pthread_cond_signal(&queueCond);
+	pthread_mutex_unlock(&queueLock);
+
+	return true;
 }
 
 /**
- * @brief Initialize libflow and register as a device.
+ * @brief Connect to flow cloud and log in as the device.
  * @return true if device registration is successful else false.
  */
-bool InitializeAndRegisterFlowDevice(void)
+static bool ConnectAndRegister(void)
 {
-	RegistrationData regData;
+	char userId[MAX_SIZE];
+	bool registered = false;
 
-	if (GetConfigData(&regData))
+	if (InitialiseLibFlow(registration.url, registration.key, registration.secret))
 	{
-		if (InitialiseLibFlow(regData.url, regData.key, regData.secret))
+		if (RegisterDevice(registration))
 		{
-			if (RegisterDevice(regData))
-			{
-				LOG(LOG_INFO, "Device registration successful");
-				return true;
-			}
-			else
-			{
-				LOG(LOG_ERR, "Failed to login as device");
-			}
+			LOG(LOG_INFO, "Device registration successful");
+
+			/* Resolve the owner now rather than on the first message */
+			GetUserId(userId);
+			registered = true;
 		}
 		else
 		{
-			LOG(LOG_ERR, "Flow Core initialization failed");
+			LOG(LOG_ERR, "Failed to login as device");
 		}
 	}
+	else
+	{
+		LOG(LOG_ERR, "Flow Core initialization failed");
+	}
+
+	pthread_mutex_lock(&queueLock);
+	deviceRegistered = registered;
+	pthread_mutex_unlock(&queueLock);
+
+	return registered;
+}
+
+/**
+ * @brief Send a message from the offline outbox, logging in again first if needed.
+ * @param *message pointer to a message for flow user.
+ * @return non-zero if the message was sent, 0 to retry it later.
+ */
+static int SendQueuedMessage(char *message)
+{
+	bool registered;
+
+	pthread_mutex_lock(&queueLock);
+	registered = deviceRegistered;
+	pthread_mutex_unlock(&queueLock);
+
+	if (!registered && !ConnectAndRegister())
+	{
+		return 0;
+	}
+
+	if (!SendMessage(message))
+	{
+		/* Most likely the connection is gone, log in again on the next retry */
+		pthread_mutex_lock(&queueLock);
+		deviceRegistered = false;
+		pthread_mutex_unlock(&queueLock);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Start the message thread and the offline outbox behind it.
+ */
+static void StartMessageQueue(void)
+{
+	pthread_t messageThread;
+
+	outbox_start(SendQueuedMessage);
+
+	pthread_mutex_lock(&queueLock);
+
+	if (!queueRunning && pthread_create(&messageThread, NULL, MessageThread, NULL) == 0)
+	{
+		pthread_detach(messageThread);
+		queueRunning = true;
+	}
+
+	pthread_mutex_unlock(&queueLock);
+}
+
+/**
+ * @brief Start queueing messages for the flow user without waiting for flow cloud.
+ *        The device logs in when the outbox sends the first message.
+ * @return true if the flow configuration was read and the queue runs, else false.
+ */
+bool StartFlowMessaging(void)
+{
+	if (!GetConfigData(&registration))
+	{
+		return false;
+	}
+
+	StartMessageQueue();
+	return true;
+}
+
+/**
+ * @brief Initialize libflow and register as a device.
+ * @return true if device registration is successful else false.
+ */
+bool InitializeAndRegisterFlowDevice(void)
+{
+	bool registered;
+
+	if (GetConfigData(&registration))
+	{
+		registered = ConnectAndRegister();
+
+		/* Messages are kept offline and sent once flow cloud can be reached */
+		StartMessageQueue();
+		return registered;
+	}
 	return false;
 }
 
@@ -40,12 +40,31 @@
 #ifndef FLOW_INTERFACE_H
 #define FLOW_INTERFACE_H
 
+/**
+ * Memory manager pool counters.
+ */
+typedef struct
+{
+	/*@{*/
+	unsigned long acquired; /**< memory managers created for a caller */
+	unsigned long released; /**< memory managers freed */
+	unsigned long waits; /**< times a caller waited for the pool's limit */
+	/*@}*/
+}MemoryManagerStats;
+
 /**
  * @brief Initialize libflow and register as a device.
  * @return true if device registration is successful else false.
  */
 bool InitializeAndRegisterFlowDevice(void);
 
+/**
+ * @brief Start queueing messages for the flow user without waiting for flow cloud.
+ *        The device logs in when the first message is sent.
+ * @return true if the flow configuration was read and the queue runs, else false.
+ */
+bool StartFlowMessaging(void);
+
 /**
  * @brief Send a flow message to user.
  * @param *message pointer to a message for flow user.
@@ -53,4 +72,19 @@ bool InitializeAndRegisterFlowDevice(void);
  */
 bool SendMessage(char *message);
 
+/**
+ * @brief Queue an event for the flow user without blocking. Events queued close
+ *        together are coalesced into one message.
+ * @param *subject what the event happened to, e.g. a room.
+ * @param *event what happened, e.g. "became occupied".
+ * @return true if the event is queued, else false.
+ */
+bool QueueMessage(const char *subject, const char *event);
+
+/**
+ * @brief Get memory manager pool counters.
+ * @param *stats pointer to the counters to fill in.
+ */
+void GetMemoryManagerStats(MemoryManagerStats *stats);
+
 #endif	/* FLOW_INTERFACE_H*/
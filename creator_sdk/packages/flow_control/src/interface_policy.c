@@ -0,0 +1,110 @@
+#include "interface_policy.h"
+#include "log.h"
+#include <string.h>
+
+typedef struct
+{
+	char			names[INTERFACE_POLICY_MAX][INTERFACE_POLICY_NAME_LEN];
+	unsigned int	count;
+
+} INTERFACE_LIST_S;
+
+static INTERFACE_LIST_S	allow;
+static INTERFACE_LIST_S	deny;
+static char				preferred[INTERFACE_POLICY_NAME_LEN] = "";
+
+static void read_list(config_t* cfg, const char* path, INTERFACE_LIST_S* list)
+{
+	config_setting_t*	setting = config_lookup(cfg, path);
+	unsigned int		i;
+
+	list->count = 0;
+
+	for(i = 0; setting != NULL && i < config_setting_length(setting); i++)
+	{
+		const char* name = config_setting_get_string_elem(setting, i);
+
+		if(name == NULL || list->count >= INTERFACE_POLICY_MAX)
+		{
+			LOG(LOG_WARN, "Ignoring %s entry %u", path, i);
+			continue;
+		}
+
+		strncpy(list->names[list->count], name, INTERFACE_POLICY_NAME_LEN - 1);
+		list->names[list->count][INTERFACE_POLICY_NAME_LEN - 1] = '\0';
+		list->count++;
+	}
+}
+
+static int find(const INTERFACE_LIST_S* list, const char* iface)
+{
+	unsigned int i;
+
+	for(i = 0; i < list->count; i++)
+	{
+		if(strcmp(list->names[i], iface) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int interface_policy_configure(config_t* cfg)
+{
+	const char* name;
+
+	read_list(cfg, "discovery.allow", &allow);
+	read_list(cfg, "discovery.deny", &deny);
+
+	preferred[0] = '\0';
+
+	if(config_lookup_string(cfg, "discovery.preferred", &name))
+	{
+		strncpy(preferred, name, INTERFACE_POLICY_NAME_LEN - 1);
+		preferred[INTERFACE_POLICY_NAME_LEN - 1] = '\0';
+	}
+
+	LOG(LOG_INFO, "Discovery: %u allowed, %u denied interfaces, preferred %s",
+			allow.count,
+			deny.count,
+			preferred[0] ? preferred : "none");
+
+	return 0;
+}
+
+int interface_policy_allowed(const char* iface)
+{
+	if(iface == NULL)
+	{
+		return 1;
+	}
+
+	if(find(&deny, iface) >= 0)
+	{
+		return 0;
+	}
+
+	// An empty allow list allows every interface not denied
+	return (allow.count == 0 || find(&allow, iface) >= 0 || strcmp(iface, preferred) == 0);
+}
+
+int interface_policy_rank(const char* iface)
+{
+	int position;
+
+	if(iface == NULL)
+	{
+		return INTERFACE_RANK_DEFAULT;
+	}
+
+	if(preferred[0] && strcmp(iface, preferred) == 0)
+	{
+		return 0;
+	}
+
+	position = find(&allow, iface);
+
+	return (position >= 0) ? position + 1 : INTERFACE_RANK_DEFAULT;
+}
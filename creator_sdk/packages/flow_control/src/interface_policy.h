@@ -0,0 +1,21 @@
+#ifndef INTERFACE_POLICY_H
+#define INTERFACE_POLICY_H
+
+#include <libconfig.h>
+
+#define INTERFACE_POLICY_MAX		8
+#define INTERFACE_POLICY_NAME_LEN	16
+
+// Rank of an interface without a preference, lower ranks are better paths
+#define INTERFACE_RANK_DEFAULT		(INTERFACE_POLICY_MAX + 1)
+
+// Read before the control point thread starts, never changed afterwards
+int interface_policy_configure(config_t* cfg);
+
+// Whether renderers should be discovered on iface at all
+int interface_policy_allowed(const char* iface);
+
+// Preferred interface first, then allowed interfaces in listed order
+int interface_policy_rank(const char* iface);
+
+#endif	/* INTERFACE_POLICY_H */
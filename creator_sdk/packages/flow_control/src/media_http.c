@@ -0,0 +1,452 @@
+#include "media_http.h"
+#include "media_index.h"
+#include "log.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define REQUEST_BUFF_SIZE	(2048)
+#define HEADER_BUFF_SIZE	(512)
+#define SENDFILE_CHUNK		(1 << 20)
+#define CLIENT_TIMEOUT_S	(30)
+#define ACCEPT_BACKOFF_MIN_MS	(10)
+#define ACCEPT_BACKOFF_MAX_MS	(1000)
+
+struct MEDIA_HTTP_LISTENER_S
+{
+	int		fd;
+	int		closing;
+};
+
+static int					listen_port = MEDIA_HTTP_DEFAULT_PORT;
+static unsigned int			clients 	= 0;
+static pthread_mutex_t		lock 		= PTHREAD_MUTEX_INITIALIZER;
+
+static int write_all(int fd, const char* data, size_t len)
+{
+	while(len > 0)
+	{
+		// A renderer that hangs up ends the response with EPIPE rather than a signal
+		ssize_t res = send(fd, data, len, MSG_NOSIGNAL);
+
+		if(res < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(res <= 0)
+		{
+			return 0;
+		}
+
+		data 	+= res;
+		len 	-= res;
+	}
+
+	return 1;
+}
+
+static void send_status(int fd, int code, const char* reason)
+{
+	char header[HEADER_BUFF_SIZE];
+	int len = snprintf(header, sizeof(header),
+						"HTTP/1.1 %d %s\r\n"
+						"Content-Length: 0\r\n"
+						"Connection: close\r\n\r\n",
+						code,
+						reason);
+
+	write_all(fd, header, len);
+}
+
+// Parse "Range: bytes=a-b", "bytes=a-" or "bytes=-n". Returns 0 when absent,
+// 1 for a valid range and -1 when it cannot be satisfied.
+static int parse_range(const char* request, off_t size, off_t* start, off_t* end)
+{
+	const char*	range = request;
+	char*		next;
+
+	while((range = strchr(range, '\n')) != NULL)
+	{
+		range++;
+		if(strncasecmp(range, "Range:", 6) == 0)
+		{
+			break;
+		}
+	}
+
+	if(range == NULL)
+	{
+		return 0;
+	}
+
+	range += 6;
+	while(*range == ' ')
+	{
+		range++;
+	}
+
+	if(strncasecmp(range, "bytes=", 6) != 0)
+	{
+		return 0;
+	}
+	range += 6;
+
+	if(*range == '-')
+	{
+		// Suffix range, the last n bytes
+		off_t suffix = strtoll(range + 1, NULL, 10);
+
+		if(suffix <= 0)
+		{
+			return -1;
+		}
+		*start 	= (suffix < size) ? size - suffix : 0;
+		*end 	= size - 1;
+	}
+	else
+	{
+		*start = strtoll(range, &next, 10);
+
+		if(next == range || *next != '-')
+		{
+			return 0;
+		}
+
+		*end = (next[1] >= '0' && next[1] <= '9') ? strtoll(next + 1, NULL, 10) : size - 1;
+
+		if(*end >= size)
+		{
+			*end = size - 1;
+		}
+	}
+
+	return (*start <= *end && *start < size) ? 1 : -1;
+}
+
+static void serve(int fd, const char* request)
+{
+	char			path[MEDIA_INDEX_PATH_LEN];
+	char			header[HEADER_BUFF_SIZE];
+	const char*		mime;
+	struct stat		st;
+	off_t			size, start, end, offset;
+	int				head 	= (strncmp(request, "HEAD ", 5) == 0);
+	int				file;
+	int				range;
+	int				len;
+
+	if(!head && strncmp(request, "GET ", 4) != 0)
+	{
+		send_status(fd, 501, "Not Implemented");
+		return;
+	}
+
+	request = strchr(request, ' ') + 1;
+
+	if(strncmp(request, MEDIA_HTTP_PATH_PREFIX, strlen(MEDIA_HTTP_PATH_PREFIX)) != 0 ||
+		!media_index_lookup_file(atoi(request + strlen(MEDIA_HTTP_PATH_PREFIX)), path, &size, &mime) ||
+		(file = open(path, O_RDONLY)) < 0)
+	{
+		send_status(fd, 404, "Not Found");
+		return;
+	}
+
+	// The file may have changed since it was indexed
+	if(fstat(file, &st) == 0)
+	{
+		size = st.st_size;
+	}
+
+	start 	= 0;
+	end 	= size - 1;
+	range 	= parse_range(request, size, &start, &end);
+
+	if(range < 0)
+	{
+		len = snprintf(header, sizeof(header),
+						"HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+						"Content-Range: bytes */%lld\r\n"
+						"Content-Length: 0\r\n"
+						"Connection: close\r\n\r\n",
+						(long long)size);
+		write_all(fd, header, len);
+		close(file);
+		return;
+	}
+
+	len = snprintf(header, sizeof(header),
+					"HTTP/1.1 %s\r\n"
+					"Content-Type: %s\r\n"
+					"Content-Length: %lld\r\n"
+					"Accept-Ranges: bytes\r\n"
+					"transferMode.dlna.org: Streaming\r\n"
+					"contentFeatures.dlna.org: DLNA.ORG_OP=01\r\n"
+					"Connection: close\r\n",
+					range ? "206 Partial Content" : "200 OK",
+					mime,
+					(long long)(end - start + 1));
+
+	if(range)
+	{
+		len += snprintf(header + len, sizeof(header) - len,
+						"Content-Range: bytes %lld-%lld/%lld\r\n",
+						(long long)start,
+						(long long)end,
+						(long long)size);
+	}
+
+	len += snprintf(header + len, sizeof(header) - len, "\r\n");
+
+	if(write_all(fd, header, len) && !head)
+	{
+		// Straight from the page cache to the socket, no user space copy
+		offset = start;
+
+		while(offset <= end)
+		{
+			size_t	count 	= (end - offset + 1 > SENDFILE_CHUNK) ? SENDFILE_CHUNK : (size_t)(end - offset + 1);
+			ssize_t	sent 	= sendfile(fd, file, &offset, count);
+
+			if(sent < 0 && errno == EINTR)
+			{
+				continue;
+			}
+
+			// Renderers hang up after a Range probe or on skipping, that ends the transfer
+			if(sent < 0 && errno != EPIPE && errno != ECONNRESET)
+			{
+				LOG(LOG_DBG, "Media HTTP sendfile of %s failed: %s", path, strerror(errno));
+			}
+			if(sent <= 0)
+			{
+				break;
+			}
+		}
+	}
+
+	close(file);
+}
+
+static void* client_func(void* data)
+{
+	int		fd 		= (int)(long)data;
+	char	request[REQUEST_BUFF_SIZE];
+	size_t	len 	= 0;
+
+	// Only the request head is needed, the body of a GET/HEAD is empty
+	while(len < sizeof(request) - 1)
+	{
+		ssize_t res = read(fd, request + len, sizeof(request) - 1 - len);
+
+		if(res <= 0)
+		{
+			break;
+		}
+
+		len += res;
+		request[len] = '\0';
+
+		if(strstr(request, "\r\n\r\n"))
+		{
+			serve(fd, request);
+			break;
+		}
+	}
+
+	close(fd);
+
+	pthread_mutex_lock(&lock);
+	clients--;
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+static void* accept_func(void* data)
+{
+	MEDIA_HTTP_LISTENER_S*	listener 	= data;
+	unsigned int			backoff_ms 	= 0;
+
+	while(1)
+	{
+		int				fd = accept(listener->fd, NULL, NULL);
+		int				accepted;
+		pthread_t		client_thread;
+		pthread_attr_t	attr;
+		struct timeval	timeout = { CLIENT_TIMEOUT_S, 0 };
+
+		if(fd < 0)
+		{
+			int closing;
+
+			pthread_mutex_lock(&lock);
+			closing = listener->closing;
+			pthread_mutex_unlock(&lock);
+
+			// media_http_close() shut the socket down
+			if(closing)
+			{
+				break;
+			}
+
+			// Out of descriptors or memory: retrying at once would spin, wait for clients to finish
+			if(errno != EINTR && errno != ECONNABORTED)
+			{
+				if(backoff_ms == 0)
+				{
+					LOG(LOG_WARN, "Media HTTP accept failed: %s", strerror(errno));
+				}
+
+				backoff_ms = (backoff_ms == 0) ? ACCEPT_BACKOFF_MIN_MS : backoff_ms * 2;
+
+				if(backoff_ms > ACCEPT_BACKOFF_MAX_MS)
+				{
+					backoff_ms = ACCEPT_BACKOFF_MAX_MS;
+				}
+
+				usleep(backoff_ms * 1000);
+			}
+			continue;
+		}
+
+		backoff_ms = 0;
+
+		pthread_mutex_lock(&lock);
+		accepted = (clients < MEDIA_HTTP_MAX_CLIENTS);
+		if(accepted)
+		{
+			clients++;
+		}
+		pthread_mutex_unlock(&lock);
+
+		if(!accepted)
+		{
+			send_status(fd, 503, "Service Unavailable");
+			close(fd);
+			continue;
+		}
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+		if(pthread_create(&client_thread, &attr, client_func, (void*)(long)fd) != 0)
+		{
+			close(fd);
+			pthread_mutex_lock(&lock);
+			clients--;
+			pthread_mutex_unlock(&lock);
+		}
+
+		pthread_attr_destroy(&attr);
+	}
+
+	close(listener->fd);
+	free(listener);
+
+	return NULL;
+}
+
+void media_http_configure(int port)
+{
+	listen_port = port;
+}
+
+MEDIA_HTTP_LISTENER_S* media_http_listen(const char* host, const char* iface)
+{
+	struct sockaddr_storage	addr;
+	struct sockaddr_in*		addr4 		= (struct sockaddr_in*)&addr;
+	struct sockaddr_in6*	addr6 		= (struct sockaddr_in6*)&addr;
+	socklen_t				addr_len;
+	MEDIA_HTTP_LISTENER_S*	listener;
+	pthread_t				accept_thread;
+	pthread_attr_t			attr;
+	int						fd;
+	int						on 			= 1;
+
+	memset(&addr, 0, sizeof(addr));
+
+	if(inet_pton(AF_INET, host, &addr4->sin_addr) == 1)
+	{
+		addr4->sin_family 	= AF_INET;
+		addr4->sin_port 	= htons(listen_port);
+		addr_len 			= sizeof(*addr4);
+	}
+	else if(inet_pton(AF_INET6, host, &addr6->sin6_addr) == 1)
+	{
+		addr6->sin6_family 		= AF_INET6;
+		addr6->sin6_port 		= htons(listen_port);
+		addr6->sin6_scope_id 	= if_nametoindex(iface);
+		addr_len 				= sizeof(*addr6);
+	}
+	else
+	{
+		LOG(LOG_ERR, "Media HTTP server cannot use address %s on %s", host, iface);
+		return NULL;
+	}
+
+	if((fd = socket(addr.ss_family, SOCK_STREAM, 0)) < 0)
+	{
+		LOG(LOG_ERR, "Media HTTP socket failed");
+		return NULL;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if(bind(fd, (struct sockaddr*)&addr, addr_len) < 0 || listen(fd, MEDIA_HTTP_MAX_CLIENTS) < 0)
+	{
+		LOG(LOG_ERR, "Media HTTP server cannot listen on %s:%d", host, listen_port);
+		close(fd);
+		return NULL;
+	}
+
+	listener 			= calloc(1, sizeof(*listener));
+	listener->fd 		= fd;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if(pthread_create(&accept_thread, &attr, accept_func, listener) != 0)
+	{
+		close(fd);
+		free(listener);
+		listener = NULL;
+	}
+	else
+	{
+		LOG(LOG_INFO, "Media HTTP server on %s:%d (%s)", host, listen_port, iface);
+	}
+
+	pthread_attr_destroy(&attr);
+
+	return listener;
+}
+
+void media_http_close(MEDIA_HTTP_LISTENER_S* listener)
+{
+	pthread_mutex_lock(&lock);
+	listener->closing = 1;
+	pthread_mutex_unlock(&lock);
+
+	// Wakes the accept thread, which closes the socket and frees the listener
+	shutdown(listener->fd, SHUT_RDWR);
+}
+
+int media_http_get_port(void)
+{
+	return listen_port;
+}
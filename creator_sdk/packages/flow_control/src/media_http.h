@@ -0,0 +1,21 @@
+#ifndef MEDIA_HTTP_H
+#define MEDIA_HTTP_H
+
+#define MEDIA_HTTP_DEFAULT_PORT		8200
+#define MEDIA_HTTP_MAX_CLIENTS		8
+#define MEDIA_HTTP_PATH_PREFIX		"/media/"
+
+// Renderers reach the server on each allowed network context's address, never on a wildcard
+typedef struct MEDIA_HTTP_LISTENER_S MEDIA_HTTP_LISTENER_S;
+
+void media_http_configure(int port);
+
+// Listen on the address the context has on iface, NULL if it cannot be bound
+MEDIA_HTTP_LISTENER_S* media_http_listen(const char* host, const char* iface);
+
+// Stop listening, clients already connected finish their responses
+void media_http_close(MEDIA_HTTP_LISTENER_S* listener);
+
+int media_http_get_port(void);
+
+#endif	/* MEDIA_HTTP_H */
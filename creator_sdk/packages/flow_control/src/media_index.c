@@ -0,0 +1,491 @@
+#include "media_index.h"
+#include "log.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INOTIFY_MASK		(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE)
+#define INOTIFY_BUFF_SIZE	(4096)
+#define INITIAL_CAPACITY	(256)
+
+static const struct
+{
+	const char* extension;
+	const char* mime;
+
+} mime_types[] =
+{
+	{ ".mp3",	"audio/mpeg" },
+	{ ".flac",	"audio/x-flac" },
+	{ ".ogg",	"audio/ogg" },
+	{ ".m4a",	"audio/mp4" },
+	{ ".aac",	"audio/aac" },
+	{ ".wav",	"audio/wav" },
+};
+
+static MEDIA_ENTRY_S*			entries 			= NULL;
+static int						capacity 			= 0;
+static int						used 				= 0;
+static int						free_list 			= MEDIA_INDEX_NONE;
+static unsigned int				system_update_id 	= 0;
+static int						inotify_fd 			= -1;
+static media_index_changed_cb	changed_cb 			= NULL;
+static pthread_rwlock_t			lock 				= PTHREAD_RWLOCK_INITIALIZER;
+
+static const char* mime_type(const char* name)
+{
+	const char*		extension = strrchr(name, '.');
+	unsigned int	i;
+
+	for(i = 0; extension != NULL && i < sizeof(mime_types) / sizeof(mime_types[0]); i++)
+	{
+		if(strcasecmp(extension, mime_types[i].extension) == 0)
+		{
+			return mime_types[i].mime;
+		}
+	}
+
+	return NULL;
+}
+
+// Allocate an entry, reusing removed slots under a new generation. Write lock held.
+static int entry_new(void)
+{
+	int				id 			= free_list;
+	unsigned int	generation 	= 0;
+
+	if(id != MEDIA_INDEX_NONE)
+	{
+		free_list 	= entries[id].next_sibling;
+		generation 	= ((entries[id].id >> MEDIA_INDEX_SLOT_BITS) + 1) % MEDIA_INDEX_GENERATIONS;
+	}
+	else
+	{
+		if(used == MEDIA_INDEX_MAX_ENTRIES)
+		{
+			return MEDIA_INDEX_NONE;
+		}
+
+		if(used == capacity)
+		{
+			int 			new_capacity 	= capacity ? capacity * 2 : INITIAL_CAPACITY;
+			MEDIA_ENTRY_S*	grown 			= realloc(entries, new_capacity * sizeof(MEDIA_ENTRY_S));
+
+			if(grown == NULL)
+			{
+				return MEDIA_INDEX_NONE;
+			}
+
+			entries 	= grown;
+			capacity 	= new_capacity;
+		}
+		id = used++;
+	}
+
+	memset(&entries[id], 0, sizeof(MEDIA_ENTRY_S));
+	entries[id].id 				= id | (generation << MEDIA_INDEX_SLOT_BITS);
+	entries[id].first_child 	= MEDIA_INDEX_NONE;
+	entries[id].next_sibling 	= MEDIA_INDEX_NONE;
+	entries[id].wd 				= -1;
+	entries[id].in_use 			= 1;
+
+	return id;
+}
+
+static int add_entry(int parent, const char* name, const char* path, int is_container, off_t size, const char* mime)
+{
+	int id = entry_new();
+
+	if(id != MEDIA_INDEX_NONE)
+	{
+		MEDIA_ENTRY_S* entry = &entries[id];
+
+		entry->parent 		= parent;
+		entry->is_container = is_container;
+		entry->name 		= strdup(name);
+		entry->path 		= strdup(path);
+		entry->size 		= size;
+		entry->mime 		= mime;
+
+		if(parent != MEDIA_INDEX_NONE)
+		{
+			entry->next_sibling 			= entries[parent].first_child;
+			entries[parent].first_child 	= id;
+			entries[parent].child_count++;
+		}
+	}
+
+	return id;
+}
+
+static int find_child(int parent, const char* name)
+{
+	int id;
+
+	for(id = entries[parent].first_child; id != MEDIA_INDEX_NONE; id = entries[id].next_sibling)
+	{
+		if(strcmp(entries[id].name, name) == 0)
+		{
+			return id;
+		}
+	}
+
+	return MEDIA_INDEX_NONE;
+}
+
+static void remove_entry(int id)
+{
+	MEDIA_ENTRY_S*	entry = &entries[id];
+	int*			link;
+
+	while(entry->first_child != MEDIA_INDEX_NONE)
+	{
+		remove_entry(entry->first_child);
+	}
+
+	if(entry->wd >= 0)
+	{
+		inotify_rm_watch(inotify_fd, entry->wd);
+	}
+
+	// Unlink from the parent
+	for(link = &entries[entry->parent].first_child; *link != MEDIA_INDEX_NONE; link = &entries[*link].next_sibling)
+	{
+		if(*link == id)
+		{
+			*link = entry->next_sibling;
+			entries[entry->parent].child_count--;
+			break;
+		}
+	}
+
+	free(entry->name);
+	free(entry->path);
+	entry->in_use 		= 0;
+	entry->next_sibling = free_list;
+	free_list 			= id;
+}
+
+static void scan(int container);
+
+// Index a single directory entry. Write lock held.
+static void add_path(int container, const char* name)
+{
+	char		path[MEDIA_INDEX_PATH_LEN];
+	struct stat	st;
+	const char*	mime;
+
+	if(name[0] == '.')
+	{
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", entries[container].path, name);
+
+	if(stat(path, &st) != 0 || find_child(container, name) != MEDIA_INDEX_NONE)
+	{
+		return;
+	}
+
+	if(S_ISDIR(st.st_mode))
+	{
+		int id = add_entry(container, name, path, 1, 0, NULL);
+
+		if(id != MEDIA_INDEX_NONE)
+		{
+			scan(id);
+		}
+	}
+	else if(S_ISREG(st.st_mode) && (mime = mime_type(name)) != NULL)
+	{
+		add_entry(container, name, path, 0, st.st_size, mime);
+	}
+}
+
+static void scan(int container)
+{
+	DIR*			dir = opendir(entries[container].path);
+	struct dirent*	dirent;
+
+	if(dir == NULL)
+	{
+		LOG(LOG_WARN, "Cannot open media directory %s", entries[container].path);
+		return;
+	}
+
+	entries[container].wd = inotify_add_watch(inotify_fd, entries[container].path, INOTIFY_MASK);
+
+	while((dirent = readdir(dir)) != NULL)
+	{
+		add_path(container, dirent->d_name);
+	}
+
+	closedir(dir);
+}
+
+// Bring a container in line with disk after events were lost. Entries that
+// still exist keep their IDs. Write lock held.
+static void rescan(int container)
+{
+	DIR*			dir;
+	struct dirent*	dirent;
+	int				id;
+	int				next;
+
+	for(id = entries[container].first_child; id != MEDIA_INDEX_NONE; id = next)
+	{
+		struct stat st;
+
+		next = entries[id].next_sibling;
+
+		if(stat(entries[id].path, &st) != 0 || (!S_ISDIR(st.st_mode) != !entries[id].is_container))
+		{
+			remove_entry(id);
+		}
+		else if(entries[id].is_container)
+		{
+			rescan(id);
+		}
+		else
+		{
+			entries[id].size = st.st_size;
+		}
+	}
+
+	if((dir = opendir(entries[container].path)) == NULL)
+	{
+		return;
+	}
+
+	// Also restores a watch lost with the events
+	entries[container].wd = inotify_add_watch(inotify_fd, entries[container].path, INOTIFY_MASK);
+
+	while((dirent = readdir(dir)) != NULL)
+	{
+		add_path(container, dirent->d_name);
+	}
+
+	closedir(dir);
+}
+
+static int find_watch(int wd)
+{
+	int id;
+
+	for(id = 0; id < used; id++)
+	{
+		if(entries[id].in_use && entries[id].is_container && entries[id].wd == wd)
+		{
+			return id;
+		}
+	}
+
+	return MEDIA_INDEX_NONE;
+}
+
+// Apply one inotify event. Write lock held. Returns the changed container.
+static int apply_event(struct inotify_event* event)
+{
+	int container;
+	int child;
+
+	// The kernel queue overflowed and events were dropped, only a walk of the tree can tell what changed
+	if(event->mask & IN_Q_OVERFLOW)
+	{
+		LOG(LOG_WARN, "Media index events lost, rescanning");
+		rescan(MEDIA_INDEX_ROOT_ID);
+		return MEDIA_INDEX_ROOT_ID;
+	}
+
+	container = find_watch(event->wd);
+
+	if(container == MEDIA_INDEX_NONE || event->len == 0)
+	{
+		return MEDIA_INDEX_NONE;
+	}
+
+	child = find_child(container, event->name);
+
+	if(event->mask & (IN_DELETE | IN_MOVED_FROM))
+	{
+		if(child == MEDIA_INDEX_NONE)
+		{
+			return MEDIA_INDEX_NONE;
+		}
+		remove_entry(child);
+	}
+	else if((event->mask & IN_CLOSE_WRITE) && child != MEDIA_INDEX_NONE)
+	{
+		struct stat st;
+
+		// Finished writing, refresh the size but keep the ID
+		if(stat(entries[child].path, &st) == 0)
+		{
+			entries[child].size = st.st_size;
+		}
+	}
+	else
+	{
+		add_path(container, event->name);
+	}
+
+	return container;
+}
+
+static void* watch_func(void* data)
+{
+	char buffer[INOTIFY_BUFF_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while(1)
+	{
+		ssize_t	len 		= read(inotify_fd, buffer, sizeof(buffer));
+		ssize_t	offset 		= 0;
+		int		container 	= MEDIA_INDEX_NONE;
+		int		changed 	= 0;
+
+		if(len <= 0)
+		{
+			if(len < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			LOG(LOG_ERR, "Media index watch stopped");
+			break;
+		}
+
+		pthread_rwlock_wrlock(&lock);
+
+		// A read returns a batch of events, publish one update for all of them
+		while(offset < len)
+		{
+			struct inotify_event* event = (struct inotify_event*)(buffer + offset);
+			int res = apply_event(event);
+
+			if(res != MEDIA_INDEX_NONE)
+			{
+				container = changed ? ((container == res) ? res : MEDIA_INDEX_ROOT_ID) : res;
+				changed++;
+			}
+
+			offset += sizeof(struct inotify_event) + event->len;
+		}
+
+		if(changed)
+		{
+			system_update_id++;
+			container = entries[container].id;
+		}
+
+		pthread_rwlock_unlock(&lock);
+
+		if(changed && changed_cb)
+		{
+			changed_cb(system_update_id, container);
+		}
+	}
+
+	return NULL;
+}
+
+int media_index_init(const char* root, media_index_changed_cb cb)
+{
+	pthread_t	watch_thread;
+	int			count = 0;
+	int			id;
+
+	inotify_fd = inotify_init();
+
+	if(inotify_fd < 0)
+	{
+		LOG(LOG_ERR, "inotify_init failed");
+		return -1;
+	}
+
+	changed_cb = cb;
+
+	pthread_rwlock_wrlock(&lock);
+
+	add_entry(MEDIA_INDEX_NONE, "root", root, 1, 0, NULL);
+	scan(MEDIA_INDEX_ROOT_ID);
+
+	for(id = 0; id < used; id++)
+	{
+		count += (entries[id].in_use && !entries[id].is_container);
+	}
+
+	pthread_rwlock_unlock(&lock);
+
+	LOG(LOG_INFO, "Media index: %d tracks under %s", count, root);
+
+	pthread_create(&watch_thread, NULL, watch_func, NULL);
+
+	return count;
+}
+
+void media_index_read_lock(void)
+{
+	pthread_rwlock_rdlock(&lock);
+}
+
+void media_index_read_unlock(void)
+{
+	pthread_rwlock_unlock(&lock);
+}
+
+const MEDIA_ENTRY_S* media_index_get(int slot)
+{
+	if(slot >= 0 && slot < used && entries[slot].in_use)
+	{
+		return &entries[slot];
+	}
+
+	return NULL;
+}
+
+const MEDIA_ENTRY_S* media_index_find(int id)
+{
+	const MEDIA_ENTRY_S* entry = media_index_get(id & (MEDIA_INDEX_MAX_ENTRIES - 1));
+
+	return (entry && entry->id == id) ? entry : NULL;
+}
+
+unsigned int media_index_system_update_id(void)
+{
+	unsigned int id;
+
+	pthread_rwlock_rdlock(&lock);
+	id = system_update_id;
+	pthread_rwlock_unlock(&lock);
+
+	return id;
+}
+
+int media_index_lookup_file(int id, char* path, off_t* size, const char** mime)
+{
+	const MEDIA_ENTRY_S*	entry;
+	int						res = 0;
+
+	pthread_rwlock_rdlock(&lock);
+
+	entry = media_index_find(id);
+
+	if(entry && !entry->is_container)
+	{
+		strncpy(path, entry->path, MEDIA_INDEX_PATH_LEN - 1);
+		path[MEDIA_INDEX_PATH_LEN - 1] = '\0';
+		*size 	= entry->size;
+		*mime 	= entry->mime;
+		res 	= 1;
+	}
+
+	pthread_rwlock_unlock(&lock);
+
+	return res;
+}
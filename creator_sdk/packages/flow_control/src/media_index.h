@@ -0,0 +1,53 @@
+#ifndef MEDIA_INDEX_H
+#define MEDIA_INDEX_H
+
+#include <sys/types.h>
+
+#define MEDIA_INDEX_ROOT_ID		0
+#define MEDIA_INDEX_NONE		-1
+#define MEDIA_INDEX_PATH_LEN	512
+
+// Object IDs carry the slot's generation above the slot index, so an ID held
+// by a renderer for a removed file never resolves to whatever reuses the slot
+#define MEDIA_INDEX_SLOT_BITS		20
+#define MEDIA_INDEX_MAX_ENTRIES		(1 << MEDIA_INDEX_SLOT_BITS)
+#define MEDIA_INDEX_GENERATIONS		(1 << (31 - MEDIA_INDEX_SLOT_BITS))
+
+typedef struct
+{
+	int				id;				// Object ID, the slot index plus its generation
+	int				parent;			// Links between entries are slot indices
+	int				is_container;
+	char*			name;
+	char*			path;
+	off_t			size;
+	const char*		mime;
+	unsigned int	child_count;
+	int				first_child;
+	int				next_sibling;
+	int				wd;				// inotify watch, containers only
+	int				in_use;
+
+} MEDIA_ENTRY_S;
+
+// Called from the index thread after every batch of changes, with the changed container's object ID
+typedef void (*media_index_changed_cb)(unsigned int system_update_id, int container_id);
+
+int media_index_init(const char* root, media_index_changed_cb cb);
+
+// Entries returned by media_index_get() stay valid until the read lock is released
+void media_index_read_lock(void);
+
+void media_index_read_unlock(void);
+
+// By slot index, for following the links between entries
+const MEDIA_ENTRY_S* media_index_get(int slot);
+
+// By object ID, as handed out to renderers
+const MEDIA_ENTRY_S* media_index_find(int id);
+
+unsigned int media_index_system_update_id(void);
+
+int media_index_lookup_file(int id, char* path, off_t* size, const char** mime);
+
+#endif	/* MEDIA_INDEX_H */
@@ -0,0 +1,500 @@
+#include "media_server.h"
+#include "media_index.h"
+#include "media_http.h"
+#include "log.h"
+#include <libgupnp-av/gupnp-av.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CONTENT_DIRECTORY 		"urn:schemas-upnp-org:service:ContentDirectory"
+#define CONNECTION_MANAGER 		"urn:schemas-upnp-org:service:ConnectionManager"
+#define DESCRIPTION_FILE		"MediaServer.xml"
+#define UDN_LEN					64
+#define NAME_LEN				64
+
+#define ERR_NO_SUCH_OBJECT		701
+#define ERR_INVALID_ARGS		402
+
+#define CONTAINER_CLASS			"object.container.storageFolder"
+#define MUSIC_TRACK_CLASS		"object.item.audioItem.musicTrack"
+
+static const char* description_template =
+	"<?xml version=\"1.0\"?>\n"
+	"<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\n"
+	"  <specVersion><major>1</major><minor>0</minor></specVersion>\n"
+	"  <device>\n"
+	"    <deviceType>urn:schemas-upnp-org:device:MediaServer:1</deviceType>\n"
+	"    <friendlyName>%s</friendlyName>\n"
+	"    <manufacturer>Imagination Technologies</manufacturer>\n"
+	"    <modelName>CI40 flow_control</modelName>\n"
+	"    <UDN>%s</UDN>\n"
+	"    <serviceList>\n"
+	"      <service>\n"
+	"        <serviceType>urn:schemas-upnp-org:service:ContentDirectory:1</serviceType>\n"
+	"        <serviceId>urn:upnp-org:serviceId:ContentDirectory</serviceId>\n"
+	"        <SCPDURL>/ContentDirectory.xml</SCPDURL>\n"
+	"        <controlURL>/ContentDirectory/control</controlURL>\n"
+	"        <eventSubURL>/ContentDirectory/event</eventSubURL>\n"
+	"      </service>\n"
+	"      <service>\n"
+	"        <serviceType>urn:schemas-upnp-org:service:ConnectionManager:1</serviceType>\n"
+	"        <serviceId>urn:upnp-org:serviceId:ConnectionManager</serviceId>\n"
+	"        <SCPDURL>/ConnectionManager.xml</SCPDURL>\n"
+	"        <controlURL>/ConnectionManager/control</controlURL>\n"
+	"        <eventSubURL>/ConnectionManager/event</eventSubURL>\n"
+	"      </service>\n"
+	"    </serviceList>\n"
+	"  </device>\n"
+	"</root>\n";
+
+static const char* source_protocol_info =
+	"http-get:*:audio/mpeg:*,"
+	"http-get:*:audio/x-flac:*,"
+	"http-get:*:audio/ogg:*,"
+	"http-get:*:audio/mp4:*,"
+	"http-get:*:audio/aac:*,"
+	"http-get:*:audio/wav:*";
+
+typedef struct
+{
+	GUPnPContext*		context;
+	GUPnPRootDevice*	device;
+	GUPnPService*		content_directory;
+	GUPnPService*		connection_manager;
+	MEDIA_HTTP_LISTENER_S*	listener;
+
+} SERVER_S;
+
+static int			enabled 			= 0;
+static char			friendly_name[NAME_LEN];
+static GList*		servers 			= NULL;		// Touched on the GLib thread only
+
+// Derive a stable UDN from the first non-loopback interface MAC so it
+// survives restarts and differs between gateways
+static void make_udn(char* udn)
+{
+	char			mac[32] 	= "000000000000";
+	DIR*			dir 		= opendir("/sys/class/net");
+	struct dirent*	dirent;
+
+	while(dir && (dirent = readdir(dir)) != NULL)
+	{
+		char	path[128];
+		char	address[32];
+		FILE*	file;
+
+		if(dirent->d_name[0] == '.' || strcmp(dirent->d_name, "lo") == 0)
+		{
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "/sys/class/net/%s/address", dirent->d_name);
+
+		if((file = fopen(path, "r")) != NULL)
+		{
+			unsigned int b[6];
+
+			if(fgets(address, sizeof(address), file) &&
+				sscanf(address, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) == 6 &&
+				(b[0] | b[1] | b[2] | b[3] | b[4] | b[5]))
+			{
+				snprintf(mac, sizeof(mac), "%02x%02x%02x%02x%02x%02x", b[0], b[1], b[2], b[3], b[4], b[5]);
+				fclose(file);
+				break;
+			}
+			fclose(file);
+		}
+	}
+
+	if(dir)
+	{
+		closedir(dir);
+	}
+
+	snprintf(udn, UDN_LEN, "uuid:f10ac0de-4d53-4349-3430-%s", mac);
+}
+
+// The description carries the UDN and name, so it is generated into a runtime
+// directory alongside links to the installed service descriptions
+static int write_description(void)
+{
+	char	udn[UDN_LEN];
+	char*	name;
+	FILE*	file;
+
+	mkdir(MEDIA_SERVER_RUN_DIR, 0755);
+
+	if((file = fopen(MEDIA_SERVER_RUN_DIR "/" DESCRIPTION_FILE, "w")) == NULL)
+	{
+		LOG(LOG_ERR, "Cannot write media server description");
+		return 0;
+	}
+
+	make_udn(udn);
+	name = g_markup_escape_text(friendly_name, -1);
+	fprintf(file, description_template, name, udn);
+	g_free(name);
+	fclose(file);
+
+	unlink(MEDIA_SERVER_RUN_DIR "/ContentDirectory.xml");
+	unlink(MEDIA_SERVER_RUN_DIR "/ConnectionManager.xml");
+	symlink(MEDIA_SERVER_XML_DIR "/ContentDirectory.xml", MEDIA_SERVER_RUN_DIR "/ContentDirectory.xml");
+	symlink(MEDIA_SERVER_XML_DIR "/ConnectionManager.xml", MEDIA_SERVER_RUN_DIR "/ConnectionManager.xml");
+
+	return 1;
+}
+
+static void add_entry(GUPnPDIDLLiteWriter* writer, const MEDIA_ENTRY_S* entry, const char* host)
+{
+	GUPnPDIDLLiteObject	*object;
+	char				id[16], parent[16];
+
+	snprintf(id, sizeof(id), "%d", entry->id);
+	snprintf(parent, sizeof(parent), "%d", (entry->parent == MEDIA_INDEX_NONE) ? -1 : media_index_get(entry->parent)->id);
+
+	if(entry->is_container)
+	{
+		GUPnPDIDLLiteContainer* container = gupnp_didl_lite_writer_add_container(writer);
+
+		gupnp_didl_lite_container_set_child_count(container, entry->child_count);
+		object = GUPNP_DIDL_LITE_OBJECT(container);
+		gupnp_didl_lite_object_set_upnp_class(object, CONTAINER_CLASS);
+		gupnp_didl_lite_object_set_title(object, entry->name);
+	}
+	else
+	{
+		GUPnPDIDLLiteResource	*res;
+		GUPnPProtocolInfo		*info;
+		char					*title 	= g_strdup(entry->name);
+		char					*dot 	= strrchr(title, '.');
+		char					*uri;
+
+		if(dot)
+		{
+			*dot = '\0';
+		}
+
+		object = GUPNP_DIDL_LITE_OBJECT(gupnp_didl_lite_writer_add_item(writer));
+		gupnp_didl_lite_object_set_upnp_class(object, MUSIC_TRACK_CLASS);
+		gupnp_didl_lite_object_set_title(object, title);
+
+		info = gupnp_protocol_info_new();
+		gupnp_protocol_info_set_protocol(info, "http-get");
+		gupnp_protocol_info_set_network(info, "*");
+		gupnp_protocol_info_set_mime_type(info, entry->mime);
+
+		uri = g_strdup_printf("http://%s:%d" MEDIA_HTTP_PATH_PREFIX "%d", host, media_http_get_port(), entry->id);
+
+		res = gupnp_didl_lite_object_add_resource(object);
+		gupnp_didl_lite_resource_set_uri(res, uri);
+		gupnp_didl_lite_resource_set_size64(res, entry->size);
+		gupnp_didl_lite_resource_set_protocol_info(res, info);
+
+		g_free(uri);
+		g_free(title);
+		g_object_unref(info);
+		g_object_unref(res);
+	}
+
+	gupnp_didl_lite_object_set_id(object, id);
+	gupnp_didl_lite_object_set_parent_id(object, parent);
+	gupnp_didl_lite_object_set_restricted(object, TRUE);
+
+	g_object_unref(object);
+}
+
+static void
+browse_cb (GUPnPService       *service,
+           GUPnPServiceAction *action,
+           gpointer            user_data)
+{
+	char					*object_id 	= NULL;
+	char					*flag 		= NULL;
+	guint					start 		= 0;
+	guint					requested 	= 0;
+	guint					returned 	= 0;
+	guint					total 		= 0;
+	const char				*host;
+	const MEDIA_ENTRY_S		*entry;
+	GUPnPDIDLLiteWriter		*writer;
+	char					*result;
+	char					*end;
+	long					id;
+
+	gupnp_service_action_get (action,
+								"ObjectID", G_TYPE_STRING, &object_id,
+								"BrowseFlag", G_TYPE_STRING, &flag,
+								"StartingIndex", G_TYPE_UINT, &start,
+								"RequestedCount", G_TYPE_UINT, &requested,
+								NULL);
+
+	id = object_id ? strtol(object_id, &end, 10) : -1;
+
+	if(object_id == NULL || *end != '\0' || flag == NULL)
+	{
+		gupnp_service_action_return_error (action, ERR_INVALID_ARGS, "Invalid Args");
+		g_free(object_id);
+		g_free(flag);
+		return;
+	}
+
+	host 	= gupnp_context_get_host_ip (gupnp_service_info_get_context (GUPNP_SERVICE_INFO (service)));
+	writer 	= gupnp_didl_lite_writer_new (NULL);
+
+	media_index_read_lock();
+
+	entry = media_index_find(id);
+
+	if(entry == NULL)
+	{
+		media_index_read_unlock();
+		gupnp_service_action_return_error (action, ERR_NO_SUCH_OBJECT, "No such object");
+		g_object_unref(writer);
+		g_free(object_id);
+		g_free(flag);
+		return;
+	}
+
+	if(strcmp(flag, "BrowseMetadata") == 0)
+	{
+		add_entry(writer, entry, host);
+		returned = total = 1;
+	}
+	else
+	{
+		int child;
+
+		// Children come straight from the cached index, no file system access
+		for(child = entry->first_child; child != MEDIA_INDEX_NONE; child = media_index_get(child)->next_sibling)
+		{
+			if(total >= start && (requested == 0 || returned < requested))
+			{
+				add_entry(writer, media_index_get(child), host);
+				returned++;
+			}
+			total++;
+		}
+	}
+
+	media_index_read_unlock();
+
+	result = gupnp_didl_lite_writer_get_string (writer);
+
+	gupnp_service_action_set (action,
+								"Result", G_TYPE_STRING, result,
+								"NumberReturned", G_TYPE_UINT, returned,
+								"TotalMatches", G_TYPE_UINT, total,
+								"UpdateID", G_TYPE_UINT, media_index_system_update_id(),
+								NULL);
+	gupnp_service_action_return (action);
+
+	g_free(result);
+	g_object_unref(writer);
+	g_free(object_id);
+	g_free(flag);
+}
+
+static void
+get_system_update_id_cb (GUPnPService       *service,
+                         GUPnPServiceAction *action,
+                         gpointer            user_data)
+{
+	gupnp_service_action_set (action, "Id", G_TYPE_UINT, media_index_system_update_id(), NULL);
+	gupnp_service_action_return (action);
+}
+
+static void
+get_capabilities_cb (GUPnPService       *service,
+                     GUPnPServiceAction *action,
+                     gpointer            user_data)
+{
+	// No search or sort support, only the capability name differs
+	gupnp_service_action_set (action, (const char*)user_data, G_TYPE_STRING, "", NULL);
+	gupnp_service_action_return (action);
+}
+
+static void
+query_system_update_id_cb (GUPnPService *service,
+                           const char   *variable,
+                           GValue       *value,
+                           gpointer      user_data)
+{
+	g_value_init (value, G_TYPE_UINT);
+	g_value_set_uint (value, media_index_system_update_id());
+}
+
+static void
+get_protocol_info_cb (GUPnPService       *service,
+                      GUPnPServiceAction *action,
+                      gpointer            user_data)
+{
+	gupnp_service_action_set (action,
+								"Source", G_TYPE_STRING, source_protocol_info,
+								"Sink", G_TYPE_STRING, "",
+								NULL);
+	gupnp_service_action_return (action);
+}
+
+static void
+get_current_connection_ids_cb (GUPnPService       *service,
+                               GUPnPServiceAction *action,
+                               gpointer            user_data)
+{
+	gupnp_service_action_set (action, "ConnectionIDs", G_TYPE_STRING, "0", NULL);
+	gupnp_service_action_return (action);
+}
+
+static void
+get_current_connection_info_cb (GUPnPService       *service,
+                                GUPnPServiceAction *action,
+                                gpointer            user_data)
+{
+	gupnp_service_action_set (action,
+								"RcsID", G_TYPE_INT, -1,
+								"AVTransportID", G_TYPE_INT, -1,
+								"ProtocolInfo", G_TYPE_STRING, "",
+								"PeerConnectionManager", G_TYPE_STRING, "",
+								"PeerConnectionID", G_TYPE_INT, -1,
+								"Direction", G_TYPE_STRING, "Output",
+								"Status", G_TYPE_STRING, "OK",
+								NULL);
+	gupnp_service_action_return (action);
+}
+
+static int notify_changed(void* data)
+{
+	GList* item;
+
+	for(item = servers; item != NULL; item = item->next)
+	{
+		SERVER_S* server = item->data;
+
+		gupnp_service_notify (server->content_directory,
+								"SystemUpdateID", G_TYPE_UINT, media_index_system_update_id(),
+								"ContainerUpdateIDs", G_TYPE_STRING, (char*)data,
+								NULL);
+	}
+
+	g_free(data);
+
+	return G_SOURCE_REMOVE;
+}
+
+// Index thread: hand the change over to the GLib thread for eventing
+static void index_changed_cb(unsigned int system_update_id, int container_id)
+{
+	g_idle_add(notify_changed, g_strdup_printf("%d,%u", container_id, system_update_id));
+}
+
+int media_server_configure(config_t* cfg)
+{
+	const char*	directory 	= NULL;
+	const char*	name 		= MEDIA_SERVER_DEFAULT_NAME;
+	int			port 		= MEDIA_HTTP_DEFAULT_PORT;
+
+	config_lookup_bool(cfg, "media_server.enabled", &enabled);
+
+	if(!enabled)
+	{
+		return 0;
+	}
+
+	if(!config_lookup_string(cfg, "media_server.directory", &directory))
+	{
+		LOG(LOG_ERR, "Media server enabled without a directory");
+		enabled = 0;
+		return 0;
+	}
+
+	config_lookup_string(cfg, "media_server.name", &name);
+	config_lookup_int(cfg, "media_server.port", &port);
+
+	strncpy(friendly_name, name, sizeof(friendly_name) - 1);
+	media_http_configure(port);
+
+	if(media_index_init(directory, index_changed_cb) < 0 || !write_description())
+	{
+		enabled = 0;
+	}
+
+	return enabled;
+}
+
+void media_server_context_available(GUPnPContextManager* context_manager, GUPnPContext* context)
+{
+	SERVER_S*				server;
+	MEDIA_HTTP_LISTENER_S*	listener;
+
+	if(!enabled)
+	{
+		return;
+	}
+
+	// Only contexts the interface policy allows get here, streams are served on their address alone
+	listener = media_http_listen(gupnp_context_get_host_ip(context),
+									gssdp_client_get_interface(GSSDP_CLIENT(context)));
+
+	if(listener == NULL)
+	{
+		return;
+	}
+
+	server 				= g_new0(SERVER_S, 1);
+	server->context 	= context;
+	server->listener 	= listener;
+	server->device 	= gupnp_root_device_new (context, DESCRIPTION_FILE, MEDIA_SERVER_RUN_DIR);
+
+	server->content_directory = GUPNP_SERVICE (gupnp_device_info_get_service (GUPNP_DEVICE_INFO (server->device),
+																				CONTENT_DIRECTORY));
+	server->connection_manager = GUPNP_SERVICE (gupnp_device_info_get_service (GUPNP_DEVICE_INFO (server->device),
+																				CONNECTION_MANAGER));
+
+	g_signal_connect (server->content_directory, "action-invoked::Browse", G_CALLBACK (browse_cb), NULL);
+	g_signal_connect (server->content_directory, "action-invoked::GetSystemUpdateID",
+						G_CALLBACK (get_system_update_id_cb), NULL);
+	g_signal_connect (server->content_directory, "action-invoked::GetSearchCapabilities",
+						G_CALLBACK (get_capabilities_cb), "SearchCaps");
+	g_signal_connect (server->content_directory, "action-invoked::GetSortCapabilities",
+						G_CALLBACK (get_capabilities_cb), "SortCaps");
+	g_signal_connect (server->content_directory, "query-variable::SystemUpdateID",
+						G_CALLBACK (query_system_update_id_cb), NULL);
+
+	g_signal_connect (server->connection_manager, "action-invoked::GetProtocolInfo",
+						G_CALLBACK (get_protocol_info_cb), NULL);
+	g_signal_connect (server->connection_manager, "action-invoked::GetCurrentConnectionIDs",
+						G_CALLBACK (get_current_connection_ids_cb), NULL);
+	g_signal_connect (server->connection_manager, "action-invoked::GetCurrentConnectionInfo",
+						G_CALLBACK (get_current_connection_info_cb), NULL);
+
+	gupnp_root_device_set_available (server->device, TRUE);
+
+	/* Let context manager take care of the root device life cycle */
+	gupnp_context_manager_manage_root_device (context_manager, server->device);
+
+	servers = g_list_prepend(servers, server);
+}
+
+void media_server_context_unavailable(GUPnPContext* context)
+{
+	GList* item;
+
+	for(item = servers; item != NULL; item = item->next)
+	{
+		SERVER_S* server = item->data;
+
+		if(server->context == context)
+		{
+			servers = g_list_remove(servers, server);
+
+			g_object_unref(server->content_directory);
+			g_object_unref(server->connection_manager);
+			g_object_unref(server->device);
+			media_http_close(server->listener);
+			g_free(server);
+			break;
+		}
+	}
+}
@@ -0,0 +1,17 @@
+#ifndef MEDIA_SERVER_H
+#define MEDIA_SERVER_H
+
+#include <libconfig.h>
+#include <libgupnp/gupnp-control-point.h>
+
+#define MEDIA_SERVER_XML_DIR		"/usr/share/flow_control/xml"
+#define MEDIA_SERVER_RUN_DIR		"/var/run/flow_control"
+#define MEDIA_SERVER_DEFAULT_NAME	"CI40 Music"
+
+int media_server_configure(config_t* cfg);
+
+void media_server_context_available(GUPnPContextManager* context_manager, GUPnPContext* context);
+
+void media_server_context_unavailable(GUPnPContext* context);
+
+#endif	/* MEDIA_SERVER_H */
@@ -0,0 +1,263 @@
+#include "metrics.h"
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define METRICS_BUCKETS			9
+#define METRICS_CACHE_LINE		64
+#define METRICS_BUFFER_SIZE		8192
+#define METRICS_SEND_TIMEOUT_S	2
+
+typedef struct
+{
+	const char*	name;
+	const char*	help;
+
+} METRIC_INFO_S;
+
+// Each thread writes only its own shard, the scraper sums them
+typedef struct
+{
+	unsigned long	counters[METRIC_COUNTER_COUNT];
+	unsigned long	buckets[METRIC_HISTOGRAM_COUNT][METRICS_BUCKETS + 1];
+	unsigned long	sums[METRIC_HISTOGRAM_COUNT];
+
+} __attribute__((aligned(METRICS_CACHE_LINE))) METRICS_SHARD_S;
+
+static const METRIC_INFO_S counter_info[METRIC_COUNTER_COUNT] =
+{
+	{ "flow_control_events_received_total", 	"Sensor notifications received" },
+	{ "flow_control_events_debounced_total", 	"Renderer actions coalesced or superseded while queued" },
+	{ "flow_control_events_routed_total", 		"Sensor notifications routed to a renderer action" },
+	{ "flow_control_timers_armed_total", 		"Vacancy countdowns armed" },
+	{ "flow_control_timers_fired_total", 		"Vacancy countdowns expired" },
+	{ "flow_control_actions_issued_total", 		"Renderer actions issued" },
+	{ "flow_control_actions_succeeded_total", 	"Renderer actions completed successfully" },
+	{ "flow_control_actions_failed_total", 		"Renderer actions failed or not issued" },
+	{ "flow_control_actions_retried_total", 	"Renderer actions held and issued on rediscovery" },
+};
+
+static const METRIC_INFO_S gauge_info[METRIC_GAUGE_COUNT] =
+{
+	{ "flow_control_renderers", 				"Renderers in the registry" },
+	{ "flow_control_action_queue_depth", 		"Renderer actions waiting to be issued" },
+	{ "flow_control_message_queue_depth", 		"Cloud messages waiting for the next batch" },
+	{ "flow_control_outbox_depth", 				"Cloud messages waiting in the offline outbox" },
+};
+
+static const METRIC_INFO_S histogram_info[METRIC_HISTOGRAM_COUNT] =
+{
+	{ "flow_control_action_wait_ms", 			"Time renderer actions waited in the queue" },
+	{ "flow_control_sensor_setup_ms", 			"Time from observing a sensor to its first notification" },
+};
+
+static const unsigned long	bounds[METRICS_BUCKETS] = { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000 };
+
+static METRICS_SHARD_S		shards[METRICS_MAX_THREADS + 1];
+static long					gauges[METRIC_GAUGE_COUNT];
+static int					next_shard 	= 0;
+static __thread int			shard 		= -1;
+static char					socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)] = METRICS_DEFAULT_SOCKET;
+
+static METRICS_SHARD_S* own_shard(void)
+{
+	if(shard < 0)
+	{
+		shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED);
+
+		if(shard > METRICS_MAX_THREADS)
+		{
+			shard = METRICS_MAX_THREADS;
+		}
+	}
+
+	return &shards[shard];
+}
+
+void metrics_count(METRIC_COUNTER_E counter, unsigned long n)
+{
+	__atomic_fetch_add(&own_shard()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void metrics_gauge_set(METRIC_GAUGE_E gauge, long value)
+{
+	__atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(METRIC_HISTOGRAM_E histogram, unsigned long value)
+{
+	METRICS_SHARD_S*	own 	= own_shard();
+	unsigned int		bucket 	= 0;
+
+	while(bucket < METRICS_BUCKETS && value > bounds[bucket])
+	{
+		bucket++;
+	}
+
+	__atomic_fetch_add(&own->buckets[histogram][bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&own->sums[histogram], value, __ATOMIC_RELAXED);
+}
+
+static unsigned long sum_shards(const unsigned long* first)
+{
+	unsigned long	total 	= 0;
+	size_t			offset 	= (const char*)first - (const char*)&shards[0];
+	unsigned int	i;
+
+	for(i = 0; i <= METRICS_MAX_THREADS; i++)
+	{
+		total += __atomic_load_n((const unsigned long*)((const char*)&shards[i] + offset), __ATOMIC_RELAXED);
+	}
+
+	return total;
+}
+
+static int render(char* out, int size)
+{
+	int 			len = 0;
+	unsigned int	i, j;
+
+	for(i = 0; i < METRIC_COUNTER_COUNT && len < size; i++)
+	{
+		len += snprintf(out + len, size - len, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n",
+				counter_info[i].name, counter_info[i].help,
+				counter_info[i].name,
+				counter_info[i].name, sum_shards(&shards[0].counters[i]));
+	}
+
+	for(i = 0; i < METRIC_GAUGE_COUNT && len < size; i++)
+	{
+		len += snprintf(out + len, size - len, "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n",
+				gauge_info[i].name, gauge_info[i].help,
+				gauge_info[i].name,
+				gauge_info[i].name, __atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+	}
+
+	for(i = 0; i < METRIC_HISTOGRAM_COUNT && len < size; i++)
+	{
+		unsigned long cumulative = 0;
+
+		len += snprintf(out + len, size - len, "# HELP %s %s\n# TYPE %s histogram\n",
+				histogram_info[i].name, histogram_info[i].help, histogram_info[i].name);
+
+		for(j = 0; j <= METRICS_BUCKETS && len < size; j++)
+		{
+			cumulative += sum_shards(&shards[0].buckets[i][j]);
+
+			if(j < METRICS_BUCKETS)
+			{
+				len += snprintf(out + len, size - len, "%s_bucket{le=\"%lu\"} %lu\n",
+						histogram_info[i].name, bounds[j], cumulative);
+			}
+			else
+			{
+				len += snprintf(out + len, size - len, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %lu\n%s_count %lu\n",
+						histogram_info[i].name, cumulative,
+						histogram_info[i].name, sum_shards(&shards[0].sums[i]),
+						histogram_info[i].name, cumulative);
+			}
+		}
+	}
+
+	return (len < size) ? len : size - 1;
+}
+
+static void* server_func(void* data)
+{
+	static char	buffer[METRICS_BUFFER_SIZE];
+	int			fd = (int)(long)data;
+
+	while(1)
+	{
+		int 			client 	= accept(fd, NULL, NULL);
+		struct timeval	timeout = { METRICS_SEND_TIMEOUT_S, 0 };
+		int 			len;
+		int 			sent;
+
+		if(client < 0)
+		{
+			continue;
+		}
+
+		// A scraper that stops reading cannot hold this thread for long
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		// Reads race with updates by design, each value is individually consistent
+		len = render(buffer, sizeof(buffer));
+
+		for(sent = 0; sent < len; )
+		{
+			// A scraper hanging up early must not raise SIGPIPE in the gateway
+			int res = send(client, buffer + sent, len - sent, MSG_NOSIGNAL);
+
+			if(res < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if(res <= 0)
+			{
+				break;
+			}
+			sent += res;
+		}
+
+		close(client);
+	}
+
+	return NULL;
+}
+
+int metrics_configure(config_t* cfg)
+{
+	struct sockaddr_un	addr;
+	pthread_t			server_thread;
+	const char*			path 		= NULL;
+	int					enabled 	= 1;
+	int					fd;
+
+	config_lookup_bool(cfg, "metrics.enabled", &enabled);
+
+	if(!enabled)
+	{
+		return 0;
+	}
+
+	if(config_lookup_string(cfg, "metrics.socket", &path))
+	{
+		strncpy(socket_path, path, sizeof(socket_path) - 1);
+	}
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		LOG(LOG_ERR, "Metrics socket failed");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+	// The default lives on tmpfs next to the state snapshot
+	mkdir("/var/run/flow_control", 0755);
+	unlink(socket_path);
+
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0)
+	{
+		LOG(LOG_ERR, "Metrics cannot listen on %s", socket_path);
+		close(fd);
+		return -1;
+	}
+
+	pthread_create(&server_thread, NULL, server_func, (void*)(long)fd);
+
+	LOG(LOG_INFO, "Metrics on %s", socket_path);
+
+	return 1;
+}
@@ -0,0 +1,56 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <libconfig.h>
+
+// Metrics are served in Prometheus text exposition format to each client
+// connecting to a Unix socket, e.g. socat - UNIX-CONNECT:/var/run/flow_control/metrics.sock
+#define METRICS_DEFAULT_SOCKET		"/var/run/flow_control/metrics.sock"
+
+// Threads beyond this share one set of counters, still lock free but contended
+#define METRICS_MAX_THREADS			16
+
+typedef enum
+{
+	METRIC_EVENTS_RECEIVED = 0,		// Sensor notifications
+	METRIC_EVENTS_DEBOUNCED,		// Actions coalesced or superseded before reaching a renderer
+	METRIC_EVENTS_ROUTED,			// Notifications turned into renderer actions
+	METRIC_TIMERS_ARMED,
+	METRIC_TIMERS_FIRED,
+	METRIC_ACTIONS_ISSUED,
+	METRIC_ACTIONS_SUCCEEDED,
+	METRIC_ACTIONS_FAILED,
+	METRIC_ACTIONS_RETRIED,			// Held for an absent renderer and issued on its return
+	METRIC_COUNTER_COUNT
+
+} METRIC_COUNTER_E;
+
+typedef enum
+{
+	METRIC_RENDERERS = 0,
+	METRIC_ACTION_QUEUE_DEPTH,
+	METRIC_MESSAGE_QUEUE_DEPTH,
+	METRIC_OUTBOX_DEPTH,
+	METRIC_GAUGE_COUNT
+
+} METRIC_GAUGE_E;
+
+typedef enum
+{
+	METRIC_ACTION_WAIT_MS = 0,		// Enqueue to dispatch
+	METRIC_SENSOR_SETUP_MS,			// Observe issued to first notification
+	METRIC_HISTOGRAM_COUNT
+
+} METRIC_HISTOGRAM_E;
+
+// Starts the socket server unless metrics.enabled is false
+int metrics_configure(config_t* cfg);
+
+// Hot path updates, each a single relaxed atomic on the calling thread's own cache line
+void metrics_count(METRIC_COUNTER_E counter, unsigned long n);
+
+void metrics_gauge_set(METRIC_GAUGE_E gauge, long value);
+
+void metrics_observe(METRIC_HISTOGRAM_E histogram, unsigned long value);
+
+#endif	/* METRICS_H */
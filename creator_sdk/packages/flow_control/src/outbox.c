@@ -0,0 +1,627 @@
+#include "outbox.h"
+#include "metrics.h"
+#include "log.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEGMENT_FORMAT			"%s/seg-%08u.log"
+#define HEAD_FILE				"head"
+#define PATH_LEN				256
+
+// Sent records between head checkpoints; a crash re-sends at most this many
+#define HEAD_SAVE_RECORDS		16
+
+typedef struct
+{
+	uint16_t	len;
+	uint16_t	check;
+
+} RECORD_HEADER_S;
+
+static char				directory[PATH_LEN] = OUTBOX_DEFAULT_DIRECTORY;
+static unsigned int		max_segments 		= OUTBOX_DEFAULT_MAX_SEGMENTS;
+static outbox_send_cb	send_cb 			= NULL;
+
+// Segments first_seg..last_seg exist. Records before head_seg/head_off are sent,
+// appends go to the end of last_seg.
+static unsigned int		first_seg 			= 0;
+static unsigned int		last_seg 			= 0;
+static unsigned int		head_seg 			= 0;
+static off_t			head_off 			= 0;
+static off_t			tail_off 			= 0;
+static int				tail_fd 			= -1;
+static unsigned int		unsaved 			= 0;
+
+// Appends waiting for the next group commit
+static char				buffer[OUTBOX_FLUSH_BYTES];
+static size_t			buffered 			= 0;
+static unsigned int		buffered_records 	= 0;
+static struct timespec	flush_at;
+
+static struct timespec	retry_at;
+static unsigned int		backoff_s 			= 0;
+
+static OUTBOX_STATS_S	stats;
+static pthread_mutex_t	lock 				= PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	cond;
+
+static uint16_t checksum(const char* data, size_t len)
+{
+	uint16_t	sum1 = 0xff;
+	uint16_t	sum2 = 0xff;
+
+	while(len--)
+	{
+		sum1 = (sum1 + (uint8_t)*data++) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+
+	return (sum2 << 8) | sum1;
+}
+
+static void deadline_ms(struct timespec* deadline, unsigned long ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+
+	deadline->tv_sec 	+= ms / 1000;
+	deadline->tv_nsec 	+= (ms % 1000) * 1000000L;
+
+	if(deadline->tv_nsec >= 1000000000L)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+static unsigned long elapsed_us(struct timespec* since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((now.tv_sec - since->tv_sec) * 1000000L) + ((now.tv_nsec - since->tv_nsec) / 1000L);
+}
+
+static int before(struct timespec* a, struct timespec* b)
+{
+	return (a->tv_sec < b->tv_sec) || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void segment_path(char* path, unsigned int seg)
+{
+	snprintf(path, PATH_LEN, SEGMENT_FORMAT, directory, seg);
+}
+
+// Read the record at off into message. Returns its size on flash, or 0 at the
+// end of the segment or at a torn or corrupt record.
+static size_t read_record(unsigned int seg, off_t off, char* message)
+{
+	char			path[PATH_LEN];
+	RECORD_HEADER_S	header;
+	size_t			size 	= 0;
+	int				fd;
+
+	segment_path(path, seg);
+
+	if((fd = open(path, O_RDONLY)) < 0)
+	{
+		return 0;
+	}
+
+	if(pread(fd, &header, sizeof(header), off) == sizeof(header) &&
+		header.len > 0 && header.len <= OUTBOX_MAX_RECORD &&
+		pread(fd, message, header.len, off + sizeof(header)) == header.len &&
+		checksum(message, header.len) == header.check)
+	{
+		message[header.len] = '\0';
+		size = sizeof(header) + header.len;
+	}
+
+	close(fd);
+
+	return size;
+}
+
+static unsigned int count_records(unsigned int seg, off_t from, off_t* end)
+{
+	char			message[OUTBOX_MAX_RECORD + 1];
+	unsigned int	count 	= 0;
+	size_t			size;
+
+	while((size = read_record(seg, from, message)) > 0)
+	{
+		from += size;
+		count++;
+	}
+
+	if(end)
+	{
+		*end = from;
+	}
+
+	return count;
+}
+
+// Checkpoint the read position. Written beside the log and renamed into place.
+static void save_head(void)
+{
+	char	path[PATH_LEN];
+	char	tmp[PATH_LEN];
+	FILE*	file;
+
+	snprintf(path, sizeof(path), "%s/" HEAD_FILE, directory);
+	snprintf(tmp, sizeof(tmp), "%s/" HEAD_FILE ".tmp", directory);
+
+	if((file = fopen(tmp, "w")) != NULL)
+	{
+		fprintf(file, "%u %lld\n", head_seg, (long long)head_off);
+		fflush(file);
+		fdatasync(fileno(file));
+		fclose(file);
+		rename(tmp, path);
+	}
+
+	unsaved = 0;
+}
+
+static void drop_segment(unsigned int seg)
+{
+	char path[PATH_LEN];
+
+	segment_path(path, seg);
+	unlink(path);
+}
+
+static int open_tail(void)
+{
+	char path[PATH_LEN];
+
+	segment_path(path, last_seg);
+
+	tail_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+	if(tail_fd < 0)
+	{
+		LOG(LOG_ERR, "Cannot open outbox segment %s", path);
+		return -1;
+	}
+
+	tail_off = lseek(tail_fd, 0, SEEK_END);
+
+	return 0;
+}
+
+// Keep disk use bounded by dropping the oldest segment, sent or not
+static void evict(void)
+{
+	while(last_seg - first_seg + 1 > max_segments)
+	{
+		if(head_seg <= first_seg)
+		{
+			unsigned int lost = count_records(first_seg, (head_seg == first_seg) ? head_off : 0, NULL);
+
+			stats.depth 	-= lost;
+			stats.evicted 	+= lost;
+			metrics_gauge_set(METRIC_OUTBOX_DEPTH, stats.depth);
+
+			LOG(LOG_WARN, "Outbox full, evicted %u unsent messages", lost);
+		}
+
+		drop_segment(first_seg);
+		first_seg++;
+
+		if(head_seg < first_seg)
+		{
+			head_seg = first_seg;
+			head_off = 0;
+			save_head();
+		}
+	}
+}
+
+// Group commit: one write and one sync for everything buffered. Lock held.
+// On failure nothing partial stays on flash and the buffer is kept for a retry.
+static int flush(void)
+{
+	struct timespec	start;
+	size_t			written = 0;
+	unsigned long	us;
+
+	if(buffered == 0)
+	{
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if(tail_fd >= 0 && tail_off > 0 && tail_off + buffered > OUTBOX_SEGMENT_SIZE)
+	{
+		close(tail_fd);
+		tail_fd = -1;
+		last_seg++;
+		evict();
+	}
+
+	if(tail_fd < 0 && open_tail() < 0)
+	{
+		stats.flush_failures++;
+		deadline_ms(&flush_at, OUTBOX_FLUSH_INTERVAL_MS);
+		return -1;
+	}
+
+	while(written < buffered)
+	{
+		ssize_t res = write(tail_fd, buffer + written, buffered - written);
+
+		if(res < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(res <= 0)
+		{
+			LOG(LOG_ERR, "Outbox write failed");
+			break;
+		}
+		written += res;
+	}
+
+	if(written < buffered)
+	{
+		// Cut the torn record off, appends and reads would stop at it
+		if(ftruncate(tail_fd, tail_off) != 0)
+		{
+			// Otherwise leave it ending the segment, reading moves on to the next
+			LOG(LOG_ERR, "Cannot truncate outbox segment, starting a new one");
+			close(tail_fd);
+			tail_fd = -1;
+			last_seg++;
+			evict();
+		}
+
+		stats.flush_failures++;
+		deadline_ms(&flush_at, OUTBOX_FLUSH_INTERVAL_MS);
+		return -1;
+	}
+
+	fdatasync(tail_fd);
+
+	us = elapsed_us(&start);
+
+	tail_off 				+= written;
+	stats.flushes++;
+	stats.bytes_written 	+= written;
+	stats.total_flush_us 	+= us;
+
+	if(us > stats.max_flush_us)
+	{
+		stats.max_flush_us = us;
+	}
+
+	buffered 			= 0;
+	buffered_records 	= 0;
+
+	return 0;
+}
+
+// Send the oldest record on flash. Lock held, released while sending.
+static void drain_one(void)
+{
+	char			message[OUTBOX_MAX_RECORD + 1];
+	unsigned int	seg 	= head_seg;
+	off_t			off 	= head_off;
+	size_t			size 	= read_record(seg, off, message);
+	int				sent;
+
+	if(size == 0)
+	{
+		if(head_seg < last_seg)
+		{
+			// Segment fully sent, it is no longer needed
+			drop_segment(head_seg);
+			head_seg++;
+			head_off 	= 0;
+			first_seg 	= head_seg;
+			save_head();
+		}
+		else
+		{
+			// Nothing readable is left on flash, anything still counted was corrupt
+			if(stats.depth > buffered_records)
+			{
+				stats.lost += stats.depth - buffered_records;
+
+				LOG(LOG_WARN, "Outbox lost %u unreadable messages", stats.depth - buffered_records);
+			}
+
+			stats.depth = buffered_records;
+			metrics_gauge_set(METRIC_OUTBOX_DEPTH, stats.depth);
+		}
+		return;
+	}
+
+	pthread_mutex_unlock(&lock);
+	sent = send_cb(message);
+	pthread_mutex_lock(&lock);
+
+	if(!sent)
+	{
+		stats.send_failures++;
+		backoff_s = backoff_s ? backoff_s * 2 : OUTBOX_BACKOFF_MIN_S;
+		if(backoff_s > OUTBOX_BACKOFF_MAX_S)
+		{
+			backoff_s = OUTBOX_BACKOFF_MAX_S;
+		}
+		deadline_ms(&retry_at, backoff_s * 1000UL);
+		return;
+	}
+
+	stats.sent++;
+	backoff_s = 0;
+
+	// Unless the record was evicted while it was being sent
+	if(seg == head_seg && off == head_off)
+	{
+		head_off += size;
+		stats.depth--;
+		metrics_gauge_set(METRIC_OUTBOX_DEPTH, stats.depth);
+
+		if(++unsaved >= HEAD_SAVE_RECORDS || stats.depth == buffered_records)
+		{
+			save_head();
+		}
+	}
+}
+
+static void* outbox_func(void* data)
+{
+	pthread_mutex_lock(&lock);
+
+	while(1)
+	{
+		struct timespec	now;
+		struct timespec	wake;
+		int				timed = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if(buffered && !before(&now, &flush_at))
+		{
+			flush();
+		}
+
+		if(stats.depth > buffered_records && !before(&now, &retry_at))
+		{
+			drain_one();
+			continue;
+		}
+
+		if(buffered)
+		{
+			wake 	= flush_at;
+			timed 	= 1;
+		}
+
+		if(stats.depth > buffered_records && (!timed || before(&retry_at, &wake)))
+		{
+			wake 	= retry_at;
+			timed 	= 1;
+		}
+
+		if(timed)
+		{
+			pthread_cond_timedwait(&cond, &lock, &wake);
+		}
+		else
+		{
+			pthread_cond_wait(&cond, &lock);
+		}
+	}
+
+	return NULL;
+}
+
+int outbox_configure(config_t* cfg)
+{
+	const char*	value;
+	int			segments;
+
+	if(config_lookup_string(cfg, "outbox.directory", &value))
+	{
+		strncpy(directory, value, sizeof(directory) - 1);
+	}
+
+	if(config_lookup_int(cfg, "outbox.max_segments", &segments) && segments > 0)
+	{
+		max_segments = segments;
+	}
+
+	return 0;
+}
+
+int outbox_start(outbox_send_cb send)
+{
+	pthread_condattr_t	attr;
+	pthread_t			outbox_thread;
+	DIR*				dir;
+	struct dirent*		dirent;
+	FILE*				file;
+	char				path[PATH_LEN];
+	unsigned int		seg;
+	int					found 	= 0;
+	off_t				end 	= 0;
+
+	if(send_cb)
+	{
+		return 0;
+	}
+
+	mkdir(directory, 0755);
+
+	if((dir = opendir(directory)) == NULL)
+	{
+		LOG(LOG_ERR, "Cannot open outbox directory %s", directory);
+		return -1;
+	}
+
+	while((dirent = readdir(dir)) != NULL)
+	{
+		if(sscanf(dirent->d_name, "seg-%08u.log", &seg) == 1)
+		{
+			first_seg 	= (!found || seg < first_seg) ? seg : first_seg;
+			last_seg 	= (!found || seg > last_seg) ? seg : last_seg;
+			found 		= 1;
+		}
+	}
+
+	closedir(dir);
+
+	snprintf(path, sizeof(path), "%s/" HEAD_FILE, directory);
+	head_seg = first_seg;
+	head_off = 0;
+
+	if((file = fopen(path, "r")) != NULL)
+	{
+		long long off;
+
+		if(fscanf(file, "%u %lld", &seg, &off) == 2 && seg >= first_seg && seg <= last_seg)
+		{
+			head_seg = seg;
+			head_off = off;
+		}
+		fclose(file);
+	}
+
+	// Segments before the head were sent but not yet removed
+	for(; first_seg < head_seg; first_seg++)
+	{
+		drop_segment(first_seg);
+	}
+
+	for(seg = head_seg; found && seg <= last_seg; seg++)
+	{
+		stats.depth += count_records(seg, (seg == head_seg) ? head_off : 0, &end);
+	}
+
+	// Cut a record torn by power loss off the end of the log
+	segment_path(path, last_seg);
+	if(found && truncate(path, end) != 0)
+	{
+		LOG(LOG_WARN, "Cannot truncate outbox segment %s", path);
+	}
+
+	if(open_tail() < 0)
+	{
+		return -1;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	clock_gettime(CLOCK_MONOTONIC, &retry_at);
+	send_cb = send;
+
+	metrics_gauge_set(METRIC_OUTBOX_DEPTH, stats.depth);
+
+	LOG(LOG_INFO, "Outbox: %u unsent messages in %s", stats.depth, directory);
+
+	pthread_create(&outbox_thread, NULL, outbox_func, NULL);
+
+	return 0;
+}
+
+int outbox_append(const char* message)
+{
+	RECORD_HEADER_S	header;
+	size_t			len = strlen(message);
+
+	if(len == 0 || len > OUTBOX_MAX_RECORD)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	if(send_cb == NULL)
+	{
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+
+	// With flash failing and the buffer full there is nowhere to keep the message
+	if(buffered + sizeof(header) + len > sizeof(buffer) && flush() != 0)
+	{
+		stats.lost++;
+		pthread_mutex_unlock(&lock);
+
+		LOG(LOG_ERR, "Outbox full and unwritable, message lost");
+		return -1;
+	}
+
+	if(buffered_records == 0)
+	{
+		deadline_ms(&flush_at, OUTBOX_FLUSH_INTERVAL_MS);
+	}
+
+	header.len 		= len;
+	header.check 	= checksum(message, len);
+
+	memcpy(buffer + buffered, &header, sizeof(header));
+	memcpy(buffer + buffered + sizeof(header), message, len);
+
+	buffered += sizeof(header) + len;
+	buffered_records++;
+	stats.depth++;
+	stats.appended++;
+	metrics_gauge_set(METRIC_OUTBOX_DEPTH, stats.depth);
+
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+unsigned int outbox_depth(void)
+{
+	unsigned int depth;
+
+	pthread_mutex_lock(&lock);
+	depth = stats.depth;
+	pthread_mutex_unlock(&lock);
+
+	return depth;
+}
+
+void outbox_get_stats(OUTBOX_STATS_S* out)
+{
+	char			path[PATH_LEN];
+	struct stat		st;
+	unsigned int	seg;
+
+	pthread_mutex_lock(&lock);
+
+	*out 			= stats;
+	out->disk_bytes = 0;
+
+	for(seg = first_seg; send_cb && seg <= last_seg; seg++)
+	{
+		segment_path(path, seg);
+
+		if(stat(path, &st) == 0)
+		{
+			out->disk_bytes += st.st_size;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
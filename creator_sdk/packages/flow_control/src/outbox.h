@@ -0,0 +1,54 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <libconfig.h>
+
+// Persistent queue of cloud messages that could not be sent, kept as a
+// segmented log. Disk use is bounded by OUTBOX_SEGMENT_SIZE * max segments,
+// the oldest segment is evicted when a new one is needed.
+#define OUTBOX_DEFAULT_DIRECTORY		"/etc/flow_control/outbox"
+#define OUTBOX_SEGMENT_SIZE				(16 * 1024)
+#define OUTBOX_DEFAULT_MAX_SEGMENTS		8
+#define OUTBOX_MAX_RECORD				512
+
+// Appends are group-committed: one write and sync per this many buffered
+// bytes, or per interval after the first buffered append
+#define OUTBOX_FLUSH_BYTES				(4 * 1024)
+#define OUTBOX_FLUSH_INTERVAL_MS		2000
+
+// Retry backoff while sending fails
+#define OUTBOX_BACKOFF_MIN_S			2
+#define OUTBOX_BACKOFF_MAX_S			300
+
+typedef int (*outbox_send_cb)(char* message);
+
+typedef struct
+{
+	unsigned int		depth;
+	unsigned long		disk_bytes;
+	unsigned long		appended;
+	unsigned long		sent;
+	unsigned long		send_failures;
+	unsigned long		evicted;
+	unsigned long		lost;			// Unwritable, or unreadable on flash
+	unsigned long		flushes;
+	unsigned long		flush_failures;
+	unsigned long		bytes_written;
+	unsigned long long	total_flush_us;
+	unsigned long		max_flush_us;
+
+} OUTBOX_STATS_S;
+
+int outbox_configure(config_t* cfg);
+
+// Recover the log and start draining it through send
+int outbox_start(outbox_send_cb send);
+
+int outbox_append(const char* message);
+
+// Records not yet sent, buffered or on flash
+unsigned int outbox_depth(void);
+
+void outbox_get_stats(OUTBOX_STATS_S* stats);
+
+#endif	/* OUTBOX_H */
@@ -0,0 +1,200 @@
+#include "prewarm.h"
+#include "action_queue.h"
+#include "log.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct
+{
+	char			speaker[PREWARM_NAME_LEN];
+	int				adjacent[PREWARM_MAX_ADJACENT];
+	unsigned int	num_adjacent;
+	int				occupied;
+	int				warm;			// A pre-warm is outstanding
+	time_t			warmed_at;
+
+} ROOM_S;
+
+static ROOM_S			rooms[PREWARM_MAX_ROOMS];
+static unsigned int		num_rooms 	= 0;
+static int				window_s 	= PREWARM_DEFAULT_WINDOW_S;
+static PREWARM_STATS_S	stats;
+static pthread_mutex_t	lock 		= PTHREAD_MUTEX_INITIALIZER;
+
+static time_t now_s(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec;
+}
+
+static int find_room(const char* speaker)
+{
+	unsigned int i;
+
+	for(i = 0; i < num_rooms; i++)
+	{
+		if(strcmp(rooms[i].speaker, speaker) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static int add_room(const char* speaker)
+{
+	int room = find_room(speaker);
+
+	if(room < 0 && num_rooms < PREWARM_MAX_ROOMS)
+	{
+		room = num_rooms++;
+		memset(&rooms[room], 0, sizeof(ROOM_S));
+		strncpy(rooms[room].speaker, speaker, PREWARM_NAME_LEN - 1);
+	}
+
+	return room;
+}
+
+// Account for pre-warms whose window has passed. Must be called with the lock held.
+static void expire(time_t now)
+{
+	unsigned int i;
+
+	for(i = 0; i < num_rooms; i++)
+	{
+		if(rooms[i].warm && (now - rooms[i].warmed_at) >= window_s)
+		{
+			rooms[i].warm = 0;
+			stats.wasted++;
+		}
+	}
+}
+
+int prewarm_configure(config_t* cfg)
+{
+	config_setting_t*	list;
+	unsigned int		i, j;
+	int					enabled = 1;
+
+	pthread_mutex_lock(&lock);
+
+	num_rooms = 0;
+
+	list = config_lookup(cfg, "prewarm.rooms");
+
+	config_lookup_bool(cfg, "prewarm.enabled", &enabled);
+
+	if(enabled && list != NULL)
+	{
+		config_lookup_int(cfg, "prewarm.window", &window_s);
+
+		for(i = 0; i < config_setting_length(list); i++)
+		{
+			config_setting_t*	entry 		= config_setting_get_elem(list, i);
+			config_setting_t*	adjacent 	= config_setting_get_member(entry, "adjacent");
+			const char*			speaker;
+			int					room;
+
+			if(!config_setting_lookup_string(entry, "speaker", &speaker) || (room = add_room(speaker)) < 0)
+			{
+				LOG(LOG_WARN, "Ignoring pre-warm room entry %u", i);
+				continue;
+			}
+
+			for(j = 0; adjacent != NULL && j < config_setting_length(adjacent); j++)
+			{
+				int next = add_room(config_setting_get_string_elem(adjacent, j));
+
+				if(next >= 0 && next != room && rooms[room].num_adjacent < PREWARM_MAX_ADJACENT)
+				{
+					rooms[room].adjacent[rooms[room].num_adjacent++] = next;
+				}
+			}
+		}
+	}
+
+	LOG(LOG_INFO, "Pre-warm: %u rooms, window %ds", num_rooms, window_s);
+
+	pthread_mutex_unlock(&lock);
+
+	return num_rooms;
+}
+
+void prewarm_motion(char* speaker)
+{
+	time_t			now = now_s();
+	unsigned int	i;
+	int				room;
+
+	pthread_mutex_lock(&lock);
+
+	expire(now);
+
+	room = find_room(speaker);
+
+	if(room >= 0)
+	{
+		rooms[room].occupied = 1;
+
+		// Someone walked in while the renderer was still warm
+		if(rooms[room].warm)
+		{
+			rooms[room].warm = 0;
+			stats.used++;
+		}
+
+		for(i = 0; i < rooms[room].num_adjacent; i++)
+		{
+			ROOM_S* next = &rooms[rooms[room].adjacent[i]];
+
+			// Occupied rooms are playing already and warm ones need no second nudge
+			if(next->occupied || next->warm)
+			{
+				stats.skipped++;
+			}
+			else if(action_queue_get_volume(ACTION_CLASS_BACKGROUND, next->speaker))
+			{
+				next->warm 		= 1;
+				next->warmed_at = now;
+				stats.issued++;
+			}
+			else
+			{
+				stats.failed++;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+void prewarm_vacant(char* speaker)
+{
+	int room;
+
+	pthread_mutex_lock(&lock);
+
+	room = find_room(speaker);
+
+	if(room >= 0)
+	{
+		rooms[room].occupied = 0;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+void prewarm_get_stats(PREWARM_STATS_S* out)
+{
+	pthread_mutex_lock(&lock);
+
+	expire(now_s());
+	*out = stats;
+
+	pthread_mutex_unlock(&lock);
+}
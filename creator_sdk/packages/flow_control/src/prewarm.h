@@ -0,0 +1,32 @@
+#ifndef PREWARM_H
+#define PREWARM_H
+
+#include <libconfig.h>
+
+#define PREWARM_MAX_ROOMS			16
+#define PREWARM_MAX_ADJACENT		8
+#define PREWARM_NAME_LEN			64
+
+// Seconds a pre-warmed renderer is considered warm. Motion in the room within
+// this window counts the pre-warm as used, otherwise it is counted as wasted.
+#define PREWARM_DEFAULT_WINDOW_S	30
+
+typedef struct
+{
+	unsigned long	issued;
+	unsigned long	used;
+	unsigned long	wasted;
+	unsigned long	skipped;
+	unsigned long	failed;
+
+} PREWARM_STATS_S;
+
+int prewarm_configure(config_t* cfg);
+
+void prewarm_motion(char* speaker);
+
+void prewarm_vacant(char* speaker);
+
+void prewarm_get_stats(PREWARM_STATS_S* stats);
+
+#endif	/* PREWARM_H */
@@ -0,0 +1,122 @@
+#include "renderer_list.h"
+#include <pthread.h>
+#include <string.h>
+
+// The list is published RCU style. A reader announces itself in the counter
+// for the current epoch's parity before loading the list and taking a
+// reference; the writer swaps the list, flips the epoch and waits for readers
+// of the old parity to drain before dropping the old list.
+static RENDERER_LIST_S		*renderer_list 		= NULL;
+static volatile gint		list_epoch 			= 0;
+static volatile gint		list_readers[2] 	= {0, 0};
+static pthread_mutex_t		publish_lock 		= PTHREAD_MUTEX_INITIALIZER;
+
+static void renderer_list_unref(RENDERER_LIST_S* list)
+{
+	unsigned int i;
+
+	if(list && g_atomic_int_dec_and_test(&list->refs))
+	{
+		for(i = 0; i < list->count; i++)
+		{
+			g_free(list->entries[i].name);
+			g_object_unref(list->entries[i].proxy);
+		}
+
+		g_free(list);
+	}
+}
+
+RENDERER_LIST_S* renderer_list_new(unsigned int capacity)
+{
+	RENDERER_LIST_S* list = g_malloc0(sizeof(RENDERER_LIST_S) + capacity * sizeof(RENDERER_ENTRY_S));
+
+	list->refs = 1;
+
+	return list;
+}
+
+void renderer_list_add(RENDERER_LIST_S* list, char* name, gpointer proxy)
+{
+	RENDERER_ENTRY_S* entry = &list->entries[list->count++];
+
+	entry->name 	= name;
+	entry->proxy 	= g_object_ref(proxy);
+}
+
+void renderer_list_publish(RENDERER_LIST_S* list)
+{
+	RENDERER_LIST_S*	old;
+	gint				parity;
+
+	pthread_mutex_lock(&publish_lock);
+
+	old = g_atomic_pointer_get(&renderer_list);
+	g_atomic_pointer_set(&renderer_list, list);
+
+	// Readers arriving from here on announce under the new parity and see the new list
+	parity = g_atomic_int_get(&list_epoch) & 1;
+	g_atomic_int_inc(&list_epoch);
+
+	while(g_atomic_int_get(&list_readers[parity]) > 0)
+	{
+		g_thread_yield();
+	}
+
+	pthread_mutex_unlock(&publish_lock);
+
+	// Readers that got the old list hold their own reference
+	renderer_list_unref(old);
+}
+
+RENDERER_LIST_S* renderer_list_acquire(void)
+{
+	RENDERER_LIST_S*	list;
+	gint				epoch;
+	gint				parity;
+
+	// Retry if the epoch moved while announcing, the writer may not have seen us
+	while(1)
+	{
+		epoch 	= g_atomic_int_get(&list_epoch);
+		parity 	= epoch & 1;
+
+		g_atomic_int_inc(&list_readers[parity]);
+
+		if(g_atomic_int_get(&list_epoch) == epoch)
+		{
+			break;
+		}
+
+		g_atomic_int_add(&list_readers[parity], -1);
+	}
+
+	if((list = g_atomic_pointer_get(&renderer_list)) != NULL)
+	{
+		g_atomic_int_inc(&list->refs);
+	}
+
+	g_atomic_int_add(&list_readers[parity], -1);
+
+	return list;
+}
+
+void renderer_list_release(RENDERER_LIST_S* list)
+{
+	renderer_list_unref(list);
+}
+
+gpointer renderer_list_find(const RENDERER_LIST_S* list, const char* name)
+{
+	unsigned int i;
+
+	for(i = 0; list && i < list->count; i++)
+	{
+		if(strcmp(list->entries[i].name, name) == 0)
+		{
+			return list->entries[i].proxy;
+		}
+	}
+
+	return NULL;
+}
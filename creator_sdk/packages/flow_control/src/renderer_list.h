@@ -0,0 +1,40 @@
+#ifndef RENDERER_LIST_H
+#define RENDERER_LIST_H
+
+#include <glib-object.h>
+
+// Immutable view of the discovered renderers, safe to read from any thread.
+// Each proxy is referenced for as long as the list is held.
+typedef struct
+{
+	char*		name;
+	gpointer	proxy;
+
+} RENDERER_ENTRY_S;
+
+typedef struct
+{
+	volatile gint		refs;
+	unsigned int		count;
+	RENDERER_ENTRY_S	entries[];
+
+} RENDERER_LIST_S;
+
+// Writer side, one thread at a time: build a list and publish it in place of
+// the current one
+RENDERER_LIST_S* renderer_list_new(unsigned int capacity);
+
+// Takes over name, references proxy
+void renderer_list_add(RENDERER_LIST_S* list, char* name, gpointer proxy);
+
+void renderer_list_publish(RENDERER_LIST_S* list);
+
+// Current renderers, or NULL before the first publication. Lock free, pair
+// with renderer_list_release.
+RENDERER_LIST_S* renderer_list_acquire(void);
+
+void renderer_list_release(RENDERER_LIST_S* list);
+
+gpointer renderer_list_find(const RENDERER_LIST_S* list, const char* name);
+
+#endif	/* RENDERER_LIST_H */
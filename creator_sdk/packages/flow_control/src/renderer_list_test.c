@@ -0,0 +1,126 @@
+#include "renderer_list.h"
+#include <pthread.h>
+#include <stdio.h>
+
+// Readers look renderers up while the writer keeps publishing fresh lists.
+// Every proxy a reader finds must still be alive, and once the readers are
+// done every proxy of every replaced list must have been released.
+#define READERS				4
+#define RENDERERS			8
+#define ROUNDS				20000
+
+static volatile gint		alive[ROUNDS * RENDERERS];
+static volatile gint		released 	= 0;
+static volatile gint		stale 		= 0;
+static volatile gint		lookups 	= 0;
+static volatile gint		passes 		= 0;
+static volatile gint		stop 		= 0;
+static char					names[RENDERERS][16];
+
+static void proxy_released(gpointer data, GObject* where_the_object_was)
+{
+	g_atomic_int_set(&alive[GPOINTER_TO_INT(data)], 0);
+	g_atomic_int_inc(&released);
+}
+
+static void* reader_func(void* data)
+{
+	unsigned int i;
+
+	while(!g_atomic_int_get(&stop))
+	{
+		RENDERER_LIST_S* list = renderer_list_acquire();
+
+		for(i = 0; i < RENDERERS; i++)
+		{
+			gpointer proxy = renderer_list_find(list, names[i]);
+
+			if(proxy)
+			{
+				int id = GPOINTER_TO_INT(g_object_get_data(proxy, "id"));
+
+				if(!g_atomic_int_get(&alive[id]))
+				{
+					g_atomic_int_inc(&stale);
+				}
+				g_atomic_int_inc(&lookups);
+			}
+
+			// Hold the list across a writer's swap now and then
+			if(i == 0)
+			{
+				g_thread_yield();
+			}
+		}
+
+		renderer_list_release(list);
+		g_atomic_int_inc(&passes);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char** argv)
+{
+	pthread_t		readers[READERS];
+	unsigned int	round, i;
+
+	for(i = 0; i < RENDERERS; i++)
+	{
+		snprintf(names[i], sizeof(names[i]), "ewc_%u", i);
+	}
+
+	for(i = 0; i < READERS; i++)
+	{
+		pthread_create(&readers[i], NULL, reader_func, NULL);
+	}
+
+	// Readers first, they start out on an empty registry
+	while(g_atomic_int_get(&passes) < READERS)
+	{
+		g_thread_yield();
+	}
+
+	for(round = 0; round < ROUNDS; round++)
+	{
+		// Renderers come and go, so some lookups miss
+		unsigned int		count 	= 1 + (round % RENDERERS);
+		RENDERER_LIST_S*	list 	= renderer_list_new(count);
+
+		for(i = 0; i < count; i++)
+		{
+			int			id 		= (round * RENDERERS) + i;
+			GObject*	proxy 	= g_object_new(G_TYPE_OBJECT, NULL);
+
+			g_atomic_int_set(&alive[id], 1);
+			g_object_set_data(proxy, "id", GINT_TO_POINTER(id));
+			g_object_weak_ref(proxy, proxy_released, GINT_TO_POINTER(id));
+
+			renderer_list_add(list, g_strdup(names[i]), proxy);
+			g_object_unref(proxy);
+		}
+
+		renderer_list_publish(list);
+
+		// Let the readers in between swaps
+		g_thread_yield();
+	}
+
+	g_atomic_int_set(&stop, 1);
+
+	for(i = 0; i < READERS; i++)
+	{
+		pthread_join(readers[i], NULL);
+	}
+
+	// Replacing the last list leaves nothing referenced
+	renderer_list_publish(renderer_list_new(0));
+
+	printf("%d lookups, %d of a released proxy, %d of %d proxies released\n",
+			g_atomic_int_get(&lookups),
+			g_atomic_int_get(&stale),
+			g_atomic_int_get(&released),
+			ROUNDS * (RENDERERS + 1) / 2);
+
+	return (g_atomic_int_get(&stale) == 0 && g_atomic_int_get(&released) == ROUNDS * (RENDERERS + 1) / 2) ? 0 : 1;
+}
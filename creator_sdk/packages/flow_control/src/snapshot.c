@@ -0,0 +1,152 @@
+#include "snapshot.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC		0x46435353		// "FCSS"
+#define SNAPSHOT_VERSION	1
+
+// Only the entries in use follow the header
+typedef struct
+{
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	num_sensors;
+	uint16_t	num_renderers;
+	uint16_t	reserved;
+	int64_t		written;		// Wall clock, monotonic time does not survive the process
+	uint32_t	check;
+
+} SNAPSHOT_HEADER_S;
+
+static uint32_t checksum(const void* data, size_t len, uint32_t sum)
+{
+	const uint8_t* bytes = data;
+
+	while(len--)
+	{
+		sum = (sum << 5) + sum + *bytes++;
+	}
+
+	return sum;
+}
+
+static uint32_t body_checksum(const SNAPSHOT_S* snapshot)
+{
+	uint32_t sum = 5381;
+
+	sum = checksum(snapshot->sensors, snapshot->num_sensors * sizeof(SNAPSHOT_SENSOR_S), sum);
+	sum = checksum(snapshot->renderers, snapshot->num_renderers * sizeof(SNAPSHOT_RENDERER_S), sum);
+
+	return sum;
+}
+
+int snapshot_write(const SNAPSHOT_S* snapshot)
+{
+	SNAPSHOT_HEADER_S	header;
+	FILE*				file;
+	int					ok;
+
+	if(snapshot->num_sensors > SNAPSHOT_MAX_SENSORS || snapshot->num_renderers > SNAPSHOT_MAX_RENDERERS)
+	{
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic 			= SNAPSHOT_MAGIC;
+	header.version 			= SNAPSHOT_VERSION;
+	header.num_sensors 		= snapshot->num_sensors;
+	header.num_renderers 	= snapshot->num_renderers;
+	header.written 			= time(NULL);
+	header.check 			= body_checksum(snapshot);
+
+	mkdir(SNAPSHOT_DIR, 0755);
+
+	if((file = fopen(SNAPSHOT_FILE ".tmp", "wb")) == NULL)
+	{
+		return -1;
+	}
+
+	ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(snapshot->sensors, sizeof(SNAPSHOT_SENSOR_S), snapshot->num_sensors, file) == snapshot->num_sensors &&
+		fwrite(snapshot->renderers, sizeof(SNAPSHOT_RENDERER_S), snapshot->num_renderers, file) == snapshot->num_renderers;
+
+	// Replace the previous snapshot only once this one is complete
+	if(fclose(file) != 0 || !ok || rename(SNAPSHOT_FILE ".tmp", SNAPSHOT_FILE) != 0)
+	{
+		unlink(SNAPSHOT_FILE ".tmp");
+		return -1;
+	}
+
+	return 0;
+}
+
+int snapshot_read(SNAPSHOT_S* snapshot)
+{
+	SNAPSHOT_HEADER_S	header;
+	FILE*				file;
+	long				down;
+	unsigned int		i;
+	int					ok;
+
+	if((file = fopen(SNAPSHOT_FILE, "rb")) == NULL)
+	{
+		return -1;
+	}
+
+	memset(snapshot, 0, sizeof(SNAPSHOT_S));
+
+	ok = fread(&header, sizeof(header), 1, file) == 1 &&
+		header.magic == SNAPSHOT_MAGIC &&
+		header.version == SNAPSHOT_VERSION &&
+		header.num_sensors <= SNAPSHOT_MAX_SENSORS &&
+		header.num_renderers <= SNAPSHOT_MAX_RENDERERS &&
+		fread(snapshot->sensors, sizeof(SNAPSHOT_SENSOR_S), header.num_sensors, file) == header.num_sensors &&
+		fread(snapshot->renderers, sizeof(SNAPSHOT_RENDERER_S), header.num_renderers, file) == header.num_renderers;
+
+	fclose(file);
+
+	snapshot->num_sensors 	= ok ? header.num_sensors : 0;
+	snapshot->num_renderers = ok ? header.num_renderers : 0;
+
+	if(!ok || body_checksum(snapshot) != header.check)
+	{
+		LOG(LOG_WARN, "Ignoring invalid state snapshot");
+		return -1;
+	}
+
+	down = (long)(time(NULL) - header.written);
+
+	if(down < 0 || down > SNAPSHOT_MAX_AGE_S)
+	{
+		LOG(LOG_INFO, "Ignoring state snapshot from %lds ago", down);
+		return -1;
+	}
+
+	for(i = 0; i < snapshot->num_sensors; i++)
+	{
+		SNAPSHOT_SENSOR_S* sensor = &snapshot->sensors[i];
+
+		sensor->client_id[SNAPSHOT_NAME_LEN - 1] = '\0';
+
+		if(sensor->remaining_s != SNAPSHOT_TIMER_STOPPED)
+		{
+			sensor->remaining_s = (sensor->remaining_s > down) ? sensor->remaining_s - down : 0;
+		}
+	}
+
+	for(i = 0; i < snapshot->num_renderers; i++)
+	{
+		snapshot->renderers[i].name[SNAPSHOT_NAME_LEN - 1] = '\0';
+	}
+
+	LOG(LOG_INFO, "Restored state snapshot from %lds ago: %u sensors, %u renderers",
+			down,
+			snapshot->num_sensors,
+			snapshot->num_renderers);
+
+	return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+// Runtime state kept across a restart of the process, not across a reboot,
+// so it lives on tmpfs and periodic writes cost no flash wear
+#define SNAPSHOT_DIR				"/var/run/flow_control"
+#define SNAPSHOT_FILE				SNAPSHOT_DIR "/state.bin"
+#define SNAPSHOT_MAX_SENSORS		64
+#define SNAPSHOT_MAX_RENDERERS		16
+#define SNAPSHOT_NAME_LEN			64
+#define SNAPSHOT_INTERVAL_S			5
+
+// A snapshot older than this describes a house that has moved on
+#define SNAPSHOT_MAX_AGE_S			600
+
+#define SNAPSHOT_TIMER_STOPPED		-1
+
+typedef struct
+{
+	char		client_id[SNAPSHOT_NAME_LEN];
+	uint16_t	object_id;
+	uint16_t	instance_id;
+	uint8_t		observed;
+	uint8_t		occupied;
+	int32_t		remaining_s;		// Vacancy countdown, or SNAPSHOT_TIMER_STOPPED
+
+} SNAPSHOT_SENSOR_S;
+
+typedef struct
+{
+	char		name[SNAPSHOT_NAME_LEN];
+	uint8_t		muted;
+
+} SNAPSHOT_RENDERER_S;
+
+typedef struct
+{
+	uint16_t				num_sensors;
+	uint16_t				num_renderers;
+	SNAPSHOT_SENSOR_S		sensors[SNAPSHOT_MAX_SENSORS];
+	SNAPSHOT_RENDERER_S		renderers[SNAPSHOT_MAX_RENDERERS];
+
+} SNAPSHOT_S;
+
+int snapshot_write(const SNAPSHOT_S* snapshot);
+
+// Countdowns come back reduced by the time the process was down
+int snapshot_read(SNAPSHOT_S* snapshot);
+
+#endif	/* SNAPSHOT_H */
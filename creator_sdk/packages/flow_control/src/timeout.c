@@ -1,10 +1,14 @@
 #include "timeout.h"
+#include "metrics.h"
+#include "trace.h"
 #include <pthread.h>
 
 void timeout_reset(TIMEOUT_S* stimeout)
 {
 	stimeout->b_elapsed = 0;
 	clock_gettime(CLOCK_MONOTONIC, &stimeout->start);
+	metrics_count(METRIC_TIMERS_ARMED, 1);
+	TRACE_TIMER_ARM(stimeout, stimeout->sec_timeout);
 }
 
 int compare(TIMEOUT_S* stimeout)
@@ -19,6 +23,12 @@ int compare(TIMEOUT_S* stimeout)
 		{
 			stimeout->b_elapsed = 1;
 			res =  1;
+			metrics_count(METRIC_TIMERS_FIRED, 1);
+
+			// The vacancy actions issued from the callback carry a new correlation ID
+			trace_set_current(trace_new_id());
+			TRACE_TIMER_FIRE(stimeout, trace_current());
+
 			stimeout->elapsed_cb(stimeout);
 		}
 	}
@@ -40,8 +50,44 @@ void timeout_init_and_run(TIMEOUT_S* pstimeout)
 	pthread_t timeout_check_thread;
 	
 	pstimeout->b_elapsed = 0;
+	metrics_count(METRIC_TIMERS_ARMED, 1);
+	TRACE_TIMER_ARM(pstimeout, pstimeout->sec_timeout);
 	
 	pthread_create( &timeout_check_thread, NULL, ((void *)check_func), pstimeout);
 }
 
+// Carry on a countdown with the given seconds left, or stay stopped if negative
+void timeout_init_and_resume(TIMEOUT_S* pstimeout, int remaining)
+{
+	pthread_t timeout_check_thread;
+	
+	clock_gettime(CLOCK_MONOTONIC, &pstimeout->start);
+	
+	pstimeout->start.tv_sec -= pstimeout->sec_timeout - remaining;
+	pstimeout->b_elapsed 	= (remaining < 0);
+	
+	if(!pstimeout->b_elapsed)
+	{
+		metrics_count(METRIC_TIMERS_ARMED, 1);
+		TRACE_TIMER_ARM(pstimeout, remaining);
+	}
+	
+	pthread_create( &timeout_check_thread, NULL, ((void *)check_func), pstimeout);
+}
 
+int timeout_remaining(TIMEOUT_S* stimeout)
+{
+	struct timespec now;
+	int				remaining;
+	
+	if(stimeout->b_elapsed)
+	{
+		return -1;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	remaining = stimeout->sec_timeout - (now.tv_sec - stimeout->start.tv_sec);
+	
+	return (remaining > 0) ? remaining : 0;
+}
@@ -15,3 +15,7 @@ typedef struct
 void timeout_init_and_run(TIMEOUT_S* pstimeout);
 
 void timeout_reset(TIMEOUT_S* stimeout);
+
+void timeout_init_and_resume(TIMEOUT_S* pstimeout, int remaining);
+
+int timeout_remaining(TIMEOUT_S* stimeout);
@@ -0,0 +1,24 @@
+#include "trace.h"
+
+// Only built with FLOW_CONTROL_TRACE, see CMakeLists.txt
+#ifdef FLOW_CONTROL_TRACE
+
+static unsigned long			next_id = 0;
+static __thread unsigned long	current = 0;
+
+unsigned long trace_new_id(void)
+{
+	return __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+}
+
+void trace_set_current(unsigned long id)
+{
+	current = id;
+}
+
+unsigned long trace_current(void)
+{
+	return current;
+}
+
+#endif	/* FLOW_CONTROL_TRACE */
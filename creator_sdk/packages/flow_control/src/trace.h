@@ -0,0 +1,55 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Static tracepoints along the motion to speaker path, to rebuild per-event
+// latency with perf, bpftrace or LTTng, e.g.
+//   bpftrace -l 'usdt:/usr/bin/flow_control:*'
+// Configure with -DFLOW_CONTROL_TRACE=ON to build them in, which needs
+// sys/sdt.h. Built in, each probe is a nop until a tracer attaches; otherwise
+// they compile to nothing.
+//
+// A correlation ID follows an event from the sensor notification or timer
+// that caused it to the renderer actions it issues. It is carried per thread
+// and handed across the action queue with each action.
+
+#ifdef FLOW_CONTROL_TRACE
+
+#include <sys/sdt.h>
+
+unsigned long trace_new_id(void);
+
+void trace_set_current(unsigned long id);
+
+unsigned long trace_current(void);
+
+#define TRACE_OBSERVE_ENTER(sensor, id)			DTRACE_PROBE2(flow_control, observe_enter, sensor, id)
+#define TRACE_OBSERVE_EXIT(sensor, id, state)	DTRACE_PROBE3(flow_control, observe_exit, sensor, id, state)
+#define TRACE_TIMER_ARM(timer, seconds)			DTRACE_PROBE2(flow_control, timer_arm, timer, seconds)
+#define TRACE_TIMER_FIRE(timer, id)				DTRACE_PROBE2(flow_control, timer_fire, timer, id)
+#define TRACE_ACTION_BEGIN(udn, action, id)		DTRACE_PROBE3(flow_control, action_begin, udn, action, id)
+#define TRACE_ACTION_END(udn, id, success)		DTRACE_PROBE3(flow_control, action_end, udn, id, success)
+#define TRACE_REGISTRY_ADD(udn, entry)			DTRACE_PROBE2(flow_control, registry_add, udn, entry)
+#define TRACE_REGISTRY_REMOVE(udn, entry)		DTRACE_PROBE2(flow_control, registry_remove, udn, entry)
+#define TRACE_CLOUD_SEND_BEGIN(length)			DTRACE_PROBE1(flow_control, cloud_send_begin, length)
+#define TRACE_CLOUD_SEND_END(length, success)	DTRACE_PROBE2(flow_control, cloud_send_end, length, success)
+
+#else
+
+#define trace_new_id()							0UL
+#define trace_set_current(id)					((void)0)
+#define trace_current()							0UL
+
+#define TRACE_OBSERVE_ENTER(sensor, id)			((void)0)
+#define TRACE_OBSERVE_EXIT(sensor, id, state)	((void)0)
+#define TRACE_TIMER_ARM(timer, seconds)			((void)0)
+#define TRACE_TIMER_FIRE(timer, id)				((void)0)
+#define TRACE_ACTION_BEGIN(udn, action, id)		((void)0)
+#define TRACE_ACTION_END(udn, id, success)		((void)0)
+#define TRACE_REGISTRY_ADD(udn, entry)			((void)0)
+#define TRACE_REGISTRY_REMOVE(udn, entry)		((void)0)
+#define TRACE_CLOUD_SEND_BEGIN(length)			((void)0)
+#define TRACE_CLOUD_SEND_END(length, success)	((void)0)
+
+#endif	/* FLOW_CONTROL_TRACE */
+
+#endif	/* TRACE_H */
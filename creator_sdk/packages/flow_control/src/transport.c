@@ -0,0 +1,566 @@
+#include "transport.h"
+#include "trace.h"
+#include "browse_cache.h"
+#include "log.h"
+#include <string.h>
+
+#define AV_TRANSPORT 		"urn:schemas-upnp-org:service:AVTransport"
+
+#define DEFAULT_MIME_TYPE	"audio/mpeg"
+#define MUSIC_TRACK_CLASS	"object.item.audioItem.musicTrack"
+
+typedef struct
+{
+	char				speaker[TRANSPORT_NAME_LEN];
+	char*				uri;			// Fixed URI, or the current track of a playlist zone
+	char*				server;			// Playlist zones play through a media server container
+	char*				container;
+	unsigned int		position;
+	char*				title;
+	char*				mime;
+	const char*			metadata;		// Owned by the metadata cache
+	GUPnPServiceProxy*	av_transport;
+	TRANSPORT_STATE_E	state;
+	int					armed;
+	struct TRANSPORT_CTX_S*	arming;		// SetAVTransportURI in flight
+
+} ZONE_S;
+
+typedef struct TRANSPORT_CTX_S
+{
+	control_point_action_cb	cb;
+	void*					user_data;
+	ZONE_S*					zone;
+	const char*				action;
+	int						play;			// Start playback once the URI has landed
+	unsigned long			trace_id;
+
+} TRANSPORT_CTX_S;
+
+static ZONE_S					zones[TRANSPORT_MAX_ZONES];
+static unsigned int				num_zones 		= 0;
+static GUPnPLastChangeParser*	last_change 	= NULL;
+
+// DIDL-Lite metadata per URI, built or validated once and reused for every re-arm
+static GHashTable*				metadata_cache 	= NULL;
+
+static const struct
+{
+	const char*			name;
+	TRANSPORT_STATE_E	state;
+
+} transport_states[] =
+{
+	{ "NO_MEDIA_PRESENT",	TRANSPORT_STATE_NO_MEDIA },
+	{ "STOPPED",			TRANSPORT_STATE_STOPPED },
+	{ "PAUSED_PLAYBACK",	TRANSPORT_STATE_PAUSED },
+	{ "TRANSITIONING",		TRANSPORT_STATE_TRANSITIONING },
+	{ "PLAYING",			TRANSPORT_STATE_PLAYING },
+};
+
+static ZONE_S* find_zone(const char* speaker)
+{
+	unsigned int i;
+
+	for(i = 0; i < num_zones; i++)
+	{
+		if(strcmp(zones[i].speaker, speaker) == 0)
+		{
+			return &zones[i];
+		}
+	}
+
+	return NULL;
+}
+
+static TRANSPORT_STATE_E parse_state(const char* name)
+{
+	unsigned int i;
+
+	for(i = 0; i < sizeof(transport_states) / sizeof(transport_states[0]); i++)
+	{
+		if(strcmp(transport_states[i].name, name) == 0)
+		{
+			return transport_states[i].state;
+		}
+	}
+
+	return TRANSPORT_STATE_UNKNOWN;
+}
+
+static void
+didl_item_available_cb (GUPnPDIDLLiteParser *parser,
+                        GUPnPDIDLLiteObject *item,
+                        gpointer             user_data)
+{
+	char** title = user_data;
+
+	if(*title == NULL)
+	{
+		*title = g_strdup(gupnp_didl_lite_object_get_title(item));
+	}
+}
+
+static char* build_metadata(const char* title, const char* uri, GUPnPProtocolInfo* info)
+{
+	GUPnPDIDLLiteWriter		*writer;
+	GUPnPDIDLLiteObject		*item;
+	GUPnPDIDLLiteResource	*res;
+	char					*metadata;
+
+	writer 	= gupnp_didl_lite_writer_new(NULL);
+	item 	= GUPNP_DIDL_LITE_OBJECT(gupnp_didl_lite_writer_add_item(writer));
+
+	gupnp_didl_lite_object_set_id(item, "0");
+	gupnp_didl_lite_object_set_parent_id(item, "-1");
+	gupnp_didl_lite_object_set_restricted(item, TRUE);
+	gupnp_didl_lite_object_set_title(item, title);
+	gupnp_didl_lite_object_set_upnp_class(item, MUSIC_TRACK_CLASS);
+
+	res = gupnp_didl_lite_object_add_resource(item);
+	gupnp_didl_lite_resource_set_uri(res, uri);
+	gupnp_didl_lite_resource_set_protocol_info(res, info);
+
+	metadata = gupnp_didl_lite_writer_get_string(writer);
+
+	g_object_unref(res);
+	g_object_unref(item);
+	g_object_unref(writer);
+
+	return metadata;
+}
+
+// Look up or create the metadata for a zone's URI. Supplied metadata is parsed
+// once to validate it; anything unusable is replaced by generated metadata.
+static const char* get_metadata(ZONE_S* zone, const char* supplied)
+{
+	char* metadata = g_hash_table_lookup(metadata_cache, zone->uri);
+
+	if(metadata == NULL)
+	{
+		if(supplied != NULL)
+		{
+			GUPnPDIDLLiteParser	*parser = gupnp_didl_lite_parser_new();
+			char				*title 	= NULL;
+			GError				*error 	= NULL;
+
+			g_signal_connect(parser, "item-available", G_CALLBACK(didl_item_available_cb), &title);
+
+			if(gupnp_didl_lite_parser_parse_didl(parser, supplied, &error) && title != NULL)
+			{
+				LOG(LOG_INFO, "%s: armed with \"%s\"", zone->speaker, title);
+				metadata = g_strdup(supplied);
+			}
+			else
+			{
+				LOG(LOG_WARN, "%s: unusable DIDL-Lite metadata (%s), generating it",
+						zone->speaker,
+						error ? error->message : "no item");
+			}
+
+			if(error)
+			{
+				g_error_free(error);
+			}
+
+			g_free(title);
+			g_object_unref(parser);
+		}
+
+		if(metadata == NULL)
+		{
+			GUPnPProtocolInfo* info = gupnp_protocol_info_new();
+
+			gupnp_protocol_info_set_protocol(info, "http-get");
+			gupnp_protocol_info_set_network(info, "*");
+			gupnp_protocol_info_set_mime_type(info, zone->mime ? zone->mime : DEFAULT_MIME_TYPE);
+
+			metadata = build_metadata(zone->title ? zone->title : zone->speaker, zone->uri, info);
+
+			g_object_unref(info);
+		}
+
+		g_hash_table_insert(metadata_cache, g_strdup(zone->uri), metadata);
+	}
+
+	return metadata;
+}
+
+static void container_loaded_cb(const char* server, const char* container);
+
+int transport_configure(config_t* cfg)
+{
+	config_setting_t*	list = config_lookup(cfg, "transport.zones");
+	unsigned int		i;
+
+	if(metadata_cache == NULL)
+	{
+		metadata_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	}
+
+	for(i = 0; list != NULL && i < config_setting_length(list) && num_zones < TRANSPORT_MAX_ZONES; i++)
+	{
+		config_setting_t*	entry 		= config_setting_get_elem(list, i);
+		ZONE_S*				zone 		= &zones[num_zones];
+		const char			*speaker, *uri, *server, *container, *value;
+		const char*			metadata 	= NULL;
+		int					playlist;
+
+		playlist = config_setting_lookup_string(entry, "server", &server) &&
+					config_setting_lookup_string(entry, "container", &container);
+
+		if(!config_setting_lookup_string(entry, "speaker", &speaker) ||
+			(!playlist && !config_setting_lookup_string(entry, "uri", &uri)))
+		{
+			LOG(LOG_WARN, "Ignoring transport zone entry %u", i);
+			continue;
+		}
+
+		memset(zone, 0, sizeof(ZONE_S));
+		strncpy(zone->speaker, speaker, TRANSPORT_NAME_LEN - 1);
+
+		if(playlist)
+		{
+			// Tracks and their metadata come from the browse cache when arming
+			zone->server 	= g_strdup(server);
+			zone->container = g_strdup(container);
+			num_zones++;
+			continue;
+		}
+
+		zone->uri = g_strdup(uri);
+
+		if(config_setting_lookup_string(entry, "title", &value))
+		{
+			zone->title = g_strdup(value);
+		}
+
+		if(config_setting_lookup_string(entry, "mime", &value))
+		{
+			zone->mime = g_strdup(value);
+		}
+
+		config_setting_lookup_string(entry, "metadata", &metadata);
+
+		zone->metadata = get_metadata(zone, metadata);
+		num_zones++;
+	}
+
+	browse_cache_set_loaded_cb(container_loaded_cb);
+
+	LOG(LOG_INFO, "Transport: %u zones", num_zones);
+
+	return num_zones;
+}
+
+static void arm(ZONE_S* zone);
+static void begin_play(ZONE_S* zone, control_point_action_cb cb, void* user_data);
+
+static void
+transport_action_cb (GUPnPServiceProxy       *av_transport,
+                     GUPnPServiceProxyAction *action,
+                     gpointer                 user_data)
+{
+	TRANSPORT_CTX_S	*ctx 		= user_data;
+	ZONE_S			*zone 		= ctx->zone;
+	GError			*error 		= NULL;
+	int				success 	= 1;
+	int				arming 		= (strcmp(ctx->action, "SetAVTransportURI") == 0);
+
+	if (!gupnp_service_proxy_end_action (av_transport, action, &error, NULL))
+	{
+		g_warning ("Transport Action Failed: %s: %s: %s", zone->speaker, ctx->action, error->message);
+		g_error_free (error);
+		success = 0;
+
+		// Arming failed, try again on the next idle transition
+		if(arming && zone->av_transport == av_transport)
+		{
+			zone->armed = 0;
+		}
+	}
+
+	TRACE_ACTION_END(gupnp_service_info_get_udn(GUPNP_SERVICE_INFO(av_transport)), ctx->trace_id, success);
+
+	if(arming && zone->arming == ctx)
+	{
+		zone->arming = NULL;
+
+		// The renderer came back while this was in flight on its old proxy
+		if(zone->av_transport && zone->av_transport != av_transport &&
+			zone->state == TRANSPORT_STATE_NO_MEDIA)
+		{
+			arm(zone);
+		}
+	}
+
+	// Play only once the renderer has the URI, before that it may refuse with 701
+	if(ctx->play && success && zone->av_transport == av_transport)
+	{
+		begin_play(zone, ctx->cb, ctx->user_data);
+	}
+	else if(ctx->cb)
+	{
+		ctx->cb(success && !ctx->play, ctx->user_data);
+	}
+
+	g_free(ctx);
+
+	g_object_unref (av_transport);
+}
+
+static TRANSPORT_CTX_S* transport_ctx_new(ZONE_S* zone, const char* action, control_point_action_cb cb, void* user_data)
+{
+	TRANSPORT_CTX_S* ctx = g_new0(TRANSPORT_CTX_S, 1);
+
+	ctx->zone 		= zone;
+	ctx->action 	= action;
+	ctx->cb 		= cb;
+	ctx->user_data 	= user_data;
+	ctx->trace_id 	= trace_current();
+
+	TRACE_ACTION_BEGIN(gupnp_service_info_get_udn(GUPNP_SERVICE_INFO(zone->av_transport)), action, ctx->trace_id);
+
+	// Unreffing a proxy cancels its pending actions without a callback, keep it until ours has run
+	g_object_ref(zone->av_transport);
+
+	return ctx;
+}
+
+// Pick the playlist zone's current track. A local lookup once the container
+// is cached; otherwise arming is retried when the container has loaded.
+static int select_track(ZONE_S* zone)
+{
+	const BROWSE_ITEM_S*	item = browse_cache_select(zone->server, zone->container, zone->position);
+	GUPnPProtocolInfo*		info;
+
+	if(item == NULL)
+	{
+		return 0;
+	}
+
+	if(g_strcmp0(zone->uri, item->uri) != 0)
+	{
+		g_free(zone->uri);
+		zone->uri = g_strdup(item->uri);
+	}
+
+	zone->metadata = g_hash_table_lookup(metadata_cache, zone->uri);
+
+	if(zone->metadata == NULL && (info = gupnp_protocol_info_new_from_string(item->protocol_info, NULL)) != NULL)
+	{
+		char* metadata = build_metadata(item->title, item->uri, info);
+
+		g_hash_table_insert(metadata_cache, g_strdup(zone->uri), metadata);
+		zone->metadata = metadata;
+		g_object_unref(info);
+	}
+
+	return zone->metadata != NULL;
+}
+
+// Load the zone's URI while the renderer is idle so motion only needs Play
+static void arm(ZONE_S* zone)
+{
+	if(zone->av_transport && !zone->armed && zone->arming == NULL &&
+		(zone->container == NULL || select_track(zone)))
+	{
+		zone->armed 	= 1;
+		zone->arming 	= transport_ctx_new(zone, "SetAVTransportURI", NULL, NULL);
+
+		gupnp_service_proxy_begin_action (zone->av_transport,
+								"SetAVTransportURI",
+								transport_action_cb,
+								zone->arming,
+								"InstanceID",
+								G_TYPE_UINT,
+								0,
+								"CurrentURI",
+								G_TYPE_STRING,
+								zone->uri,
+								"CurrentURIMetaData",
+								G_TYPE_STRING,
+								zone->metadata,
+								NULL);
+	}
+}
+
+static void begin_play(ZONE_S* zone, control_point_action_cb cb, void* user_data)
+{
+	gupnp_service_proxy_begin_action (zone->av_transport,
+							"Play",
+							transport_action_cb,
+							transport_ctx_new(zone, "Play", cb, user_data),
+							"InstanceID",
+							G_TYPE_UINT,
+							0,
+							"Speed",
+							G_TYPE_STRING,
+							"1",
+							NULL);
+}
+
+static void
+last_change_cb (GUPnPServiceProxy *av_transport,
+                const char        *variable,
+                GValue            *value,
+                gpointer           user_data)
+{
+	ZONE_S	*zone 	= user_data;
+	char	*state 	= NULL;
+	char	*uri 	= NULL;
+	GError	*error 	= NULL;
+
+	if(!gupnp_last_change_parser_parse_last_change (last_change,
+													0,
+													g_value_get_string(value),
+													&error,
+													"TransportState",
+													G_TYPE_STRING,
+													&state,
+													"AVTransportURI",
+													G_TYPE_STRING,
+													&uri,
+													NULL))
+	{
+		g_warning ("LastChange parse failed: %s: %s", zone->speaker, error->message);
+		g_error_free (error);
+		return;
+	}
+
+	// Someone else loaded media, leave it alone and re-arm when it is gone
+	if(uri)
+	{
+		zone->armed = (g_strcmp0(uri, zone->uri) == 0);
+	}
+
+	if(state)
+	{
+		TRANSPORT_STATE_E previous = zone->state;
+
+		zone->state = parse_state(state);
+
+		// A playlist track ran out, queue the next one while the room is idle
+		if(zone->container && zone->armed && previous == TRANSPORT_STATE_PLAYING &&
+			zone->state == TRANSPORT_STATE_STOPPED)
+		{
+			zone->position++;
+			zone->armed = 0;
+			arm(zone);
+		}
+	}
+
+	if(zone->state == TRANSPORT_STATE_NO_MEDIA || (uri && uri[0] == '\0'))
+	{
+		zone->armed = 0;
+		arm(zone);
+	}
+
+	g_free(state);
+	g_free(uri);
+}
+
+static void container_loaded_cb(const char* server, const char* container)
+{
+	unsigned int i;
+
+	for(i = 0; i < num_zones; i++)
+	{
+		if(zones[i].container && strcmp(zones[i].server, server) == 0 &&
+			strcmp(zones[i].container, container) == 0 && !zones[i].armed &&
+			zones[i].state != TRANSPORT_STATE_PLAYING)
+		{
+			arm(&zones[i]);
+		}
+	}
+}
+
+void transport_device_available(GUPnPDeviceProxy* proxy)
+{
+	char*	name = control_point_get_device_name(proxy);
+	ZONE_S*	zone = find_zone(name);
+
+	if(zone && zone->av_transport == NULL)
+	{
+		zone->av_transport = GUPNP_SERVICE_PROXY(gupnp_device_info_get_service(GUPNP_DEVICE_INFO(proxy), AV_TRANSPORT));
+
+		if(zone->av_transport)
+		{
+			if(last_change == NULL)
+			{
+				last_change = gupnp_last_change_parser_new();
+			}
+
+			zone->state = TRANSPORT_STATE_UNKNOWN;
+			zone->armed = 0;
+
+			// The initial event reports the current state and URI, arming follows from it
+			gupnp_service_proxy_add_notify (zone->av_transport,
+											"LastChange",
+											G_TYPE_STRING,
+											last_change_cb,
+											zone);
+			gupnp_service_proxy_set_subscribed (zone->av_transport, TRUE);
+		}
+	}
+
+	g_free(name);
+}
+
+void transport_device_unavailable(GUPnPDeviceProxy* proxy)
+{
+	char*	name = control_point_get_device_name(proxy);
+	ZONE_S*	zone = find_zone(name);
+
+	if(zone && zone->av_transport)
+	{
+		g_object_unref(zone->av_transport);
+		zone->av_transport 	= NULL;
+		zone->state 		= TRANSPORT_STATE_UNKNOWN;
+		zone->armed 		= 0;
+		// An arming in flight still completes, through its own reference, and clears itself
+	}
+
+	g_free(name);
+}
+
+int transport_begin_start(char* device, control_point_action_cb cb, void* user_data)
+{
+	ZONE_S* zone = find_zone(device);
+
+	// Playing, or not a managed zone: unmuting is all that is needed
+	if(zone == NULL || zone->av_transport == NULL || zone->state == TRANSPORT_STATE_PLAYING
+		|| zone->state == TRANSPORT_STATE_TRANSITIONING)
+	{
+		return control_point_begin_set_mute(device, 0, cb, user_data);
+	}
+
+	if(!zone->armed)
+	{
+		arm(zone);
+	}
+
+	// A start already waits on the URI, this one only needs the unmute
+	if(zone->arming && zone->arming->play)
+	{
+		return control_point_begin_set_mute(device, 0, cb, user_data);
+	}
+
+	// Stopped or paused, lift the vacancy mute and start the armed URI
+	if(!control_point_begin_set_mute(device, 0, NULL, NULL))
+	{
+		return 0;
+	}
+
+	if(zone->arming)
+	{
+		// Play follows from the URI's completion
+		zone->arming->play 		= 1;
+		zone->arming->cb 		= cb;
+		zone->arming->user_data = user_data;
+		return 1;
+	}
+
+	begin_play(zone, cb, user_data);
+	return 1;
+}
@@ -0,0 +1,29 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <libconfig.h>
+#include "control_point.h"
+
+#define TRANSPORT_MAX_ZONES		16
+#define TRANSPORT_NAME_LEN		64
+
+typedef enum
+{
+	TRANSPORT_STATE_UNKNOWN = 0,
+	TRANSPORT_STATE_NO_MEDIA,
+	TRANSPORT_STATE_STOPPED,
+	TRANSPORT_STATE_PAUSED,
+	TRANSPORT_STATE_TRANSITIONING,
+	TRANSPORT_STATE_PLAYING
+
+} TRANSPORT_STATE_E;
+
+int transport_configure(config_t* cfg);
+
+void transport_device_available(GUPnPDeviceProxy* proxy);
+
+void transport_device_unavailable(GUPnPDeviceProxy* proxy);
+
+int transport_begin_start(char* device, control_point_action_cb cb, void* user_data);
+
+#endif	/* TRANSPORT_H */